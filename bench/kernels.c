@@ -0,0 +1,416 @@
+// Microbenchmarks of the hot functions of the tree code.
+//
+// The simulation sources are included directly, so the benchmarked functions
+// (including the static ones) are exactly those of the simulator, compiled
+// with the same flags.
+//
+// Usage: kernels [-n PARTICLES] [-d uniform|disk|clustered] [-r REPEATS]
+//                [-c CPU] [-k KERNEL]
+
+// Required for `sched_setaffinity`.
+#define _GNU_SOURCE
+
+#include "../src/phys.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <getopt.h>
+#include <sched.h>
+#include <time.h>
+
+// The configuration of a benchmark run.
+static struct {
+	size_t particles;
+	const char *dist;
+	unsigned repeats;
+	int cpu;
+	const char *kernel;
+} bench = { 100000, "uniform", 5, -1, NULL };
+
+// The inputs shared by all kernels.
+static struct particle *particles;
+static unsigned *coords;
+static uint64_t *keys;
+static struct arena arena, packed;
+static struct particle_tree tree = { .root = ARENA_NULL, .arena = &arena };
+// The relative error of the packed walk's forces against the full precision
+// ones.
+static double packed_rms, packed_max;
+
+// The result of a single kernel execution.
+struct sample {
+	double ns;
+	size_t ops;
+	size_t bytes;
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// Prevents the compiler from discarding a computed value.
+static volatile uint64_t sink;
+
+static struct sample
+kernel_morton(void)
+{
+	const size_t n = bench.particles;
+	const double start = now();
+	for (size_t i = 0; i < n; i++)
+		keys[i] = morton_number(coords[3 * i], coords[3 * i + 1],
+			coords[3 * i + 2]);
+	const double ns = now() - start;
+
+	sink = keys[n / 2];
+	return (struct sample) { ns, n, 3 * sizeof(unsigned) + sizeof(uint64_t) };
+}
+
+static struct sample
+kernel_hilbert(void)
+{
+	const size_t n = bench.particles;
+	const double start = now();
+	for (size_t i = 0; i < n; i++)
+		keys[i] = hilbert_number(coords[3 * i], coords[3 * i + 1],
+			coords[3 * i + 2]);
+	const double ns = now() - start;
+
+	sink = keys[n / 2];
+	return (struct sample) { ns, n, 3 * sizeof(unsigned) + sizeof(uint64_t) };
+}
+
+static struct sample
+kernel_insert(void)
+{
+	const double start = now();
+	if (particle_tree_insert(&tree, particles, bench.particles,
+			options.radius)) {
+		fprintf(stderr, "Failed to build tree: out of arena memory\n");
+		exit(ENOMEM);
+	}
+	const double ns = now() - start;
+
+	// Each insertion reads the particle and all octants it allocates.
+	const size_t bytes = sizeof(struct point_mass)
+		+ (size_t)arena.curr * sizeof(struct octant) / bench.particles;
+	return (struct sample) { ns, bench.particles, bytes };
+}
+
+static struct sample
+kernel_center(void)
+{
+	const double start = now();
+	particle_tree_center(&tree);
+	const double ns = now() - start;
+
+	return (struct sample) { ns, arena.curr, sizeof(struct octant) };
+}
+
+static struct sample
+kernel_gforce(void)
+{
+	// All pairs of a block small enough to stay within the L1/L2 cache, so
+	// the arithmetic rather than memory bandwidth is measured.
+	const size_t m = (bench.particles < 2048) ? bench.particles : 2048;
+
+	struct vec3 sum	   = zero_vec;
+	const double start = now();
+	for (size_t i = 0; i < m; i++)
+		for (size_t j = 0; j < m; j++) {
+			const struct vec3 f = gforce(&particles[i].part, &particles[j].part);
+			vec3_addassign(&sum, &f);
+		}
+	const double ns = now() - start;
+
+	sink = (uint64_t)(sum.x + sum.y + sum.z);
+	return (struct sample) { ns, m * m, sizeof(struct point_mass) };
+}
+
+// Counts the octants visited by `octant_update_force` for the given particle.
+static size_t
+count_visits(const struct octant *oct, const struct point_mass *part)
+{
+	if (octant_is_leaf(oct)
+		|| oct->len / vec3_dist(&part->pos, &oct->center.pos) < tree.theta)
+		return 1;
+
+	size_t visits = 1;
+	for (unsigned c = 0; c < OTREE_CHILDREN; c++)
+		if (oct->children[c] != ARENA_NULL)
+			visits += count_visits(arena_get(&arena, oct->children[c]), part);
+	return visits;
+}
+
+static struct sample
+kernel_walk(void)
+{
+	// A strided subset keeps the run time independent of the tree size.
+	const size_t n		= (bench.particles < 4096) ? bench.particles : 4096;
+	const size_t stride = bench.particles / n;
+	const struct octant *root = arena_get(&arena, tree.root);
+
+	struct vec3 sum	   = zero_vec;
+	const double start = now();
+	for (size_t i = 0; i < n; i++) {
+		struct vec3 force = zero_vec;
+		octant_update_force(&tree, root, &particles[i * stride].part, &force);
+		vec3_addassign(&sum, &force);
+	}
+	const double ns = now() - start;
+	sink			= (uint64_t)(sum.x + sum.y + sum.z);
+
+	size_t visits = 0;
+	for (size_t i = 0; i < n; i++)
+		visits += count_visits(root, &particles[i * stride].part);
+
+	return (struct sample) { ns, n, visits * sizeof(struct octant) / n };
+}
+
+// Counts the packed octants visited by `packed_update_force` for the given
+// particle.
+static size_t
+count_packed(const struct packed_octant *node, struct vec3 corner, float len,
+	const struct point_mass *part)
+{
+	const float scale	   = len / PACKED_POS_MAX;
+	const struct vec3 pos = { corner.x + node->pos[0] * scale,
+		corner.y + node->pos[1] * scale, corner.z + node->pos[2] * scale };
+	if (len / vec3_dist(&part->pos, &pos) < tree.theta)
+		return 1;
+
+	size_t visits					  = 1;
+	const float sub_len				  = len / 2.0;
+	const struct packed_octant *child = arena_get(&packed, node->first);
+	for (unsigned c = 0; c < OTREE_CHILDREN; c++) {
+		if (!(node->children & (1u << c)))
+			continue;
+
+		const struct vec3 sub = {
+			(c & 1) ? corner.x + sub_len : corner.x,
+			(c & 2) ? corner.y + sub_len : corner.y,
+			(c & 4) ? corner.z + sub_len : corner.z,
+		};
+		visits += (node->leaves & (1u << c))
+			? 1
+			: count_packed(child, sub, sub_len, part);
+		child++;
+	}
+	return visits;
+}
+
+static struct sample
+kernel_packed(void)
+{
+	const size_t n		= (bench.particles < 4096) ? bench.particles : 4096;
+	const size_t stride = bench.particles / n;
+	const struct octant *root = arena_get(&arena, tree.root);
+
+	// The packing is part of each tree build, but not of the walk.
+	tree.packed = &packed;
+	if (particle_tree_pack(&tree)) {
+		fprintf(stderr, "Failed to pack tree: out of arena memory\n");
+		exit(ENOMEM);
+	}
+
+	struct vec3 sum	   = zero_vec;
+	const double start = now();
+	for (size_t i = 0; i < n; i++) {
+		const struct vec3 force
+			= particle_tree_force(&tree, &particles[i * stride].part);
+		vec3_addassign(&sum, &force);
+	}
+	const double ns = now() - start;
+	sink			= (uint64_t)(sum.x + sum.y + sum.z);
+
+	size_t visits = 0;
+	const struct vec3 corner = { root->x, root->y, root->z };
+	double sum_sq			 = 0.0;
+	packed_max				 = 0.0;
+	for (size_t i = 0; i < n; i++) {
+		const struct point_mass *part = &particles[i * stride].part;
+		visits += count_packed(arena_get(&packed, 0), corner, root->len, part);
+
+		const struct vec3 approx = particle_tree_force(&tree, part);
+		struct vec3 exact		 = zero_vec;
+		octant_update_force(&tree, root, part, &exact);
+
+		const double norm = sqrt(vec3_dist_sq(&zero_vec, &exact));
+		const double err  = (norm > 0.0)
+			 ? sqrt(vec3_dist_sq(&approx, &exact)) / norm
+			 : 0.0;
+		sum_sq += err * err;
+		if (err > packed_max)
+			packed_max = err;
+	}
+	packed_rms	= sqrt(sum_sq / (double)n);
+	tree.packed = NULL;
+
+	return (struct sample) { ns, n,
+		visits * sizeof(struct packed_octant) / n };
+}
+
+// The benchmarked kernels, in dependency order (`center`, `walk` and `packed`
+// operate on the tree built by `insert`, the walks on its centers of mass).
+static const struct {
+	const char *name;
+	struct sample (*run)(void);
+} kernels[] = {
+	{ "morton", kernel_morton },
+	{ "hilbert", kernel_hilbert },
+	{ "insert", kernel_insert },
+	{ "center", kernel_center },
+	{ "gforce", kernel_gforce },
+	{ "walk", kernel_walk },
+	{ "packed", kernel_packed },
+};
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	const double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static int
+parse_args(int argc, char *argv[argc])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "n:d:r:c:k:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			bench.particles = strtoull(optarg, NULL, 10);
+			break;
+		case 'd':
+			bench.dist = optarg;
+			break;
+		case 'r':
+			bench.repeats = (unsigned)strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			bench.cpu = atoi(optarg);
+			break;
+		case 'k':
+			bench.kernel = optarg;
+			break;
+		default:
+			fprintf(stderr,
+				"Usage: %s [-n PARTICLES] [-d uniform|disk|clustered] "
+				"[-r REPEATS] [-c CPU] [-k KERNEL]\n",
+				argv[0]);
+			return EINVAL;
+		}
+	}
+
+	if (bench.particles < 2 || bench.repeats == 0)
+		return EINVAL;
+
+	if (!strcmp(bench.dist, "disk"))
+		options.flat = true;
+	else if (!strcmp(bench.dist, "clustered"))
+		options.clusters = 16;
+	else if (strcmp(bench.dist, "uniform")) {
+		fprintf(stderr, "Unknown distribution %s\n", bench.dist);
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[argc])
+{
+	int res;
+	if ((res = parse_args(argc, argv)))
+		return res;
+
+	if (bench.cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(bench.cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set)) {
+			fprintf(stderr, "Failed to pin to CPU %d: %s\n", bench.cpu,
+				strerror(errno));
+			return errno;
+		}
+	}
+
+	options.particles = bench.particles;
+	options.seed	  = 42;
+	tree.theta		  = options.theta;
+
+	// The arena is sized generously, so even clustered inputs fit.
+	if ((res = arena_init(&arena, 64 * sizeof(struct octant) * bench.particles,
+			 sizeof(struct octant))))
+		return res;
+	if ((res = arena_init(&packed,
+			 64 * sizeof(struct packed_octant) * bench.particles,
+			 sizeof(struct packed_octant))))
+		return res;
+
+	particles = malloc(sizeof(struct particle) * bench.particles);
+	coords	  = malloc(3 * sizeof(unsigned) * bench.particles);
+	keys	  = malloc(sizeof(uint64_t) * bench.particles);
+	if (particles == NULL || coords == NULL || keys == NULL)
+		return ENOMEM;
+
+	randomize_particles(particles, 0, bench.particles, &options, NULL);
+	// Integer coordinates as used for sorting by Z-curve order, but shifted into
+	// the positive range so that all bits of the key are exercised.
+	for (size_t i = 0; i < bench.particles; i++) {
+		const struct vec3 *v = &particles[i].part.pos;
+		coords[3 * i]		 = (unsigned)(v->x + options.radius);
+		coords[3 * i + 1]	 = (unsigned)(v->y + options.radius);
+		coords[3 * i + 2]	 = (unsigned)(v->z + options.radius);
+	}
+
+	printf("%zu particles (%s), %u repeats, CPU %d\n", bench.particles,
+		bench.dist, bench.repeats, bench.cpu);
+	printf("%-8s %12s %12s %12s %10s %10s\n", "kernel", "ops", "ns/op",
+		"min ns/op", "bytes/op", "GB/s");
+
+	double *ns = malloc(sizeof(double) * bench.repeats);
+	if (ns == NULL)
+		return ENOMEM;
+
+	for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+		// The tree kernels depend on `insert` and `center`, which therefore
+		// always run.
+		const bool selected
+			= bench.kernel == NULL || !strcmp(bench.kernel, kernels[k].name);
+		if (!selected && strcmp(kernels[k].name, "insert")
+			&& strcmp(kernels[k].name, "center"))
+			continue;
+
+		struct sample sample;
+		for (unsigned r = 0; r < bench.repeats; r++) {
+			sample = kernels[k].run();
+			ns[r]  = sample.ns / (double)sample.ops;
+		}
+		if (!selected)
+			continue;
+
+		qsort(ns, bench.repeats, sizeof(double), cmp_double);
+		const double median = ns[bench.repeats / 2];
+		printf("%-8s %12zu %12.3f %12.3f %10zu %10.2f\n", kernels[k].name,
+			sample.ops, median, ns[0], sample.bytes,
+			(double)sample.bytes / median);
+	}
+
+	if (bench.kernel == NULL || !strcmp(bench.kernel, "packed"))
+		printf("packed walk error: %.3g rms, %.3g max (relative to the full "
+			   "precision walk)\n",
+			packed_rms, packed_max);
+
+	free(ns);
+	free(keys);
+	free(coords);
+	free(particles);
+	arena_deinit(&packed);
+	arena_deinit(&arena);
+	return 0;
+}
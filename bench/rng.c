@@ -0,0 +1,163 @@
+// Benchmarks the random number generators available for particle generation.
+//
+// Compares `random()`, the reference (scalar, one value per call) MT19937-64,
+// the single value API `mt1993764_int64()` and the block API
+// `mt1993764_fill()`, and checks that all MT19937-64 variants yield the same
+// sequence.
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+
+#include "barnes-hut/mt19937_64.h"
+
+#define NN 312
+#define MM 156
+#define MATRIX_A 0xB5026F5AA96619E9ULL
+#define UM 0xFFFFFFFF80000000ULL
+#define LM 0x7FFFFFFFULL
+
+// The reference implementation (Nishimura and Matsumoto, 2004/9/29).
+static unsigned long long ref_mt[NN];
+static int ref_mti = NN + 1;
+
+static void
+ref_init(unsigned long long seed)
+{
+	ref_mt[0] = seed;
+	for (ref_mti = 1; ref_mti < NN; ref_mti++)
+		ref_mt[ref_mti] = (6364136223846793005ULL
+				* (ref_mt[ref_mti - 1] ^ (ref_mt[ref_mti - 1] >> 62))
+			+ ref_mti);
+}
+
+static unsigned long long
+ref_int64(void)
+{
+	static unsigned long long mag01[2] = { 0ULL, MATRIX_A };
+	unsigned long long x;
+	int i;
+
+	if (ref_mti >= NN) {
+		if (ref_mti == NN + 1)
+			ref_init(5489ULL);
+
+		for (i = 0; i < NN - MM; i++) {
+			x		  = (ref_mt[i] & UM) | (ref_mt[i + 1] & LM);
+			ref_mt[i] = ref_mt[i + MM] ^ (x >> 1) ^ mag01[(int)(x & 1ULL)];
+		}
+		for (; i < NN - 1; i++) {
+			x		  = (ref_mt[i] & UM) | (ref_mt[i + 1] & LM);
+			ref_mt[i] = ref_mt[i + (MM - NN)] ^ (x >> 1)
+				^ mag01[(int)(x & 1ULL)];
+		}
+		x			   = (ref_mt[NN - 1] & UM) | (ref_mt[0] & LM);
+		ref_mt[NN - 1] = ref_mt[MM - 1] ^ (x >> 1) ^ mag01[(int)(x & 1ULL)];
+
+		ref_mti = 0;
+	}
+
+	x = ref_mt[ref_mti++];
+	x ^= (x >> 29) & 0x5555555555555555ULL;
+	x ^= (x << 17) & 0x71D67FFFEDA60000ULL;
+	x ^= (x << 37) & 0xFFF7EEE000000000ULL;
+	x ^= (x >> 43);
+
+	return x;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void
+report(const char *name, size_t n, double secs, unsigned long long sink)
+{
+	printf("%-24s %8.3f ns/value %10.1f Mvalues/s (checksum %016llx)\n", name,
+		secs * 1e9 / (double)n, (double)n / secs * 1e-6, sink);
+}
+
+int
+main(int argc, char *argv[argc])
+{
+	const size_t n	   = (argc > 1) ? strtoull(argv[1], NULL, 10) : 100000000;
+	const size_t block = 4096;
+	unsigned long long sink;
+	double start;
+
+	unsigned long long *buf = malloc(sizeof(unsigned long long) * block);
+	if (buf == NULL)
+		return 1;
+
+	// Verify the sequences first.
+	struct mt19937_64 state;
+	ref_init(5489ULL);
+	mt1993764_init(5489ULL);
+	mt1993764_init_state(&state, 5489ULL);
+	for (size_t i = 0; i < 10 * NN; i += 1000) {
+		mt1993764_fill(&state, buf, 1000);
+		for (size_t j = 0; j < 1000; j++) {
+			const unsigned long long ref = ref_int64();
+			if (mt1993764_int64() != ref || buf[j] != ref) {
+				fprintf(stderr, "sequence mismatch at %zu\n", i + j);
+				return 1;
+			}
+		}
+	}
+
+	printf("generating %zu values per generator\n", n);
+
+	srandom(5489);
+	sink  = 0;
+	start = now();
+	for (size_t i = 0; i < n; i++)
+		sink ^= (unsigned long long)random();
+	report("random()", n, now() - start, sink);
+
+	ref_init(5489ULL);
+	sink  = 0;
+	start = now();
+	for (size_t i = 0; i < n; i++)
+		sink ^= ref_int64();
+	report("reference mt19937-64", n, now() - start, sink);
+
+	mt1993764_init(5489ULL);
+	sink  = 0;
+	start = now();
+	for (size_t i = 0; i < n; i++)
+		sink ^= mt1993764_int64();
+	report("mt1993764_int64()", n, now() - start, sink);
+
+	mt1993764_init_state(&state, 5489ULL);
+	sink  = 0;
+	start = now();
+	for (size_t i = 0; i < n; i += block) {
+		const size_t len = (n - i < block) ? n - i : block;
+		mt1993764_fill(&state, buf, len);
+		for (size_t j = 0; j < len; j++)
+			sink ^= buf[j];
+	}
+	report("mt1993764_fill()", n, now() - start, sink);
+
+	mt1993764_init_state(&state, 5489ULL);
+	start = now();
+	if (mt1993764_jump(&state))
+		return 1;
+	printf("%-24s %8.3f ms (incl. polynomial setup)\n", "mt1993764_jump()",
+		(now() - start) * 1e3);
+	start = now();
+	if (mt1993764_jump(&state))
+		return 1;
+	printf("%-24s %8.3f ms\n", "mt1993764_jump()", (now() - start) * 1e3);
+
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,226 @@
+#!/usr/bin/env python3
+"""Runs the reproducible benchmark suite (`make bench`).
+
+Every scenario is simulated with a fixed seed across sweeps of the particle
+count, the thread count and theta, each configuration being repeated several
+times. The results are written as JSON with the median step times, the
+strong-scaling (fixed N) and weak-scaling (fixed N per thread) efficiencies
+and, for binaries built with `STATS=1`, the median interactions per second.
+
+With `--baseline`, the median step times are compared against a previously
+saved result and configurations slower by more than `--threshold` are
+reported as regressions (exiting with status 1).
+"""
+
+import argparse
+import csv
+import io
+import json
+import os
+import platform
+import statistics
+import subprocess
+import sys
+
+# The initial conditions, as extra simulator arguments.
+SCENARIOS = {
+    "sphere": [],
+    "disk": ["--flat"],
+    "clustered": ["--clusters=16"],
+}
+
+
+def int_list(arg):
+    return [int(v) for v in arg.split(",") if v]
+
+
+def float_list(arg):
+    return [float(v) for v in arg.split(",") if v]
+
+
+def run(args, scenario, particles, threads, theta):
+    """Runs the simulator once and returns the per-step CSV rows."""
+    cmd = [
+        args.binary,
+        f"--steps={args.steps}",
+        f"--num={particles}",
+        f"--threads={threads}",
+        f"--theta={theta}",
+        f"--seed={args.seed}",
+    ] + SCENARIOS[scenario]
+    if args.pin:
+        cmd.append(f"--pin={args.pin}")
+
+    res = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                         text=True, check=False)
+    if res.returncode != 0:
+        raise RuntimeError(f"{' '.join(cmd)} failed: {res.stderr.strip()}")
+
+    return list(csv.DictReader(io.StringIO(res.stdout)))
+
+
+def measure(args, scenario, particles, threads, theta):
+    """Returns the medians over all repetitions of a configuration."""
+    step_ms, build_ms, ips = [], [], []
+    for _ in range(args.repeats):
+        rows = run(args, scenario, particles, threads, theta)
+        # The first step includes page faults of freshly allocated memory.
+        rows = rows[1:] if len(rows) > 1 else rows
+        build = [int(r["build"]) * 1e-3 for r in rows]
+        simulate = [int(r["simulate"]) * 1e-3 for r in rows]
+        step_ms.append(statistics.mean(b + s for b, s in zip(build, simulate)))
+        build_ms.append(statistics.mean(build))
+        if rows and "interactions_per_s" in rows[0]:
+            ips.append(statistics.mean(
+                float(r["interactions_per_s"]) for r in rows))
+
+    result = {
+        "scenario": scenario,
+        "particles": particles,
+        "threads": threads,
+        "theta": theta,
+        "step_ms": statistics.median(step_ms),
+        "build_ms": statistics.median(build_ms),
+        "step_ms_runs": step_ms,
+    }
+    if ips:
+        result["interactions_per_s"] = statistics.median(ips)
+    return result
+
+
+def key(result):
+    return (result["scenario"], result["particles"], result["threads"],
+            result["theta"])
+
+
+def efficiencies(results):
+    """Adds the strong-scaling efficiency relative to a single thread."""
+    by_key = {key(r): r for r in results}
+    for r in results:
+        base = by_key.get((r["scenario"], r["particles"], 1, r["theta"]))
+        if base is not None:
+            r["strong_efficiency"] = base["step_ms"] / (
+                r["threads"] * r["step_ms"])
+
+
+def compare(results, baseline, threshold):
+    """Returns the configurations slower than in the baseline."""
+    by_key = {key(r): r for r in baseline.get("results", [])}
+    by_key.update({("weak",) + key(r): r for r in baseline.get("weak", [])})
+
+    regressions = []
+    for section, entries in (("results", results["results"]),
+                             ("weak", results["weak"])):
+        for r in entries:
+            k = key(r) if section == "results" else ("weak",) + key(r)
+            base = by_key.get(k)
+            if base is None:
+                continue
+            change = r["step_ms"] / base["step_ms"] - 1.0
+            r["baseline_step_ms"] = base["step_ms"]
+            r["change"] = change
+            if change > threshold:
+                regressions.append(r)
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--binary", default="./barnes-hut")
+    parser.add_argument("--scenarios", default=",".join(SCENARIOS))
+    parser.add_argument("--sizes", type=int_list, default=[10000, 30000],
+                        help="particle counts for the strong-scaling sweep")
+    parser.add_argument("--threads", type=int_list, default=None,
+                        help="thread counts (default: 1, 2, 4, ... up to "
+                             "the number of CPUs)")
+    parser.add_argument("--thetas", type=float_list, default=[0.3, 0.6])
+    parser.add_argument("--weak-size", type=int, default=10000,
+                        help="particles per thread for the weak-scaling sweep "
+                             "(0 to disable)")
+    parser.add_argument("--steps", type=int, default=4)
+    parser.add_argument("--repeats", type=int, default=3)
+    parser.add_argument("--seed", type=int, default=42)
+    parser.add_argument("--pin", default=None,
+                        help="thread placement policy passed to --pin")
+    parser.add_argument("--output", default="bench-results.json")
+    parser.add_argument("--baseline", default=None,
+                        help="a previous result to compare against")
+    parser.add_argument("--threshold", type=float, default=0.10,
+                        help="relative slowdown reported as regression")
+    args = parser.parse_args()
+
+    if args.threads is None:
+        cpus = os.cpu_count() or 1
+        args.threads = [1]
+        while args.threads[-1] * 2 <= cpus:
+            args.threads.append(args.threads[-1] * 2)
+    scenarios = [s for s in args.scenarios.split(",") if s]
+    for s in scenarios:
+        if s not in SCENARIOS:
+            parser.error(f"unknown scenario {s} "
+                         f"(available: {', '.join(SCENARIOS)})")
+
+    results, weak = [], []
+    for scenario in scenarios:
+        for theta in args.thetas:
+            for particles in args.sizes:
+                for threads in args.threads:
+                    r = measure(args, scenario, particles, threads, theta)
+                    results.append(r)
+                    print(f"{scenario:>10} n={particles:<8} p={threads:<3} "
+                          f"theta={theta:<5} {r['step_ms']:10.3f} ms/step",
+                          file=sys.stderr)
+
+            if args.weak_size <= 0:
+                continue
+            for threads in args.threads:
+                r = measure(args, scenario, args.weak_size * threads, threads,
+                            theta)
+                weak.append(r)
+                print(f"{scenario:>10} n={r['particles']:<8} p={threads:<3} "
+                      f"theta={theta:<5} {r['step_ms']:10.3f} ms/step (weak)",
+                      file=sys.stderr)
+
+    efficiencies(results)
+    for r in weak:
+        base = next((w for w in weak if w["scenario"] == r["scenario"]
+                     and w["theta"] == r["theta"] and w["threads"] == 1),
+                    None)
+        if base is not None:
+            r["weak_efficiency"] = base["step_ms"] / r["step_ms"]
+
+    output = {
+        "host": platform.node(),
+        "cpus": os.cpu_count(),
+        "binary": args.binary,
+        "steps": args.steps,
+        "repeats": args.repeats,
+        "seed": args.seed,
+        "results": results,
+        "weak": weak,
+    }
+
+    status = 0
+    if args.baseline:
+        with open(args.baseline, encoding="utf-8") as f:
+            baseline = json.load(f)
+        regressions = compare(output, baseline, args.threshold)
+        output["regressions"] = len(regressions)
+        for r in regressions:
+            print(f"REGRESSION {r['scenario']} n={r['particles']} "
+                  f"p={r['threads']} theta={r['theta']}: "
+                  f"{r['baseline_step_ms']:.3f} -> {r['step_ms']:.3f} ms/step "
+                  f"(+{r['change'] * 100:.1f}%)", file=sys.stderr)
+        if regressions:
+            status = 1
+
+    with open(args.output, "w", encoding="utf-8") as f:
+        json.dump(output, f, indent=2)
+        f.write("\n")
+    print(f"wrote {args.output}", file=sys.stderr)
+
+    return status
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,29 @@
+#ifndef BARNES_HUT_AFFINITY_H
+#define BARNES_HUT_AFFINITY_H
+
+// The thread placement policies.
+enum pin_policy {
+	// Threads are not pinned and may be migrated freely by the kernel.
+	PIN_NONE = 0,
+	// Threads fill all hardware threads of one core before the next one.
+	PIN_COMPACT,
+	// Threads are spread across packages and cores before sharing a core.
+	PIN_SCATTER,
+	// Threads are placed on the first hardware thread of each core only.
+	PIN_PHYSICAL,
+	// Threads are placed on an explicit list of CPUs.
+	PIN_LIST,
+};
+
+// Parses a pin policy string (`compact`, `scatter`, `physical` or a CPU list
+// such as `0,2,4-7`).
+int affinity_parse(const char *arg, enum pin_policy *policy);
+// Reads the CPU topology from sysfs and computes the placement for all threads
+// according to the given policy.
+int affinity_init(enum pin_policy policy, const char *list);
+// Releases the computed placement.
+void affinity_deinit(void);
+// Pins the calling thread to the CPU assigned to the thread with the given ID.
+int affinity_pin(unsigned id);
+
+#endif // BARNES_HUT_AFFINITY_H
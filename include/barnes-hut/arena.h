@@ -6,9 +6,17 @@
 
 #include "barnes-hut/common.h"
 
+#ifdef LARGE
+// Items are addressed by 64-bit indices (only with `LARGE`), which lifts the
+// limit of ~4G items at the cost of twice the size of stored references.
+#define ARENA_NULL (arena_item_t) UINT64_MAX
+
+typedef uint64_t arena_item_t;
+#else
 #define ARENA_NULL (arena_item_t) UINT32_MAX
 
 typedef uint32_t arena_item_t;
+#endif // LARGE
 
 struct arena {
 	size_t size;
@@ -18,8 +26,6 @@ struct arena {
 	void *memory;
 };
 
-extern struct arena arena;
-
 static inline void
 arena_reset(struct arena *arena)
 {
@@ -45,6 +51,10 @@ arena_get(struct arena *arena, arena_item_t item)
 	return (void *)addr;
 }
 
+// Reserves `size` bytes of address space for items of `item_size` bytes, which
+// are only backed by memory once touched.
+//
+// Returns `EOVERFLOW` if the items can not be addressed by `arena_item_t`.
 int arena_init(struct arena *arena, size_t size, size_t item_size);
 void arena_deinit(struct arena *arena);
 
@@ -0,0 +1,19 @@
+#ifndef BARNES_HUT_AUTOTUNE_H
+#define BARNES_HUT_AUTOTUNE_H
+
+#include "barnes-hut/phys.h"
+
+// Chooses the fastest thread count, theta, sort interval and tree packing for
+// the simulation of `options`, whose RMS relative force error stays within
+// `options.autotune`, and stores them in the global options.
+//
+// The opening angle is chosen from the forces of a single tree against direct
+// summation, the other settings by a few trial steps each. The trials start
+// from the given particles (e.g., a restored checkpoint, which is not
+// modified) or randomize their own ones (NULL).
+//
+// With `options.autotune_cache`, the choices are looked up by machine,
+// particle count and error bound before tuning, and appended after it.
+int autotune(const struct particle particles[]);
+
+#endif // BARNES_HUT_AUTOTUNE_H
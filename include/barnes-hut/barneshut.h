@@ -0,0 +1,56 @@
+#ifndef BARNES_HUT_BARNESHUT_H
+#define BARNES_HUT_BARNESHUT_H
+
+#include <stddef.h>
+
+// The embeddable interface of `libbarneshut`.
+//
+// A context is created with the default options, configured, optionally
+// loaded with particles and then advanced step by step. All calls return 0 or
+// an errno value and must not be made concurrently on the same context.
+
+#define BH_API __attribute__((visibility("default")))
+
+// A simulation and the threads computing it.
+struct bh_sim;
+
+// Creates a context with the default options.
+BH_API int bh_create(struct bh_sim **ctx);
+// Sets the option `name` (the long option of the command line, e.g. `theta`,
+// `threads` or `flat`) to the given value (NULL for flags).
+//
+// Options must be set before the first step. Options writing files or shared
+// memory and the thread placement are only available to the command line.
+// Different contexts may be configured from different threads at once.
+BH_API int bh_configure(struct bh_sim *ctx, const char *name,
+	const char *value);
+// Copies the given particles into the context, replacing the randomly
+// generated ones, and sets the particle count to `len`.
+//
+// `pos` and `vel` hold three coordinates per particle, `vel` (zero) and
+// `mass` (the `mass` option) may be NULL. Particles must be loaded before the
+// first step.
+BH_API int bh_load_particles(struct bh_sim *ctx, size_t len, const float *pos,
+	const float *vel, const float *mass);
+// Computes the next step on the calling and all configured threads.
+//
+// Once a step failed, the context can only be destroyed.
+BH_API int bh_step(struct bh_sim *ctx);
+// Returns the position of the first particle, which is followed by those of
+// all others `stride` floats apart (x, y and z each), and stores the particle
+// count in `len`.
+//
+// The positions are the context's own memory, which is valid and not modified
+// until the next step. Before the first step, NULL is returned unless
+// particles were loaded.
+BH_API const float *bh_positions(const struct bh_sim *ctx, size_t *len,
+	size_t *stride);
+// Returns the velocities like `bh_positions`.
+BH_API const float *bh_velocities(const struct bh_sim *ctx, size_t *len,
+	size_t *stride);
+// Returns the number of completed steps.
+BH_API unsigned bh_steps(const struct bh_sim *ctx);
+// Stops all threads and releases the context.
+BH_API void bh_destroy(struct bh_sim *ctx);
+
+#endif // BARNES_HUT_BARNESHUT_H
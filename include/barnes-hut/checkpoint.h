@@ -0,0 +1,58 @@
+#ifndef BARNES_HUT_CHECKPOINT_H
+#define BARNES_HUT_CHECKPOINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "barnes-hut/phys.h"
+
+#define CHECKPOINT_MAGIC "BHCKPT"
+#define CHECKPOINT_VERSION 1
+
+// The on-disk header of a checkpoint file.
+//
+// The header is padded to a full page and followed immediately by the raw
+// (native layout) particle array, so that a restored file can be mapped and
+// used as particle buffer directly.
+struct checkpoint_header {
+	// The file magic (`CHECKPOINT_MAGIC`, zero padded).
+	char magic[8];
+	// The file format version.
+	uint32_t version;
+	// The size of a single particle (checked for layout compatibility).
+	uint32_t particle_size;
+	// The file offset of the particle array.
+	uint64_t offset;
+	// The number of stored particles.
+	uint64_t particles;
+	// The next simulation step to compute.
+	uint32_t step;
+	// The particle space radius for the next simulation step.
+	float radius;
+	// The options the simulation was started with.
+	float max_mass;
+	float theta;
+	float dt;
+	uint32_t seed;
+	uint32_t flags;
+};
+
+#define CHECKPOINT_FLAT (1 << 0)
+#define CHECKPOINT_OPTIMIZE (1 << 1)
+
+// Writes the particles and simulation state to the given path.
+//
+// The file is written under a temporary name and renamed on completion, so an
+// interrupted checkpoint never replaces a previous (complete) one.
+int checkpoint_write(const char *path, const struct particle particles[],
+	unsigned step, float radius);
+// Maps the checkpoint at the given path and returns its particle array.
+//
+// The mapping is private, so particle updates never modify the file. The
+// stored options are restored into the global options.
+int checkpoint_restore(const char *path, struct particle **particles,
+	unsigned *step, float *radius);
+// Unmaps the particle array returned by `checkpoint_restore`.
+void checkpoint_unmap(void);
+
+#endif // BARNES_HUT_CHECKPOINT_H
@@ -5,6 +5,18 @@
 #define unlikely(cond) __builtin_expect(!!(cond), 0)
 #define aligned(align) __attribute__((aligned((align))))
 #define printf_like __attribute__((format(printf, 1, 2)))
+#define forceinline inline __attribute__((always_inline))
+
+// Fat builds (`FAT=1`) compile the annotated hot kernels once per x86-64
+// level, the best one supported by the CPU is selected at startup. Functions
+// they call are only compiled for the level of each clone if `forceinline`.
+#if defined(FAT) && defined(__x86_64__)
+#define multiversioned                                                         \
+	__attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3",          \
+		"arch=x86-64-v2", "default")))
+#else
+#define multiversioned
+#endif // FAT && __x86_64__
 
 enum error {
 	BHE_EARLY_EXIT = -1,
@@ -0,0 +1,37 @@
+#ifndef BARNES_HUT_DIAGNOSTICS_H
+#define BARNES_HUT_DIAGNOSTICS_H
+
+#include "barnes-hut/direct.h"
+#include "barnes-hut/phys.h"
+
+// The conserved quantities of a set of particles.
+//
+// All sums are accumulated in double precision, as the contributions of
+// millions of particles would otherwise be lost to rounding.
+struct diagnostics {
+	// The kinetic energy.
+	double kinetic;
+	// The potential energy (each pair counted once).
+	double potential;
+	// The linear momentum.
+	double momentum[3];
+	// The angular momentum about the origin.
+	double angular[3];
+};
+
+// Computes the conserved quantities of the particles of the given slice.
+//
+// The potential is approximated by walking the given tree with the same
+// opening criterion as the forces, or computed exactly from the given packed
+// particles unless `src` is NULL.
+void diagnostics_slice(const struct particle_tree *tree,
+	const struct direct_sources *src, const struct particle_slice *slice,
+	struct diagnostics *diag);
+// Adds the quantities of `diag` to `sum`.
+void diagnostics_add(struct diagnostics *sum, const struct diagnostics *diag);
+// Returns the total energy.
+double diagnostics_energy(const struct diagnostics *diag);
+// Returns the magnitude of the given vector quantity.
+double diagnostics_norm(const double v[3]);
+
+#endif // BARNES_HUT_DIAGNOSTICS_H
@@ -0,0 +1,72 @@
+#ifndef BARNES_HUT_DIRECT_H
+#define BARNES_HUT_DIRECT_H
+
+#include <stddef.h>
+
+#include "barnes-hut/phys.h"
+
+// The force solvers.
+enum solver {
+	// Barnes-Hut approximation using the octree (O(N log N)).
+	SOLVER_TREE = 0,
+	// Exact direct summation over all pairs (O(N^2)).
+	SOLVER_DIRECT,
+	// Direct summation below `direct_crossover` particles, the tree otherwise.
+	SOLVER_AUTO,
+};
+
+// The relative force errors of the tree solver against direct summation.
+struct direct_error {
+	// The root mean square of the relative errors of all samples.
+	float rms;
+	// The greatest relative error of any sample.
+	float max;
+};
+
+// The particles packed for direct summation as structure of arrays, padded
+// with massless particles to a multiple of the tile size.
+struct direct_sources {
+	// The number of packed particles and their padded number.
+	size_t len, padded;
+	// The coordinates and masses of the packed particles.
+	float *x, *y, *z, *m;
+};
+
+// Parses a solver string (`tree`, `direct` or `auto`).
+int direct_parse(const char *arg, enum solver *solver);
+// Returns the particle count below which direct summation is faster than
+// building and walking the tree with the given opening angle.
+size_t direct_crossover(float theta);
+// Allocates the source tiles for the given number of particles.
+int direct_init(struct direct_sources *src, size_t len);
+// Releases the source tiles.
+void direct_deinit(struct direct_sources *src);
+// Copies the positions and masses of all particles into the source tiles.
+//
+// This is the direct solver's counterpart to `particle_tree_build`, all
+// following calls use the particles as of the latest call.
+void direct_pack(struct direct_sources *src,
+	const struct particle particles[]);
+// Executes the current simulation step of length `dt` by updating all
+// particles encompassed by the given slice with the exact forces of all packed
+// particles.
+//
+// Returns the furthest distance to the center of all updated particles.
+float direct_simulate(const struct direct_sources *src,
+	const struct particle_slice *slice, float dt);
+// Returns the exact force of all packed particles on the given one.
+struct vec3 direct_force(const struct direct_sources *src,
+	const struct point_mass *part);
+// Returns the exact potential energy of the given particle in the field of all
+// (other) packed particles.
+float direct_potential(const struct direct_sources *src,
+	const struct point_mass *part);
+// Compares the forces of the given tree on `samples` evenly spaced packed
+// particles against their exact forces.
+//
+// The tree must have been built from the same particles as the latest
+// `direct_pack`.
+struct direct_error direct_accuracy(const struct direct_sources *src,
+	const struct particle_tree *tree, size_t samples);
+
+#endif // BARNES_HUT_DIRECT_H
@@ -0,0 +1,18 @@
+#ifndef BARNES_HUT_DIST_H
+#define BARNES_HUT_DIST_H
+
+// Runs the simulation distributed over `options.ranks` processes.
+//
+// Each process (rank) owns the particles of a contiguous range of Morton keys,
+// chosen each step so that all ranks own about the same number of particles.
+// Particles whose key moved into another rank's range migrate to it, and each
+// rank receives the locally essential parts of all other ranks' trees (as
+// pseudo-particles) before computing the forces on its own particles.
+//
+// With `options.rank` set, only that rank runs in the calling process and
+// connects to the others by `options.transport`. Otherwise, the calling
+// process runs rank 0 and forks all other ranks, connected over Unix sockets
+// in a temporary directory.
+int dist_main(void);
+
+#endif // BARNES_HUT_DIST_H
@@ -0,0 +1,114 @@
+#ifndef BARNES_HUT_ENGINE_H
+#define BARNES_HUT_ENGINE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "barnes-hut/arena.h"
+#include "barnes-hut/barneshut.h"
+#include "barnes-hut/common.h"
+#include "barnes-hut/diagnostics.h"
+#include "barnes-hut/options.h"
+#include "barnes-hut/phys.h"
+#include "barnes-hut/sim.h"
+
+#ifdef USE_MT19937
+#include "barnes-hut/mt19937_64.h"
+#endif // USE_MT19937
+
+// The per-thread simulation state.
+struct thread_state {
+	// The thread's ID.
+	unsigned id;
+	// The context the thread belongs to.
+	struct bh_sim *ctx;
+	// The thread's local copy of the global particle list.
+	struct particle *particles;
+	// The thread's assigned particle slice.
+	struct particle_slice slice;
+	// The particle space radius to use for the next simulation step.
+	//
+	// After completion of a step, the thread sets this field to the greatest
+	// distance from center of any calculated particle position in the latest
+	// iteration.
+	//
+	// The main thread then aggregates all thread values of this field and
+	// calculates (maximum) the radius for the next iteration.
+	//
+	// Access to this field must be synchronized using `barrier`.
+	float radius;
+#ifdef USE_MT19937
+	// The thread's random number stream.
+	struct mt19937_64 rng;
+#endif // USE_MT19937
+	// The conserved quantities of the thread's slice at the start of the
+	// latest diagnostics step, and the time spent computing them.
+	//
+	// Access to these fields must be synchronized using `barrier`.
+	struct diagnostics diag;
+	long diag_us;
+#ifdef STATS
+	// The thread's tree work counters of the latest step.
+	//
+	// Access to this field must be synchronized using `barrier`.
+	struct tree_stats stats;
+#endif // STATS
+} aligned(64);
+
+// A simulation context and the threads computing its steps.
+//
+// The calling thread of `bh_step` acts as thread 0, all other threads wait in
+// `barrier` between the steps.
+struct bh_sim {
+	// The options to start the simulation with (copied into `sim`).
+	struct options opts;
+	// The simulation, whose particles are the globally shared and synchronized
+	// region of all simulated particles.
+	//
+	// Access to the tree and the packed particles must be synchronized using
+	// `barrier`.
+	struct sim sim;
+	// The memory arena for octant allocation.
+	struct arena arena;
+	// The thread synchronization barrier.
+	pthread_barrier_t barrier;
+	// The thread error flag.
+	atomic_int thread_errno;
+	// The lock and condition the workers wait on before their first barrier,
+	// until all of them were created (`launched`). If creating any of them
+	// failed, `thread_errno` is set by then and the workers exit.
+	pthread_mutex_t launch_lock;
+	pthread_cond_t launch_cond;
+	bool launched;
+	// The state of all threads.
+	struct thread_state *states;
+	// The additional worker threads and the number of started ones.
+	pthread_t *threads;
+	unsigned started;
+	// The particles to start with (NULL means randomized), their count and
+	// whether they are owned by the context.
+	struct particle *particles;
+	size_t len;
+	bool owned;
+	// The flag for particles to be randomized by the threads' first step.
+	bool randomize;
+	// The next step to compute.
+	unsigned step;
+	// The flag for running threads (set by the first step).
+	bool running;
+	// The error that stopped the simulation.
+	int error;
+	// The times of the latest step's tree build and simulation.
+	long build_us, step_us;
+};
+
+// Uses the given particles, e.g. a restored checkpoint, without copying them
+// and continues the simulation from the given step.
+//
+// The particles must stay valid until the context is destroyed and are not
+// released by it.
+int bh_adopt_particles(struct bh_sim *ctx, struct particle particles[],
+	size_t len, unsigned step);
+
+#endif // BARNES_HUT_ENGINE_H
@@ -0,0 +1,15 @@
+#ifndef BARNES_HUT_ENSEMBLE_H
+#define BARNES_HUT_ENSEMBLE_H
+
+// Runs an ensemble of independent simulations, one per line of the file
+// `options.ensemble`.
+//
+// Each line lists the options in which its simulation differs from the command
+// line (e.g., `--seed=2 --theta=0.5`), empty lines and lines starting with `#`
+// are skipped. A pool of `options.threads` workers runs the simulations, each
+// on a single thread and reusing its arena and particle memory, so no worker
+// ever waits for another. A CSV row of totals is printed for each simulation
+// once it completes.
+int ensemble_main(void);
+
+#endif // BARNES_HUT_ENSEMBLE_H
@@ -0,0 +1,27 @@
+#ifndef BARNES_HUT_FRAMES_H
+#define BARNES_HUT_FRAMES_H
+
+#include <stddef.h>
+
+#include "barnes-hut/phys.h"
+
+// Allocates the per-thread density tiles and starts the frame writer thread,
+// which writes frames as `frame-<step>.ppm` into the given directory.
+int frames_init(const char *dir, unsigned threads);
+// Writes all pending frames and stops the frame writer thread.
+void frames_deinit(void);
+// Splats the given particles into the density tile of thread `id`.
+//
+// The particles are projected with the same camera as the interactive
+// renderer, looking at the origin from (r, r, r) with an orthographic
+// projection spanning [-r, r].
+void frames_splat(unsigned id, const struct particle particles[], size_t len,
+	float radius);
+// Reduces the density tiles of all threads into a log-density image and hands
+// it over to the writer thread.
+//
+// Must only be called while no thread is splatting. Blocks while the writer
+// thread is busy with both previously submitted frames.
+void frames_submit(unsigned step);
+
+#endif // BARNES_HUT_FRAMES_H
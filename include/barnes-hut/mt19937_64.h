@@ -1,9 +1,36 @@
 #ifndef MT19937_64_H
 #define MT19937_64_H
 
+#include <stddef.h>
+
+#define MT19937_64_NN 312
+
+// The state of an independent MT19937-64 generator.
+struct mt19937_64 {
+	unsigned long long mt[MT19937_64_NN];
+	unsigned mti;
+};
+
 // Initializes RNG with a seed.
 void mt1993764_init(unsigned long long seed);
 // Generates a random number in an [0, 2^64-1] interval.
 unsigned long long mt1993764_int64(void);
 
+// Initializes the given generator state with a seed.
+void mt1993764_init_state(struct mt19937_64 *state, unsigned long long seed);
+// Fills `out` with the next `len` random numbers of the given generator.
+//
+// The state is regenerated in blocks of 312 words with a vectorized twist and
+// the output is tempered block-wise, yielding the exact same sequence as
+// repeated calls to `mt1993764_int64`.
+void mt1993764_fill(struct mt19937_64 *state, unsigned long long out[],
+	size_t len);
+// Advances the given generator by 2^64 outputs, e.g., for deriving
+// non-overlapping per-thread streams from a single seeded state.
+//
+// The state must be freshly seeded or exactly at a multiple of 312 outputs.
+// The first call computes the characteristic polynomial and the jump
+// polynomial (taking a fraction of a second) once for all threads.
+int mt1993764_jump(struct mt19937_64 *state);
+
 #endif // MT19937_64_H
@@ -4,7 +4,9 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#include "barnes-hut/affinity.h"
 #include "barnes-hut/common.h"
+#include "barnes-hut/direct.h"
 
 // The global options and settings.
 extern struct options {
@@ -26,15 +28,95 @@ extern struct options {
 	unsigned seed;
 	// The delay in ms afer each simulation step.
 	unsigned delay;
-	// The flag for enabling z-curve order sorting optimization.
+	// The flag for enabling space-filling curve order sorting optimization.
 	bool optimize;
+	// The space-filling curve to sort particles and split domains along.
+	enum order order;
+	// The number of steps between two sorts (with `optimize`).
+	unsigned sort_every;
 	// The flag for enabling more verbose output to `stderr`.
 	bool verbose;
 	// The flag for forcing the entire galaxy into a flat x/y plane.
 	bool flat;
+	// The thread placement policy.
+	enum pin_policy pin;
+	// The explicit CPU list for the `PIN_LIST` placement policy.
+	const char *pin_list;
+	// The path for periodic checkpoints (NULL means no checkpoints).
+	const char *checkpoint;
+	// The number of steps between two checkpoints.
+	unsigned checkpoint_every;
+	// The path of the checkpoint to restore the simulation from.
+	const char *restore;
+	// The flags for the run parameters given on the command line, which take
+	// precedence over those stored in a restored checkpoint.
+	bool theta_set, dt_set, optimize_set;
+	// The path for compressed position snapshots (NULL means no snapshots).
+	const char *snapshot;
+	// The number of steps between two snapshots.
+	unsigned snapshot_every;
+	// The number of quantization bits per axis for snapshot positions.
+	unsigned snapshot_bits;
+	// The directory for headless density frames (NULL means no frames).
+	const char *frames;
+	// The number of steps between two frames.
+	unsigned frames_every;
+	// The on-screen size in pixels below which octants are rendered as a
+	// single sprite (0 means every particle is rendered).
+	float lod;
+	// The name of the shared memory feed (NULL means no feed).
+	const char *shm;
+	// The path for per-thread phase times (NULL means no phase profile).
+	const char *phases;
+	// The flag for adding hardware counters to the phase profile.
+	bool perf_counters;
+	// The path for the thread activity trace (NULL means no trace).
+	const char *trace;
+	// The number of clusters to generate particles in (0 means uniform).
+	unsigned clusters;
+	// The force solver (`SOLVER_AUTO` is resolved before the simulation).
+	enum solver solver;
+	// The number of particles whose tree forces are compared against direct
+	// summation after each step (0 means no comparison).
+	size_t accuracy;
+	// The number of steps between two computations of the conserved
+	// quantities (0 means no diagnostics).
+	unsigned diagnostics;
+	// The number of processes to distribute the simulation over.
+	unsigned ranks;
+	// The rank of this process (-1 means all ranks are launched locally).
+	int rank;
+	// The transport connecting the ranks (e.g., `unix:DIR`).
+	const char *transport;
+	// The file listing the simulations of an ensemble (NULL means a single
+	// simulation).
+	const char *ensemble;
+	// The flag for updating the global particles in place instead of in
+	// per-thread copies.
+	bool lean;
+	// The flag for computing forces from compressed copies of the octants.
+	bool packed;
+	// The greatest RMS force error of the settings chosen by the startup
+	// autotuner (0 means no autotuning).
+	float autotune;
+	// The file caching the autotuner's choices (NULL means no cache).
+	const char *autotune_cache;
 } options;
 
+// Parses the command line arguments into the global options, printing the
+// usage on errors.
 int options_parse(int argc, char *argv[argc]);
+// Parses the given arguments into `opts`, which holds the defaults for all
+// arguments not given.
+//
+// The scanning state of `getopt_long` is process-wide, so arguments must not
+// be parsed by several threads at once.
+int options_parse_args(struct options *opts, int argc, char *argv[argc]);
+// Sets the long option `name` to the given value (NULL for flags) in `opts`.
+//
+// Unlike `options_parse_args`, this uses no global state, so different options
+// can be set from different threads. String options keep pointing to `value`.
+int options_set(struct options *opts, const char *name, const char *value);
 
 printf_like void verbose_printf(const char *fmt, ...);
 
@@ -0,0 +1,65 @@
+#ifndef BARNES_HUT_PHILOX_H
+#define BARNES_HUT_PHILOX_H
+
+#include <stdint.h>
+
+// A counter-based Philox4x32-10 random number generator (Salmon et al.,
+// "Parallel Random Numbers: As Easy as 1, 2, 3", SC'11).
+//
+// Each output block is a pure function of a 128-bit counter and a 64-bit key,
+// so any element of a random sequence can be generated independently of all
+// others, in any order and on any thread.
+
+// A block of four 32-bit random numbers.
+struct philox4x32 {
+	uint32_t v[4];
+};
+
+static inline void
+philox4x32_round(uint32_t ctr[4], const uint32_t key[2])
+{
+	static const uint64_t m0 = 0xD2511F53;
+	static const uint64_t m1 = 0xCD9E8D57;
+
+	const uint64_t p0 = m0 * ctr[0];
+	const uint64_t p1 = m1 * ctr[2];
+
+	const uint32_t hi0 = (uint32_t)(p0 >> 32), lo0 = (uint32_t)p0;
+	const uint32_t hi1 = (uint32_t)(p1 >> 32), lo1 = (uint32_t)p1;
+
+	ctr[0] = hi1 ^ ctr[1] ^ key[0];
+	ctr[1] = lo1;
+	ctr[2] = hi0 ^ ctr[3] ^ key[1];
+	ctr[3] = lo0;
+}
+
+// Returns the random block for the given counter and key.
+static inline struct philox4x32
+philox4x32(uint64_t ctr_lo, uint64_t ctr_hi, uint64_t seed)
+{
+	static const uint32_t w0 = 0x9E3779B9;
+	static const uint32_t w1 = 0xBB67AE85;
+
+	uint32_t ctr[4] = { (uint32_t)ctr_lo, (uint32_t)(ctr_lo >> 32),
+		(uint32_t)ctr_hi, (uint32_t)(ctr_hi >> 32) };
+	uint32_t key[2] = { (uint32_t)seed, (uint32_t)(seed >> 32) };
+
+	for (unsigned r = 0; r < 10; r++) {
+		if (r > 0) {
+			key[0] += w0;
+			key[1] += w1;
+		}
+		philox4x32_round(ctr, key);
+	}
+
+	return (struct philox4x32) { { ctr[0], ctr[1], ctr[2], ctr[3] } };
+}
+
+// Converts a 32-bit random number into a float within [0.0, 1.0).
+static inline float
+philox_unit(uint32_t x)
+{
+	return (float)(x >> 8) * (1.0f / (float)(1u << 24));
+}
+
+#endif // BARNES_HUT_PHILOX_H
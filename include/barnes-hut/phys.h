@@ -2,9 +2,21 @@
 #define BARNES_HUT_PHYS_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include "barnes-hut/arena.h"
 
+struct mt19937_64;
+struct options;
+
+// The gravitational constant.
+#define PHYS_G 6.6726e-11f
+// The distance below which forces no longer grow, avoiding singularities.
+#define PHYS_MIN_DIST 2.0f
+// The per-axis tolerance below which two positions are considered equal (and
+// exert no force on each other).
+#define PHYS_EPS 0.001f
+
 // A 3-dimensional vector.
 struct vec3 {
 	float x, y, z;
@@ -22,10 +34,36 @@ struct particle {
 	struct vec3 vel;
 };
 
-// Randomizes the coordinates of the given list of particles.
-void randomize_particles(struct particle part[], float r);
-// Sorts the the given list of particles by a Z-curve ordering.
-void sort_particles(struct particle part[]);
+// Randomizes the coordinates of the `len` particles in the given list as the
+// particles `from` to `from + len` of a simulation with the given options.
+//
+// Unless `USE_MT19937` is defined, each particle's coordinates are a pure
+// function of the seed and its index, so disjoint ranges may be randomized
+// concurrently with identical results. Otherwise, the numbers are drawn from
+// the given MT19937 stream (NULL without `USE_MT19937`), so the results
+// depend on how the list is divided between streams.
+void randomize_particles(struct particle part[], size_t from, size_t len,
+	const struct options *opts, struct mt19937_64 *rng);
+// The space-filling curves particles can be ordered by.
+enum order {
+	// The Z-curve, whose keys interleave the bits of the coordinates.
+	ORDER_MORTON = 0,
+	// The Hilbert curve, whose consecutive cells are always adjacent.
+	ORDER_HILBERT,
+};
+
+// Parses an order string (`morton` or `hilbert`).
+int particle_order_parse(const char *arg, enum order *order);
+// Returns the key of the given point mass along the given curve within the
+// cube spanning [-radius, radius] on all axes (21 bits per axis).
+uint64_t particle_key(const struct point_mass *part, float radius,
+	enum order order);
+// Sorts the the given list of `len` particles along the given curve through
+// the cube spanning [-radius, radius] on all axes.
+//
+// The Hilbert order temporarily allocates a key for each particle.
+int sort_particles(struct particle part[], size_t len, enum order order,
+	float radius);
 
 // A consecutive view into the global array of particles.
 struct particle_slice {
@@ -59,21 +97,129 @@ struct octant {
 	arena_item_t children[OTREE_CHILDREN];
 };
 
+// The greatest quantized coordinate of a packed octant's center of mass.
+#define PACKED_POS_MAX UINT16_MAX
+
+// A compressed copy of an octant for the tree walk of the force computation.
+//
+// The center of mass of an inner octant is quantized to 16 bits per axis
+// within the octant's cube, whose corner and width follow from the parent's
+// cube during the walk, and its mass is stored as a bfloat16. Leaves keep
+// their exact point mass, as the forces of nearby particles need it.
+struct packed_octant {
+	union {
+		struct {
+			// The quantized center of mass relative to the octant's corner.
+			uint16_t pos[3];
+			// The upper half of the mass's binary32 representation
+			// (rounded).
+			uint16_t mass;
+			// The index of the first child, which is followed by all other
+			// children (in order).
+			arena_item_t first;
+			// The masks of the existing children and of those which are
+			// leaves.
+			uint8_t children, leaves;
+		};
+		struct point_mass leaf;
+	};
+};
+
 // A tree of octants containing particles.
 struct particle_tree {
 	// The particle tree's root octant.
 	arena_item_t root;
+	// The arena holding the tree's octants.
+	struct arena *arena;
+	// The arena holding the packed octants for force computations (NULL
+	// means forces are computed from the full precision octants).
+	struct arena *packed;
+	// The opening criterion's threshold.
+	float theta;
 };
 
+// The octants reserved per particle by `particle_tree_arena_init` (capped by
+// the octant indices), far more than the ~1.5 of uniform and clustered
+// distributions, for collapsing ones. Only used octants are backed by memory.
+#define OTREE_ARENA_FACTOR 64
+// The octants per particle that must fit into the octant indices at least.
+#define OTREE_ARENA_MIN_FACTOR 4
+// The octants reserved at least by `particle_tree_arena_init`.
+#define OTREE_ARENA_MIN ((size_t)1 << 20)
+
+#ifdef STATS
+// The work counters of the tree operations of a thread (only with `STATS`).
+struct tree_stats {
+	// The number of octants visited by force computations.
+	unsigned long long visits;
+	// The number of octants whose center of mass was accepted by the opening
+	// criterion (particle-cell interactions).
+	unsigned long long accepted;
+	// The number of particle-particle interactions.
+	unsigned long long pairs;
+	// The maximum depth of any octant created by insertions.
+	unsigned depth;
+};
+
+// The calling thread's counters, accumulated until reset by the caller.
+extern _Thread_local struct tree_stats tree_stats;
+#endif // STATS
+
+// Initializes the given arena for the octants of trees of up to `len`
+// particles.
+//
+// Returns `EOVERFLOW` if the octants can not be addressed without `LARGE`.
+int particle_tree_arena_init(struct arena *arena, size_t len);
+// Initializes the given arena for the packed octants of trees of up to `len`
+// particles.
+int particle_tree_packed_init(struct arena *arena, size_t len);
 // Recursively constructs the tree structure for the current simulation step.
+//
+// This is `particle_tree_insert` followed by `particle_tree_center`.
 int particle_tree_build(struct particle_tree *tree,
-	const struct particle particles[], float radius);
+	const struct particle particles[], size_t len, float radius);
+// Inserts the `len` given particles into a new tree, leaving the octants'
+// centers of mass to be computed by `particle_tree_center`.
+int particle_tree_insert(struct particle_tree *tree,
+	const struct particle particles[], size_t len, float radius);
+// Recursively computes the centers of mass of all octants of the given tree.
+void particle_tree_center(struct particle_tree *tree);
+// Packs the octants of the given (centered) tree into `tree->packed`, with
+// the children of each octant stored consecutively, followed by their
+// subtrees.
+int particle_tree_pack(struct particle_tree *tree);
 
-// Executes the current simulation step by updating all particles encompassed
-// by the given slice.
+// Executes the current simulation step of length `dt` by updating all
+// particles encompassed by the given slice.
+//
+// This and `particle_tree_force` walk the packed octants, if any.
 //
 // Returns the furthest distance to the center of all updated particles.
 float particle_tree_simulate(const struct particle_tree *tree,
-	const struct particle_slice *slice);
+	const struct particle_slice *slice, float dt);
+// Returns the approximate force of all particles in the given tree on the
+// given point mass.
+struct vec3 particle_tree_force(const struct particle_tree *tree,
+	const struct point_mass *part);
+// Returns the approximate potential energy of the given point mass in the
+// field of all (other) particles in the given tree.
+float particle_tree_potential(const struct particle_tree *tree,
+	const struct point_mass *part);
+// Appends the locally essential octants of the given tree for all particles
+// within the given box to the growable list `parts` (of length `len` and
+// capacity `cap`).
+//
+// These are the centers of mass of all octants accepted by the opening
+// criterion for the whole box and all leaves that are not, which together
+// yield the same approximations as the tree for any particle in the box.
+int particle_tree_essential(const struct particle_tree *tree,
+	const struct vec3 *lo, const struct vec3 *hi, struct point_mass **parts,
+	size_t *len, size_t *cap);
+
+// Applies the given force over the time step `dt` to the particle's velocity
+// and the velocity to its position.
+//
+// Returns the squared distance of the particle's new position to the center.
+float particle_advance(struct particle *part, struct vec3 force, float dt);
 
 #endif // BARNES_HUT_PHYS_H
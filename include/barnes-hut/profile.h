@@ -0,0 +1,138 @@
+#ifndef BARNES_HUT_PROFILE_H
+#define BARNES_HUT_PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "barnes-hut/common.h"
+
+#ifdef TRACE
+#include "barnes-hut/trace.h"
+#endif // TRACE
+
+// The phases of a simulation step, each thread is in at most one at a time.
+enum phase {
+	// Sorting the particles by Z-curve order (main thread only).
+	PHASE_SORT,
+	// Inserting the particles into the tree (main thread only).
+	PHASE_INSERT,
+	// Computing the octants' centers of mass (main thread only).
+	PHASE_CENTER,
+	// Computing the forces and integrating the thread's slice.
+	PHASE_FORCE,
+	// Computing the conserved quantities of the thread's slice.
+	PHASE_DIAGNOSTICS,
+	// Copying the thread's slice back into the global particles.
+	PHASE_COPY,
+	// Waiting at the thread barrier.
+	PHASE_WAIT,
+	// Copying all other threads' slices into the thread's local particles.
+	PHASE_SYNC,
+	// Reducing the radius and writing all output (mostly main thread).
+	PHASE_OUTPUT,
+	PHASES,
+};
+
+// The hardware events counted per phase (with `--perf-counters`).
+enum counter {
+	COUNTER_CYCLES,
+	COUNTER_INSTRUCTIONS,
+	COUNTER_LLC_MISSES,
+	COUNTER_DTLB_MISSES,
+	COUNTERS,
+};
+
+// The number of steps a thread's records are kept, a thread may be at most
+// one step ahead of the step that is being written by the main thread.
+#define PROFILE_RECORDS 3
+
+// The accumulated phase times and counters of a thread for a single step.
+struct profile_record {
+	unsigned step;
+	bool valid;
+	uint64_t ns[PHASES];
+	uint64_t counts[PHASES][COUNTERS];
+};
+
+// The per-thread profiling state.
+struct profile_thread {
+	// The perf event group leader (-1 without counters).
+	int fd;
+	// The record of the current step.
+	struct profile_record *record;
+	// The current phase (`PHASES` if none).
+	enum phase phase;
+	// The time stamp and counters at the beginning of the current phase.
+	uint64_t start_ns;
+	uint64_t start_counts[COUNTERS];
+	struct profile_record records[PROFILE_RECORDS];
+} aligned(64);
+
+// The flag for enabling the phase profiler (set by `profile_init`).
+extern bool profile_enabled;
+// The profiling state of all threads.
+extern struct profile_thread *profile_threads;
+
+// Opens the phase profile file and allocates the state of all threads.
+int profile_init(const char *path, bool counters, unsigned threads,
+	unsigned first_step);
+// Writes all remaining records and closes the file and all counters.
+void profile_deinit(void);
+// Opens the hardware counters of the calling thread with the given ID.
+//
+// Unavailable counters (e.g., due to `perf_event_paranoid`) are reported and
+// the thread's counter columns are left at zero.
+void profile_thread_init(unsigned id);
+// Writes the records of all threads for the given (completed) step.
+//
+// All threads must have entered a later step already.
+void profile_flush(unsigned step);
+
+// Returns the name of the given phase.
+const char *profile_phase_name(enum phase phase);
+
+void profile_switch(struct profile_thread *thread, enum phase phase);
+void profile_begin_step(struct profile_thread *thread, unsigned step);
+
+// Starts a new step for the given thread, ending its current phase.
+static inline void
+profile_step(unsigned id, unsigned step)
+{
+#ifdef TRACE
+	if (unlikely(trace_enabled)) {
+		trace_phase(id, PHASES);
+		trace_step(id, step);
+	}
+#endif // TRACE
+	if (likely(!profile_enabled))
+		return;
+	profile_begin_step(&profile_threads[id], step);
+}
+
+// Ends the thread's current phase (if any) and enters the given phase.
+static inline void
+profile_enter(unsigned id, enum phase phase)
+{
+#ifdef TRACE
+	if (unlikely(trace_enabled))
+		trace_phase(id, phase);
+#endif // TRACE
+	if (likely(!profile_enabled))
+		return;
+	profile_switch(&profile_threads[id], phase);
+}
+
+// Ends the thread's current phase.
+static inline void
+profile_leave(unsigned id)
+{
+#ifdef TRACE
+	if (unlikely(trace_enabled))
+		trace_phase(id, PHASES);
+#endif // TRACE
+	if (likely(!profile_enabled))
+		return;
+	profile_switch(&profile_threads[id], PHASES);
+}
+
+#endif // BARNES_HUT_PROFILE_H
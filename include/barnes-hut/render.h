@@ -5,8 +5,21 @@
 
 #include "barnes-hut/phys.h"
 
+// Starts the render thread, which creates the window and draws all published
+// frames.
 int render_init(void);
+// Stops the render thread and closes the window.
 void render_deinit(void);
-bool render_scene(const struct particle particles[], float radius);
+// Publishes a copy of the particle positions of the latest completed step.
+//
+// With a positive `options.lod`, the given tree is walked instead and each
+// octant projecting to fewer than `options.lod` pixels is drawn as a single
+// sprite weighted by its number of bodies, so the cost of a frame is bounded
+// by the number of visible pixels rather than the number of particles.
+//
+// This never waits for the render thread, frames published faster than they
+// can be displayed are dropped. Returns `true` once the window was closed.
+bool render_publish(const struct particle particles[],
+	const struct particle_tree *tree, float radius);
 
 #endif // BARNES_HUT_RENDER_H
@@ -0,0 +1,65 @@
+#ifndef BARNES_HUT_SHM_H
+#define BARNES_HUT_SHM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "barnes-hut/common.h"
+#include "barnes-hut/phys.h"
+
+#define SHM_FEED_MAGIC "BHSHM"
+#define SHM_FEED_VERSION 1
+#define SHM_FEED_SLOTS 4
+
+// The header at the start of the shared memory object.
+//
+// The header is padded to a full page and followed by `slots` frame slots of
+// `slot_size` bytes each. Frames are numbered from 1, frame `n` is written
+// into slot `n % slots`, and `latest` holds the number of the latest completed
+// frame (0 before the first frame).
+struct shm_feed_header {
+	// The object magic (`SHM_FEED_MAGIC`, zero padded).
+	char magic[8];
+	// The layout version.
+	uint32_t version;
+	// The number of frame slots.
+	uint32_t slots;
+	// The number of particles per frame.
+	uint64_t particles;
+	// The size of a single slot (a multiple of the page size).
+	uint64_t slot_size;
+	// The offset of the first slot.
+	uint64_t offset;
+	// The number of the latest completed frame.
+	_Atomic uint64_t latest;
+};
+
+// A frame slot, followed immediately by `len` particle positions.
+//
+// The slot is guarded by a sequence lock: while frame `n` is being written,
+// `seq` is `2n - 1`, and `2n` once it is complete. A reader samples `seq`
+// (acquire) before and again (after an acquire fence) after reading, and
+// discards whatever it read unless both samples are equal to `2n`.
+struct shm_feed_slot {
+	_Atomic uint64_t seq;
+	// The simulation step of the frame.
+	uint32_t step;
+	// The particle space radius of the frame.
+	float radius;
+	// The number of positions following the slot header.
+	uint64_t len;
+} aligned(64);
+
+// Creates the POSIX shared memory object of the given name (e.g., `/bh`).
+int shm_feed_init(const char *name);
+// Unmaps and unlinks the shared memory object, mappings of attached readers
+// remain valid.
+void shm_feed_deinit(void);
+// Writes the particle positions of the given step into the next frame slot.
+//
+// The simulation never waits for any reader, readers that are lapped by the
+// simulation detect it by the slot's sequence number.
+void shm_feed_publish(const struct particle particles[], unsigned step,
+	float radius);
+
+#endif // BARNES_HUT_SHM_H
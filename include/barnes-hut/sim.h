@@ -0,0 +1,62 @@
+#ifndef BARNES_HUT_SIM_H
+#define BARNES_HUT_SIM_H
+
+#include <stddef.h>
+
+#include "barnes-hut/arena.h"
+#include "barnes-hut/diagnostics.h"
+#include "barnes-hut/direct.h"
+#include "barnes-hut/options.h"
+#include "barnes-hut/phys.h"
+
+// The state of a single simulation.
+//
+// Nothing of a simulation is kept in globals, so a process may hold any number
+// of them (e.g., one per thread of an ensemble).
+struct sim {
+	// The simulation's own copy of its options.
+	struct options opts;
+	// The simulated particles (provided and released by the caller).
+	struct particle *particles;
+	// The tree of the current step's particles (in an arena provided by the
+	// caller).
+	struct particle_tree tree;
+	// The current step's particles packed for direct summation (only with
+	// the direct solver or an accuracy comparison).
+	struct direct_sources sources;
+	// The arena of the tree's packed octants (only with `opts.packed`).
+	struct arena packed;
+	// The particle space radius of the current step.
+	float radius;
+#ifdef STATS
+	// The greatest number of octants allocated by any tree build.
+	arena_item_t arena_peak;
+#endif // STATS
+};
+
+// Initializes a simulation of `opts->particles` particles, whose trees are
+// built in the given arena, and resolves `SOLVER_AUTO`.
+//
+// The simulation must not be moved once initialized.
+//
+// The particles must be set by the caller before the first step.
+int sim_init(struct sim *sim, const struct options *opts, struct arena *arena);
+// Releases all resources owned by the simulation.
+void sim_deinit(struct sim *sim);
+// Sorts (every `opts.sort_every` steps with `opts.optimize`, along
+// `opts.order`) and builds the tree and/or packs the particles for the given
+// step.
+//
+// The phases are recorded as those of thread 0.
+int sim_build(struct sim *sim, unsigned step);
+// Computes the conserved quantities of the given slice of the particles the
+// latest step was built from.
+void sim_diagnostics(const struct sim *sim, const struct particle_slice *slice,
+	struct diagnostics *diag);
+// Executes the current step by updating all particles encompassed by the given
+// slice, which may be a copy of the simulation's particles.
+//
+// Returns the furthest distance to the center of all updated particles.
+float sim_simulate(const struct sim *sim, const struct particle_slice *slice);
+
+#endif // BARNES_HUT_SIM_H
@@ -0,0 +1,57 @@
+#ifndef BARNES_HUT_SNAPSHOT_H
+#define BARNES_HUT_SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "barnes-hut/phys.h"
+
+#define SNAPSHOT_MAGIC "BHSN"
+#define SNAPSHOT_VERSION 1
+
+// The header preceding each snapshot frame in a snapshot file.
+//
+// The header is followed by `bytes` bytes of Rice coded deltas between the
+// ascending Morton keys of the quantized particle positions (starting at 0).
+// Each delta is coded as the unary quotient `delta >> rice_k` (ones terminated
+// by a zero) followed by its lowest `rice_k` bits, quotients of at least
+// `SNAPSHOT_ESCAPE` are instead coded as `SNAPSHOT_ESCAPE` ones followed by the
+// 64-bit delta. Bits are filled LSB first into little-endian 64-bit words.
+//
+// A key interleaves `bits` bits per axis (x in the lowest bit), each axis
+// being quantized linearly between `min` and `max`. The particle order is
+// therefore not preserved.
+struct snapshot_frame {
+	// The frame magic (`SNAPSHOT_MAGIC`).
+	char magic[4];
+	// The file format version.
+	uint32_t version;
+	// The simulation step of the frame.
+	uint32_t step;
+	// The number of quantization bits per axis.
+	uint32_t bits;
+	// The number of particles in the frame.
+	uint64_t particles;
+	// The bounding box of all particle positions.
+	float min[3];
+	float max[3];
+	// The Rice parameter (number of verbatim low bits per delta).
+	uint32_t rice_k;
+	uint32_t reserved;
+	// The size of the coded deltas in bytes (a multiple of 8).
+	uint64_t bytes;
+};
+
+#define SNAPSHOT_ESCAPE 48
+
+// Opens the snapshot file and starts the background writer thread.
+int snapshot_init(const char *path, unsigned bits);
+// Flushes all pending snapshots, stops the writer thread and closes the file.
+void snapshot_deinit(void);
+// Hands a copy of the current particle positions over to the writer thread.
+//
+// This never waits for the writer, if both buffers are still being processed,
+// the snapshot is dropped and `false` is returned.
+bool snapshot_submit(const struct particle particles[], unsigned step);
+
+#endif // BARNES_HUT_SNAPSHOT_H
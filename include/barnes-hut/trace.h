@@ -0,0 +1,64 @@
+#ifndef BARNES_HUT_TRACE_H
+#define BARNES_HUT_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "barnes-hut/common.h"
+
+// The number of events kept per thread (a power of 2), older events are
+// overwritten once a thread's ring is full.
+#define TRACE_EVENTS ((size_t)1 << 18)
+
+// A thread entering a phase (or leaving all phases) at the given time.
+struct trace_event {
+	uint64_t ns;
+	uint32_t step;
+	uint32_t phase;
+};
+
+// The per-thread event ring, only ever written by its own thread.
+struct trace_thread {
+	struct trace_event *events;
+	// The total number of recorded events.
+	uint64_t len;
+	// The thread's current step.
+	unsigned step;
+} aligned(64);
+
+// The flag for enabling tracing (set by `trace_init`).
+extern bool trace_enabled;
+// The event rings of all threads.
+extern struct trace_thread *trace_threads;
+
+// Allocates the event rings of all threads.
+int trace_init(const char *path, unsigned threads);
+// Writes all recorded events as Chrome trace-event JSON and frees the rings.
+//
+// Must only be called after all traced threads have terminated.
+void trace_deinit(void);
+
+// Sets the step of the given thread's following events.
+static inline void
+trace_step(unsigned id, unsigned step)
+{
+	trace_threads[id].step = step;
+}
+
+// Records the given thread entering the given phase (`PHASES` for none).
+static inline void
+trace_phase(unsigned id, unsigned phase)
+{
+	struct trace_thread *thread = &trace_threads[id];
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	struct trace_event *event = &thread->events[thread->len++
+		& (TRACE_EVENTS - 1)];
+	event->ns	 = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+	event->step	 = thread->step;
+	event->phase = phase;
+}
+
+#endif // BARNES_HUT_TRACE_H
@@ -0,0 +1,54 @@
+#ifndef BARNES_HUT_TRANSPORT_H
+#define BARNES_HUT_TRANSPORT_H
+
+#include <stddef.h>
+
+struct transport;
+
+// The operations of a transport implementation.
+struct transport_ops {
+	// Sends `slen` bytes to rank `to` while receiving `rlen` bytes from rank
+	// `from` (which may be the same rank), returning once both completed.
+	int (*exchange)(struct transport *net, unsigned to, const void *sbuf,
+		size_t slen, unsigned from, void *rbuf, size_t rlen);
+	// Closes all connections and releases the implementation's state.
+	void (*close)(struct transport *net);
+};
+
+// The point-to-point connections between all processes of a distributed
+// simulation.
+//
+// All communication is by pairwise exchanges, which never deadlock as long as
+// every rank eventually posts the matching exchange.
+struct transport {
+	// The rank of this process.
+	unsigned rank;
+	// The number of processes.
+	unsigned ranks;
+	// The implementation's operations and state.
+	const struct transport_ops *ops;
+	void *impl;
+};
+
+// Connects to all other ranks using the transport described by `spec`.
+//
+// The only transport so far is `unix:DIR`, with a Unix domain socket per rank
+// (`DIR/rank-<rank>.sock`) and a stream connection between each pair of ranks.
+// All ranks must use the same directory.
+int transport_open(struct transport *net, const char *spec, unsigned rank,
+	unsigned ranks);
+
+static inline int
+transport_exchange(struct transport *net, unsigned to, const void *sbuf,
+	size_t slen, unsigned from, void *rbuf, size_t rlen)
+{
+	return net->ops->exchange(net, to, sbuf, slen, from, rbuf, rlen);
+}
+
+static inline void
+transport_close(struct transport *net)
+{
+	net->ops->close(net);
+}
+
+#endif // BARNES_HUT_TRANSPORT_H
@@ -0,0 +1,335 @@
+// Required for `pthread_setaffinity_np` and `CPU_SET`.
+#define _GNU_SOURCE
+
+#include "barnes-hut/affinity.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#include "barnes-hut/common.h"
+#include "barnes-hut/options.h"
+
+// The topology of a single (online and permitted) logical CPU.
+struct cpu_info {
+	// The logical CPU number.
+	int cpu;
+	// The physical package (socket) the CPU belongs to.
+	int package;
+	// The core ID within the package.
+	int core;
+	// The rank of the core within its package (dense, starting at 0).
+	int core_rank;
+	// The rank of the CPU among the hardware threads of its core.
+	int smt_rank;
+};
+
+// The placement order of CPUs, thread `t` is pinned to `cpus[t % len]`.
+static struct {
+	unsigned len;
+	int *cpus;
+} placement = { 0, NULL };
+
+static int parse_cpu_list(const char *list, int **cpus, unsigned *len);
+static int read_topology(struct cpu_info **infos, unsigned *len);
+static int read_sysfs_int(int cpu, const char *file, int *res);
+static int cmp_compact(const void *a, const void *b);
+static int cmp_scatter(const void *a, const void *b);
+
+int
+affinity_parse(const char *arg, enum pin_policy *policy)
+{
+	if (strcmp(arg, "compact") == 0)
+		*policy = PIN_COMPACT;
+	else if (strcmp(arg, "scatter") == 0)
+		*policy = PIN_SCATTER;
+	else if (strcmp(arg, "physical") == 0)
+		*policy = PIN_PHYSICAL;
+	else if (strcmp(arg, "none") == 0)
+		*policy = PIN_NONE;
+	else {
+		int *cpus;
+		unsigned len;
+		if (parse_cpu_list(arg, &cpus, &len)) {
+			fprintf(stderr, "Invalid pin arg: %s\n", arg);
+			return EINVAL;
+		}
+
+		free(cpus);
+		*policy = PIN_LIST;
+	}
+
+	return 0;
+}
+
+int
+affinity_init(enum pin_policy policy, const char *list)
+{
+	struct cpu_info *infos;
+	unsigned len;
+	int res;
+
+	if (policy == PIN_NONE)
+		return 0;
+	if (policy == PIN_LIST)
+		return parse_cpu_list(list, &placement.cpus, &placement.len);
+
+	if ((res = read_topology(&infos, &len)))
+		return res;
+
+	switch (policy) {
+	case PIN_COMPACT:
+	case PIN_PHYSICAL:
+		qsort(infos, len, sizeof(struct cpu_info), &cmp_compact);
+		break;
+	case PIN_SCATTER:
+		qsort(infos, len, sizeof(struct cpu_info), &cmp_scatter);
+		break;
+	default:
+		break;
+	}
+
+	placement.cpus = malloc(sizeof(int) * len);
+	if (unlikely(placement.cpus == NULL)) {
+		free(infos);
+		return ENOMEM;
+	}
+
+	placement.len = 0;
+	for (unsigned i = 0; i < len; i++) {
+		if (policy == PIN_PHYSICAL && infos[i].smt_rank != 0)
+			continue;
+		placement.cpus[placement.len++] = infos[i].cpu;
+	}
+
+	free(infos);
+
+	if (options.threads > placement.len)
+		fprintf(stderr,
+			"Warning: %u threads exceed the %u CPUs available for pinning, "
+			"CPUs will be shared\n",
+			options.threads, placement.len);
+
+	if (options.verbose) {
+		fprintf(stderr, "thread placement:");
+		for (unsigned t = 0; t < options.threads; t++)
+			fprintf(stderr, " %u->%d", t, placement.cpus[t % placement.len]);
+		fprintf(stderr, "\n");
+	}
+
+	return 0;
+}
+
+void
+affinity_deinit(void)
+{
+	free(placement.cpus);
+	placement.cpus = NULL;
+	placement.len  = 0;
+}
+
+int
+affinity_pin(unsigned id)
+{
+	if (placement.len == 0)
+		return 0;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(placement.cpus[id % placement.len], &set);
+
+	return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+}
+
+static int
+parse_cpu_list(const char *list, int **cpus, unsigned *len)
+{
+	size_t cap = 16;
+
+	*len  = 0;
+	*cpus = malloc(sizeof(int) * cap);
+	if (unlikely(*cpus == NULL))
+		return ENOMEM;
+
+	const char *s = list;
+	while (*s != '\0' && *s != '\n') {
+		char *end;
+		const long from = strtol(s, &end, 10);
+		long to			= from;
+		if (end == s || from < 0 || from >= CPU_SETSIZE)
+			goto error;
+
+		if (*end == '-') {
+			s  = end + 1;
+			to = strtol(s, &end, 10);
+			if (end == s || to < from || to >= CPU_SETSIZE)
+				goto error;
+		}
+
+		for (long cpu = from; cpu <= to; cpu++) {
+			if (*len == cap) {
+				cap *= 2;
+				int *tmp = realloc(*cpus, sizeof(int) * cap);
+				if (unlikely(tmp == NULL))
+					goto error;
+				*cpus = tmp;
+			}
+
+			(*cpus)[(*len)++] = (int)cpu;
+		}
+
+		if (*end == ',')
+			end++;
+		else if (*end != '\0' && *end != '\n')
+			goto error;
+		s = end;
+	}
+
+	if (*len == 0)
+		goto error;
+
+	return 0;
+
+error:
+	free(*cpus);
+	*cpus = NULL;
+	return EINVAL;
+}
+
+static int
+read_topology(struct cpu_info **infos, unsigned *len)
+{
+	char buf[4096];
+	int *cpus;
+	unsigned ncpus;
+	int res;
+
+	FILE *file = fopen("/sys/devices/system/cpu/online", "r");
+	if (file == NULL)
+		return errno;
+	const bool ok = fgets(buf, sizeof(buf), file) != NULL;
+	fclose(file);
+	if (!ok)
+		return EIO;
+
+	if ((res = parse_cpu_list(buf, &cpus, &ncpus)))
+		return res;
+
+	// Only consider CPUs the process is permitted to run on (e.g., restricted
+	// by `taskset` or cgroups).
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed))
+		CPU_ZERO(&allowed);
+
+	*infos = malloc(sizeof(struct cpu_info) * ncpus);
+	if (unlikely(*infos == NULL)) {
+		free(cpus);
+		return ENOMEM;
+	}
+
+	*len = 0;
+	for (unsigned i = 0; i < ncpus; i++) {
+		struct cpu_info *info = &(*infos)[*len];
+		if (CPU_COUNT(&allowed) > 0 && !CPU_ISSET(cpus[i], &allowed))
+			continue;
+
+		info->cpu = cpus[i];
+		// Missing topology information is treated as a separate core.
+		if (read_sysfs_int(cpus[i], "physical_package_id", &info->package))
+			info->package = 0;
+		if (read_sysfs_int(cpus[i], "core_id", &info->core))
+			info->core = cpus[i];
+		*len += 1;
+	}
+
+	free(cpus);
+
+	// Derive the dense core ranks within each package and the SMT ranks
+	// within each core (the CPU numbers are ascending).
+	for (unsigned i = 0; i < *len; i++) {
+		struct cpu_info *info = &(*infos)[i];
+		info->core_rank		  = 0;
+		info->smt_rank		  = 0;
+
+		for (unsigned j = 0; j < i; j++) {
+			const struct cpu_info *prev = &(*infos)[j];
+			if (prev->package != info->package)
+				continue;
+			if (prev->core == info->core)
+				info->smt_rank += 1;
+			else if (prev->smt_rank == 0)
+				info->core_rank += 1;
+		}
+
+		// All hardware threads of a core share the rank of its first one.
+		if (info->smt_rank != 0)
+			for (unsigned j = 0; j < i; j++) {
+				const struct cpu_info *prev = &(*infos)[j];
+				if (prev->package == info->package && prev->core == info->core
+					&& prev->smt_rank == 0) {
+					info->core_rank = prev->core_rank;
+					break;
+				}
+			}
+	}
+
+	return 0;
+}
+
+static int
+read_sysfs_int(int cpu, const char *file, int *res)
+{
+	char path[128];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s",
+		cpu, file);
+
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return errno;
+
+	const int n = fscanf(f, "%d", res);
+	fclose(f);
+
+	return (n == 1) ? 0 : EIO;
+}
+
+// Orders CPUs by package, then core, then hardware thread.
+static int
+cmp_compact(const void *a, const void *b)
+{
+	const struct cpu_info *c0 = a;
+	const struct cpu_info *c1 = b;
+
+	if (c0->package != c1->package)
+		return (c0->package < c1->package) ? -1 : 1;
+	if (c0->core_rank != c1->core_rank)
+		return (c0->core_rank < c1->core_rank) ? -1 : 1;
+	if (c0->smt_rank != c1->smt_rank)
+		return (c0->smt_rank < c1->smt_rank) ? -1 : 1;
+
+	return 0;
+}
+
+// Orders CPUs by hardware thread, then core, then package, so that consecutive
+// threads alternate between packages and only share cores once every core is
+// occupied.
+static int
+cmp_scatter(const void *a, const void *b)
+{
+	const struct cpu_info *c0 = a;
+	const struct cpu_info *c1 = b;
+
+	if (c0->smt_rank != c1->smt_rank)
+		return (c0->smt_rank < c1->smt_rank) ? -1 : 1;
+	if (c0->core_rank != c1->core_rank)
+		return (c0->core_rank < c1->core_rank) ? -1 : 1;
+	if (c0->package != c1->package)
+		return (c0->package < c1->package) ? -1 : 1;
+
+	return 0;
+}
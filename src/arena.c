@@ -0,0 +1,40 @@
+// Required for `MAP_ANON`.
+#define _DEFAULT_SOURCE
+
+#include "barnes-hut/arena.h"
+
+#include <stdio.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+int
+arena_init(struct arena *arena, size_t size, size_t item_size)
+{
+	const size_t items = size / item_size;
+	if (items >= ARENA_NULL)
+		return EOVERFLOW;
+
+	// Only the touched pages are backed, so the reservation may exceed the
+	// available memory.
+	arena->memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+	if (unlikely(arena->memory == MAP_FAILED))
+		return errno;
+
+	arena->size		 = size;
+	arena->item_size = item_size;
+	arena->curr		 = 0;
+	arena->last		 = (arena_item_t)items;
+
+	return 0;
+}
+
+void
+arena_deinit(struct arena *arena)
+{
+	if (munmap(arena->memory, arena->size))
+		fprintf(stderr, "Failed to unmap arena: %s\n", strerror(errno));
+}
@@ -0,0 +1,453 @@
+// Required for `sysconf`.
+#define _XOPEN_SOURCE 700
+
+#include "barnes-hut/autotune.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/utsname.h>
+
+#include "barnes-hut/common.h"
+#include "barnes-hut/direct.h"
+#include "barnes-hut/engine.h"
+#include "barnes-hut/options.h"
+#include "barnes-hut/phys.h"
+
+// The number of steps of each trial, of which the first (allocating the
+// memory and sorting the particles) is not timed.
+#define TRIAL_STEPS 3
+// The greatest number of forces compared against direct summation.
+#define ACCURACY_SAMPLES 200
+// The amortized sort may take at most 1/SORT_SHARE of the time it saves.
+#define SORT_SHARE 10
+
+#define CACHE_HEADER                                                         \
+	"# host particles flat clusters max_error threads theta optimize "       \
+	"sort_every packed\n"
+
+// The opening angles tried, in increasing order.
+static const float thetas[] = { 0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 1.0 };
+// The sort intervals tried, in increasing order.
+static const unsigned intervals[] = { 1, 2, 5, 10, 20, 50, 100 };
+
+// The settings chosen by the autotuner.
+struct choice {
+	unsigned threads;
+	float theta;
+	bool optimize;
+	unsigned sort_every;
+	bool packed;
+};
+
+static inline long time_diff(const struct timespec *start,
+	const struct timespec *stop);
+static struct options trial_options(void);
+static int trial_create(const struct options *opts,
+	const struct particle particles[], struct bh_sim **ctx);
+static int trial_run(const struct options *opts,
+	const struct particle particles[], long *us, long *sort_us);
+static int tune_theta(const struct options *opts,
+	const struct particle particles[], float theta[2]);
+static float max_theta(struct bh_sim *ctx, bool packed);
+static void tune_sort(long sorted_us, long unsorted_us, long sort_us,
+	struct choice *choice);
+static void host_name(char *buf, size_t len);
+static bool cache_lookup(const char *path, const char *host,
+	struct choice *choice);
+static void cache_store(const char *path, const char *host,
+	const struct choice *choice);
+static void print_choice(const struct choice *choice);
+
+int
+autotune(const struct particle particles[])
+{
+	struct choice best = { 0 };
+	char host[256];
+	int res;
+
+	host_name(host, sizeof(host));
+	if (options.autotune_cache
+		&& cache_lookup(options.autotune_cache, host, &best)) {
+		fprintf(stderr, "autotune: ");
+		print_choice(&best);
+		fprintf(stderr, " (cached in %s)\n", options.autotune_cache);
+		goto apply;
+	}
+
+	struct options opts = trial_options();
+	const bool tree		= opts.solver != SOLVER_DIRECT;
+
+	// The largest opening angles within the error bound without and with
+	// packing (0 where none is).
+	float theta[2] = { opts.theta, 0.0 };
+	if (tree && (res = tune_theta(&opts, particles, theta)))
+		return res;
+
+	// The thread counts and packings are compared on sorted particles, which
+	// all trials sort once before their timed steps.
+	const long cpus			   = sysconf(_SC_NPROCESSORS_ONLN);
+	const unsigned max_threads = (cpus > 0) ? (unsigned)cpus : 1;
+	long best_us			   = LONG_MAX;
+	opts.optimize			   = tree;
+	opts.sort_every			   = UINT_MAX;
+	for (unsigned threads = 1;; threads *= 2) {
+		if (threads > max_threads)
+			threads = max_threads;
+
+		for (int packed = 0; packed <= 1; packed++) {
+			if (packed && theta[1] == 0.0)
+				continue;
+
+			long us;
+			opts.threads = threads;
+			opts.theta	 = theta[packed];
+			opts.packed	 = packed;
+			if ((res = trial_run(&opts, particles, &us, NULL)))
+				return res;
+
+			verbose_printf("autotune: %u threads, theta %.2f%s: %ld us/step\n",
+				threads, opts.theta, (packed) ? ", packed" : "", us);
+			if (us < best_us) {
+				best_us = us;
+				best	= (struct choice) {
+					.threads	= threads,
+					.theta		= opts.theta,
+					.optimize	= options.optimize,
+					.sort_every = options.sort_every,
+					.packed		= packed,
+				};
+			}
+		}
+
+		if (threads == max_threads)
+			break;
+	}
+
+	if (tree) {
+		// The time saved by sorting is that of the best setting on the
+		// particles as they are (left unsorted by the randomization).
+		long unsorted_us, sort_us;
+		opts.threads  = best.threads;
+		opts.theta	  = best.theta;
+		opts.packed	  = best.packed;
+		opts.optimize = false;
+		if ((res = trial_run(&opts, particles, &unsorted_us, &sort_us)))
+			return res;
+
+		tune_sort(best_us, unsorted_us, sort_us, &best);
+		if (!best.optimize)
+			best_us = unsorted_us;
+		else
+			best_us += sort_us / best.sort_every;
+	}
+
+	fprintf(stderr, "autotune: ");
+	print_choice(&best);
+	fprintf(stderr, " (%ld us/step)\n", best_us);
+	if (options.autotune_cache)
+		cache_store(options.autotune_cache, host, &best);
+
+apply:
+	options.threads	   = best.threads;
+	options.theta	   = best.theta;
+	options.optimize   = best.optimize;
+	options.sort_every = best.sort_every;
+	options.packed	   = best.packed;
+
+	return 0;
+}
+
+static inline long
+time_diff(const struct timespec *start, const struct timespec *stop)
+{
+	return (stop->tv_sec - start->tv_sec) * (long)1e6
+		+ ((stop->tv_nsec - start->tv_nsec) / (long)1e3);
+}
+
+// Returns the options of all trials, which write no per-step output and tune
+// the tree for the automatic solver choice.
+static struct options
+trial_options(void)
+{
+	struct options opts = options;
+	opts.accuracy		= 0;
+	opts.diagnostics	= 0;
+	opts.frames			= NULL;
+	if (opts.solver == SOLVER_AUTO)
+		opts.solver = SOLVER_TREE;
+
+	return opts;
+}
+
+// Creates a context for a trial, which starts from a copy of the given
+// particles (as the steps update them in place) or randomizes its own.
+static int
+trial_create(const struct options *opts, const struct particle particles[],
+	struct bh_sim **ctx)
+{
+	int res;
+
+	if ((res = bh_create(ctx)))
+		return res;
+	(*ctx)->opts = *opts;
+	if (particles == NULL)
+		return 0;
+
+	const size_t size	  = sizeof(struct particle) * opts->particles;
+	struct particle *copy = malloc(size);
+	if (unlikely(copy == NULL)) {
+		bh_destroy(*ctx);
+		return ENOMEM;
+	}
+	memcpy(copy, particles, size);
+
+	(*ctx)->particles = copy;
+	(*ctx)->len		  = opts->particles;
+	(*ctx)->owned	  = true;
+
+	return 0;
+}
+
+// Runs a trial and stores its fastest (timed) step and, if `sort_us` is not
+// NULL, the time a step spends on sorting the particles after the last one.
+static int
+trial_run(const struct options *opts, const struct particle particles[],
+	long *us, long *sort_us)
+{
+	struct bh_sim *ctx;
+	int res;
+
+	if ((res = trial_create(opts, particles, &ctx)))
+		return res;
+
+	*us = LONG_MAX;
+	for (unsigned s = 0; s < TRIAL_STEPS; s++) {
+		if ((res = bh_step(ctx)))
+			goto destroy;
+
+		const long step_us = ctx->build_us + ctx->step_us;
+		if (s > 0 && step_us < *us)
+			*us = step_us;
+	}
+
+	if (sort_us != NULL) {
+		// The workers may still be copying from the particles after the last
+		// step, so a private copy of them is sorted instead.
+		const size_t len	  = ctx->sim.opts.particles;
+		const size_t size	  = sizeof(struct particle) * len;
+		struct particle *copy = malloc(size);
+		if (unlikely(copy == NULL)) {
+			res = ENOMEM;
+			goto destroy;
+		}
+		memset(copy, 0, size);
+
+		// Without --lean, the workers also replace their private copies of
+		// the particles after each sort, in parallel and about as fast as
+		// copying them once.
+		const bool resync = opts->threads > 1 && !opts->lean;
+		struct timespec start, copied, stop;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		memcpy(copy, ctx->sim.particles, size);
+		clock_gettime(CLOCK_MONOTONIC, &copied);
+		res = sort_particles(copy, len, ctx->sim.opts.order, ctx->sim.radius);
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+		*sort_us = time_diff((resync) ? &start : &copied, &stop);
+		free(copy);
+	}
+
+destroy:
+	bh_destroy(ctx);
+	return res;
+}
+
+// Stores the largest opening angles within the error bound without and with
+// packing in `theta` (0 where none is), keeping the given one for the former
+// if none is.
+//
+// The angles are compared on the tree of a single step.
+static int
+tune_theta(const struct options *opts, const struct particle particles[],
+	float theta[2])
+{
+	struct options acc = *opts;
+	struct bh_sim *ctx;
+	int res;
+
+	acc.threads	 = 1;
+	acc.packed	 = true;
+	acc.accuracy = (opts->particles < ACCURACY_SAMPLES) ? opts->particles
+														: ACCURACY_SAMPLES;
+	if ((res = trial_create(&acc, particles, &ctx)))
+		return res;
+	if ((res = bh_step(ctx)))
+		goto destroy;
+
+	theta[0] = max_theta(ctx, false);
+	theta[1] = max_theta(ctx, true);
+	if (theta[0] == 0.0) {
+		fprintf(stderr,
+			"autotune: No theta within a force error of %g, keeping %g\n",
+			options.autotune, opts->theta);
+		theta[0] = opts->theta;
+	}
+
+destroy:
+	bh_destroy(ctx);
+	return res;
+}
+
+// Returns the largest opening angle whose forces on the tree of the given
+// context are within the error bound (0 if none is).
+static float
+max_theta(struct bh_sim *ctx, bool packed)
+{
+	struct particle_tree *tree = &ctx->sim.tree;
+	struct arena *arena		   = tree->packed;
+	float max				   = 0.0;
+
+	tree->packed = (packed) ? arena : NULL;
+	for (size_t i = 0; i < sizeof(thetas) / sizeof(thetas[0]); i++) {
+		tree->theta					  = thetas[i];
+		const struct direct_error err = direct_accuracy(&ctx->sim.sources,
+			tree, ctx->sim.opts.accuracy);
+
+		verbose_printf("autotune: theta %.2f%s: %.3g rms force error\n",
+			thetas[i], (packed) ? ", packed" : "", err.rms);
+		// The error only grows with the opening angle.
+		if (err.rms > options.autotune)
+			break;
+		max = thetas[i];
+	}
+	tree->packed = arena;
+
+	return max;
+}
+
+// Chooses the shortest sort interval whose amortized sort takes at most
+// 1/SORT_SHARE of the time it saves per step, or none if sorting does not pay
+// off at all.
+static void
+tune_sort(long sorted_us, long unsorted_us, long sort_us,
+	struct choice *choice)
+{
+	static const size_t len = sizeof(intervals) / sizeof(intervals[0]);
+
+	const long saved_us = unsorted_us - sorted_us;
+	verbose_printf("autotune: sorting saves %ld us/step and takes %ld us\n",
+		saved_us, sort_us);
+
+	choice->optimize = false;
+	if (saved_us <= 0 || sort_us >= saved_us * (long)intervals[len - 1])
+		return;
+
+	size_t i = 0;
+	while (i < len - 1 && sort_us * SORT_SHARE > saved_us * (long)intervals[i])
+		i++;
+	choice->optimize   = true;
+	choice->sort_every = intervals[i];
+}
+
+// Writes the name identifying the machine (host, architecture and CPUs).
+static void
+host_name(char *buf, size_t len)
+{
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	struct utsname name;
+
+	if (uname(&name))
+		snprintf(buf, len, "unknown-%ldcpus", cpus);
+	else
+		snprintf(buf, len, "%s-%s-%ldcpus", name.nodename, name.machine,
+			cpus);
+}
+
+// Looks up the latest choice for the machine and simulation in the cache.
+static bool
+cache_lookup(const char *path, const char *host, struct choice *choice)
+{
+	bool found = false;
+	char line[512];
+
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		if (errno != ENOENT)
+			fprintf(stderr, "Failed to open autotune cache %s: %s\n", path,
+				strerror(errno));
+		return false;
+	}
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		char entry_host[256];
+		size_t particles;
+		int flat, optimize, packed;
+		unsigned clusters;
+		float max_error;
+		struct choice entry;
+
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%255s %zu %d %u %g %u %g %d %u %d", entry_host,
+				&particles, &flat, &clusters, &max_error, &entry.threads,
+				&entry.theta, &optimize, &entry.sort_every, &packed)
+			!= 10)
+			continue;
+		if (strcmp(entry_host, host) != 0 || particles != options.particles
+			|| flat != options.flat || clusters != options.clusters
+			|| max_error != options.autotune || entry.threads == 0
+			|| entry.sort_every == 0)
+			continue;
+
+		// Entries are only ever appended, so the last one is the latest.
+		entry.optimize = optimize;
+		entry.packed   = packed;
+		*choice		   = entry;
+		found		   = true;
+	}
+
+	fclose(file);
+	return found;
+}
+
+// Appends the choice for the machine and simulation to the cache.
+static void
+cache_store(const char *path, const char *host, const struct choice *choice)
+{
+	FILE *file = fopen(path, "a");
+	if (file == NULL) {
+		fprintf(stderr, "Failed to open autotune cache %s: %s\n", path,
+			strerror(errno));
+		return;
+	}
+
+	if (fseek(file, 0, SEEK_END) == 0 && ftell(file) == 0)
+		fputs(CACHE_HEADER, file);
+	fprintf(file, "%s %zu %d %u %.9g %u %.9g %d %u %d\n", host,
+		options.particles, options.flat, options.clusters, options.autotune,
+		choice->threads, choice->theta, choice->optimize, choice->sort_every,
+		choice->packed);
+
+	if (fclose(file))
+		fprintf(stderr, "Failed to write autotune cache %s: %s\n", path,
+			strerror(errno));
+}
+
+// Prints the choice as command line options.
+static void
+print_choice(const struct choice *choice)
+{
+	fprintf(stderr, "-p %u --theta=%g", choice->threads, choice->theta);
+	if (choice->optimize)
+		fprintf(stderr, " -o --sort-every=%u", choice->sort_every);
+	if (choice->packed)
+		fprintf(stderr, " --packed");
+}
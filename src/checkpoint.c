@@ -0,0 +1,240 @@
+#define _XOPEN_SOURCE 700
+
+#include "barnes-hut/checkpoint.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "barnes-hut/common.h"
+#include "barnes-hut/options.h"
+
+// The currently mapped (restored) checkpoint.
+static struct {
+	void *addr;
+	size_t len;
+} mapping = { NULL, 0 };
+
+static void restore_param(const char *name, float *param, float stored,
+	bool given);
+static int write_all(int fd, struct iovec iov[], int iovcnt);
+
+int
+checkpoint_write(const char *path, const struct particle particles[],
+	unsigned step, float radius)
+{
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	int res			  = 0;
+
+	// The header is padded to a full page, so the particle array is page
+	// aligned within the file and can be mapped directly on restore.
+	char *header_page = calloc(1, page);
+	if (unlikely(header_page == NULL))
+		return ENOMEM;
+
+	struct checkpoint_header *header = (struct checkpoint_header *)header_page;
+	memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+	header->version		  = CHECKPOINT_VERSION;
+	header->particle_size = sizeof(struct particle);
+	header->offset		  = page;
+	header->particles	  = options.particles;
+	header->step		  = step;
+	header->radius		  = radius;
+	header->max_mass	  = options.max_mass;
+	header->theta		  = options.theta;
+	header->dt			  = options.dt;
+	header->seed		  = options.seed;
+	header->flags		  = (options.flat ? CHECKPOINT_FLAT : 0)
+		| (options.optimize ? CHECKPOINT_OPTIMIZE : 0);
+
+	const size_t tmp_len = strlen(path) + sizeof(".tmp");
+	char *tmp_path		 = malloc(tmp_len);
+	if (unlikely(tmp_path == NULL)) {
+		free(header_page);
+		return ENOMEM;
+	}
+	snprintf(tmp_path, tmp_len, "%s.tmp", path);
+
+	const int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		res = errno;
+		goto out;
+	}
+
+	// Header and particles are submitted with a single (vectored) write.
+	struct iovec iov[2] = {
+		{ .iov_base = header_page, .iov_len = page },
+		{ .iov_base = (void *)particles,
+			.iov_len = sizeof(struct particle) * options.particles },
+	};
+
+	if ((res = write_all(fd, iov, 2)) || (fsync(fd) && (res = errno))) {
+		close(fd);
+		unlink(tmp_path);
+		goto out;
+	}
+
+	if (close(fd) && (res = errno)) {
+		unlink(tmp_path);
+		goto out;
+	}
+
+	if (rename(tmp_path, path))
+		res = errno;
+
+out:
+	free(tmp_path);
+	free(header_page);
+	return res;
+}
+
+int
+checkpoint_restore(const char *path, struct particle **particles,
+	unsigned *step, float *radius)
+{
+	struct checkpoint_header header;
+	struct stat st;
+	int res = 0;
+
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return errno;
+
+	if (fstat(fd, &st)) {
+		res = errno;
+		goto out;
+	}
+
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+		|| memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC))) {
+		fprintf(stderr, "Invalid checkpoint file: %s\n", path);
+		res = EINVAL;
+		goto out;
+	}
+
+	if (header.version != CHECKPOINT_VERSION
+		|| header.particle_size != sizeof(struct particle)) {
+		fprintf(stderr, "Incompatible checkpoint file: %s (version %u)\n",
+			path, header.version);
+		res = EINVAL;
+		goto out;
+	}
+
+	// The particles follow the (page padded) header, aligned for direct use.
+	if (header.offset < sizeof(header)
+		|| header.offset % _Alignof(struct particle) != 0) {
+		fprintf(stderr, "Invalid checkpoint file: %s (particle offset)\n",
+			path);
+		res = EINVAL;
+		goto out;
+	}
+
+	if (header.particles
+		> (SIZE_MAX - header.offset) / sizeof(struct particle)) {
+		fprintf(stderr, "Invalid checkpoint file: %s (particle count)\n",
+			path);
+		res = EINVAL;
+		goto out;
+	}
+
+	const size_t len
+		= header.offset + sizeof(struct particle) * header.particles;
+	if ((size_t)st.st_size < len || header.particles == 0) {
+		fprintf(stderr, "Truncated checkpoint file: %s\n", path);
+		res = EINVAL;
+		goto out;
+	}
+
+	// The mapping is private (copy-on-write), the particle array can
+	// therefore be updated in place without ever touching the file.
+	void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+		res = errno;
+		goto out;
+	}
+
+	(void)posix_madvise(addr, len, POSIX_MADV_WILLNEED);
+
+	mapping.addr = addr;
+	mapping.len	 = len;
+
+	options.particles = header.particles;
+	options.max_mass  = header.max_mass;
+	options.seed	  = header.seed;
+	options.flat	  = header.flags & CHECKPOINT_FLAT;
+	options.radius	  = header.radius;
+	restore_param("theta", &options.theta, header.theta, options.theta_set);
+	restore_param("dt", &options.dt, header.dt, options.dt_set);
+	if (!options.optimize_set)
+		options.optimize = header.flags & CHECKPOINT_OPTIMIZE;
+
+	*particles = (struct particle *)((char *)addr + header.offset);
+	*step	   = header.step;
+	*radius	   = header.radius;
+
+out:
+	close(fd);
+	return res;
+}
+
+void
+checkpoint_unmap(void)
+{
+	if (mapping.addr == NULL)
+		return;
+
+	if (munmap(mapping.addr, mapping.len))
+		fprintf(stderr, "Failed to unmap checkpoint: %s\n", strerror(errno));
+
+	mapping.addr = NULL;
+	mapping.len	 = 0;
+}
+
+// Restores a run parameter from the checkpoint unless it was given on the
+// command line, which is reported if it differs from the stored one.
+static void
+restore_param(const char *name, float *param, float stored, bool given)
+{
+	if (!given)
+		*param = stored;
+	else if (*param != stored)
+		fprintf(stderr, "Using --%s=%g instead of the checkpoint's %g\n",
+			name, *param, stored);
+}
+
+static int
+write_all(int fd, struct iovec iov[], int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t n = writev(fd, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+
+		// Advance past all completely written buffers after a short write.
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,56 @@
+#include "barnes-hut/diagnostics.h"
+
+#include <math.h>
+
+#include "barnes-hut/direct.h"
+
+void
+diagnostics_slice(const struct particle_tree *tree,
+	const struct direct_sources *src, const struct particle_slice *slice,
+	struct diagnostics *diag)
+{
+	*diag = (struct diagnostics) { 0 };
+
+	for (size_t p = 0; p < slice->len; p++) {
+		const struct particle *ap = &slice->from[p];
+		const double m			  = ap->part.mass;
+		const double x = ap->part.pos.x, y = ap->part.pos.y, z = ap->part.pos.z;
+		const double vx = ap->vel.x, vy = ap->vel.y, vz = ap->vel.z;
+
+		diag->kinetic += 0.5 * m * (vx * vx + vy * vy + vz * vz);
+		// Each pair is part of both particles' potential.
+		diag->potential += 0.5
+			* ((src != NULL) ? direct_potential(src, &ap->part)
+							 : particle_tree_potential(tree, &ap->part));
+
+		diag->momentum[0] += m * vx;
+		diag->momentum[1] += m * vy;
+		diag->momentum[2] += m * vz;
+		diag->angular[0] += m * (y * vz - z * vy);
+		diag->angular[1] += m * (z * vx - x * vz);
+		diag->angular[2] += m * (x * vy - y * vx);
+	}
+}
+
+void
+diagnostics_add(struct diagnostics *sum, const struct diagnostics *diag)
+{
+	sum->kinetic += diag->kinetic;
+	sum->potential += diag->potential;
+	for (unsigned i = 0; i < 3; i++) {
+		sum->momentum[i] += diag->momentum[i];
+		sum->angular[i] += diag->angular[i];
+	}
+}
+
+double
+diagnostics_energy(const struct diagnostics *diag)
+{
+	return diag->kinetic + diag->potential;
+}
+
+double
+diagnostics_norm(const double v[3])
+{
+	return sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+}
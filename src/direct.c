@@ -0,0 +1,258 @@
+#include "barnes-hut/direct.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+#include "barnes-hut/common.h"
+
+// The number of sources per tile.
+//
+// A tile's coordinates and masses (16 KiB) stay within the L1 cache while all
+// targets of a block pass over them.
+#define DIRECT_SOURCES 1024
+// The number of targets per block.
+#define DIRECT_TARGETS 64
+
+static inline void tile_accel(const struct direct_sources *src, size_t from,
+	size_t to, const struct vec3 *pos, float acc[3]);
+multiversioned static void block_accel(const struct direct_sources *src,
+	const struct particle targets[], size_t len, float acc[][3]);
+
+int
+direct_parse(const char *arg, enum solver *solver)
+{
+	if (strcmp(arg, "tree") == 0)
+		*solver = SOLVER_TREE;
+	else if (strcmp(arg, "direct") == 0)
+		*solver = SOLVER_DIRECT;
+	else if (strcmp(arg, "auto") == 0)
+		*solver = SOLVER_AUTO;
+	else {
+		fprintf(stderr, "Invalid solver arg: %s\n", arg);
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+size_t
+direct_crossover(float theta)
+{
+	// Measured with uniform spheres on a single thread: both solvers take
+	// equally long at ~17k particles with theta 0.3, ~2k with 0.6 and below
+	// 1k with 1.0. The tree's work per particle grows with 1 / theta^3, which
+	// dominates its (logarithmic) dependency on the particle count. The force
+	// computations of both solvers scale alike with the thread count, so the
+	// crossover is independent of it.
+	static const double n = 17000.0, t = 0.3;
+	if (theta <= 0.0)
+		return SIZE_MAX;
+
+	return (size_t)(n * pow(t / theta, 3.0));
+}
+
+int
+direct_init(struct direct_sources *src, size_t len)
+{
+	const size_t padded
+		= (len + DIRECT_SOURCES - 1) / DIRECT_SOURCES * DIRECT_SOURCES;
+	float *memory = aligned_alloc(64, 4 * sizeof(float) * padded);
+	if (unlikely(memory == NULL))
+		return ENOMEM;
+
+	src->len	= len;
+	src->padded = padded;
+	src->x		= memory;
+	src->y		= &memory[padded];
+	src->z		= &memory[2 * padded];
+	src->m		= &memory[3 * padded];
+
+	for (size_t i = len; i < padded; i++) {
+		src->x[i] = src->y[i] = src->z[i] = 0.0;
+		src->m[i] = 0.0;
+	}
+
+	return 0;
+}
+
+void
+direct_deinit(struct direct_sources *src)
+{
+	free(src->x);
+	src->x = NULL;
+}
+
+void
+direct_pack(struct direct_sources *src, const struct particle particles[])
+{
+	for (size_t i = 0; i < src->len; i++) {
+		src->x[i] = particles[i].part.pos.x;
+		src->y[i] = particles[i].part.pos.y;
+		src->z[i] = particles[i].part.pos.z;
+		src->m[i] = particles[i].part.mass;
+	}
+}
+
+float
+direct_simulate(const struct direct_sources *src,
+	const struct particle_slice *slice, float dt)
+{
+	float max_dist_sq = 0.0;
+
+	for (size_t b = 0; b < slice->len; b += DIRECT_TARGETS) {
+		const size_t len = (slice->len - b < DIRECT_TARGETS)
+			? slice->len - b
+			: DIRECT_TARGETS;
+
+		float acc[DIRECT_TARGETS][3] = { { 0.0 } };
+		block_accel(src, &slice->from[b], len, acc);
+
+		for (size_t i = 0; i < len; i++) {
+			struct particle *ap = &slice->from[b + i];
+			const float gm		= PHYS_G * ap->part.mass;
+			const struct vec3 force
+				= { gm * acc[i][0], gm * acc[i][1], gm * acc[i][2] };
+
+			const float dist_sq = particle_advance(ap, force, dt);
+			if (dist_sq > max_dist_sq)
+				max_dist_sq = dist_sq;
+		}
+	}
+
+#ifdef STATS
+	tree_stats.pairs += slice->len * src->len;
+#endif // STATS
+
+	return sqrtf(max_dist_sq);
+}
+
+struct vec3
+direct_force(const struct direct_sources *src, const struct point_mass *part)
+{
+	float acc[3] = { 0.0 };
+	tile_accel(src, 0, src->padded, &part->pos, acc);
+
+	const float gm = PHYS_G * part->mass;
+	return (struct vec3) { gm * acc[0], gm * acc[1], gm * acc[2] };
+}
+
+float
+direct_potential(const struct direct_sources *src,
+	const struct point_mass *part)
+{
+	const float *restrict x = src->x;
+	const float *restrict y = src->y;
+	const float *restrict z = src->z;
+	const float *restrict m = src->m;
+	const float px			= part->pos.x, py = part->pos.y, pz = part->pos.z;
+
+	float sum = 0.0;
+	for (size_t j = 0; j < src->padded; j++) {
+		const float dx	 = x[j] - px;
+		const float dy	 = y[j] - py;
+		const float dz	 = z[j] - pz;
+		const float dist = fmaxf(sqrtf(dx * dx + dy * dy + dz * dz),
+			PHYS_MIN_DIST);
+		const float distinct = (float)((fabsf(dx) > PHYS_EPS)
+			| (fabsf(dy) > PHYS_EPS) | (fabsf(dz) > PHYS_EPS));
+		sum += distinct * m[j] / dist;
+	}
+
+	return -PHYS_G * part->mass * sum;
+}
+
+struct direct_error
+direct_accuracy(const struct direct_sources *src,
+	const struct particle_tree *tree, size_t samples)
+{
+	if (samples > src->len)
+		samples = src->len;
+
+	double sum_sq = 0.0;
+	float max	  = 0.0;
+	size_t len	  = 0;
+	for (size_t s = 0; s < samples; s++) {
+		const size_t i				 = s * src->len / samples;
+		const struct point_mass part = {
+			.pos  = { src->x[i], src->y[i], src->z[i] },
+			.mass = src->m[i],
+		};
+
+		const struct vec3 exact	 = direct_force(src, &part);
+		const struct vec3 approx = particle_tree_force(tree, &part);
+		const float norm		 = sqrtf(exact.x * exact.x + exact.y * exact.y
+			+ exact.z * exact.z);
+		// Particles without any net force have no meaningful relative error.
+		if (norm == 0.0)
+			continue;
+
+		const float dx	= approx.x - exact.x;
+		const float dy	= approx.y - exact.y;
+		const float dz	= approx.z - exact.z;
+		const float err = sqrtf(dx * dx + dy * dy + dz * dz) / norm;
+		sum_sq += (double)err * err;
+		if (err > max)
+			max = err;
+		len += 1;
+	}
+
+	return (struct direct_error) {
+		.rms = (len > 0) ? (float)sqrt(sum_sq / (double)len) : 0.0f,
+		.max = max,
+	};
+}
+
+// Accumulates the accelerations (divided by G) of the sources `from` to `to`
+// on the given position.
+//
+// The loop is free of branches, so it is vectorized by the compiler, and
+// mirrors `gforce` exactly.
+static inline void
+tile_accel(const struct direct_sources *src, size_t from, size_t to,
+	const struct vec3 *pos, float acc[3])
+{
+	const float *restrict x = src->x;
+	const float *restrict y = src->y;
+	const float *restrict z = src->z;
+	const float *restrict m = src->m;
+	const float px			= pos->x, py = pos->y, pz = pos->z;
+
+	float ax = 0.0, ay = 0.0, az = 0.0;
+	for (size_t j = from; j < to; j++) {
+		const float dx = x[j] - px;
+		const float dy = y[j] - py;
+		const float dz = z[j] - pz;
+
+		const float dist = fmaxf(sqrtf(dx * dx + dy * dy + dz * dz),
+			PHYS_MIN_DIST);
+		// Equal positions exert no force, the mask avoids a branch.
+		const float distinct = (float)((fabsf(dx) > PHYS_EPS)
+			| (fabsf(dy) > PHYS_EPS) | (fabsf(dz) > PHYS_EPS));
+		const float s = distinct * m[j] / (dist * dist * dist);
+
+		ax += dx * s;
+		ay += dy * s;
+		az += dz * s;
+	}
+
+	acc[0] += ax;
+	acc[1] += ay;
+	acc[2] += az;
+}
+
+// Accumulates the accelerations (divided by G) of all sources on the given
+// targets, with all targets passing over one source tile before the next.
+static void
+block_accel(const struct direct_sources *src, const struct particle targets[],
+	size_t len, float acc[][3])
+{
+	for (size_t j = 0; j < src->padded; j += DIRECT_SOURCES)
+		for (size_t i = 0; i < len; i++)
+			tile_accel(src, j, j + DIRECT_SOURCES, &targets[i].part.pos,
+				acc[i]);
+}
@@ -0,0 +1,630 @@
+// Required for `mkdtemp`.
+#define _XOPEN_SOURCE 700
+
+#include "barnes-hut/dist.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+#include "barnes-hut/arena.h"
+#include "barnes-hut/common.h"
+#include "barnes-hut/options.h"
+#include "barnes-hut/phys.h"
+#include "barnes-hut/transport.h"
+
+#ifdef USE_MT19937
+#include "barnes-hut/mt19937_64.h"
+#endif // USE_MT19937
+
+// The number of octree levels of the Morton key buckets along which the
+// domains are split (8^5 buckets).
+#define DIST_LEVELS 5
+#define DIST_BUCKETS ((size_t)1 << (3 * DIST_LEVELS))
+
+// The bounding box of the particles of a rank.
+struct domain {
+	struct vec3 lo, hi;
+	// The number of particles within the box (0 means the box is invalid).
+	uint64_t len;
+};
+
+// The results of a rank's latest step.
+struct rank_stats {
+	// The greatest distance to the center of any of the rank's particles.
+	float radius;
+	// The number of the rank's own and imported particles.
+	uint64_t len, imported;
+	// The times of the step's phases.
+	long decompose_us, build_us, exchange_us, simulate_us;
+};
+
+// The state of this rank.
+static struct {
+	struct transport net;
+	// The rank's own particles, followed by the imported pseudo-particles.
+	struct particle *particles;
+	size_t len, imported, cap;
+	// The particles sorted by destination rank for migration.
+	struct particle *sorted;
+	size_t sorted_cap;
+	// The tree of the own particles, later of all particles.
+	struct particle_tree tree;
+	// The memory arena for octant allocation.
+	struct arena arena;
+	// The Morton key bucket of each own particle.
+	uint32_t *buckets;
+	size_t buckets_cap;
+	// The local and global histograms of the Morton key buckets and the rank
+	// owning each bucket.
+	uint32_t *counts, *totals, *received;
+	unsigned *owners;
+	// The number of the own particles destined for each rank.
+	size_t *sends;
+	// The domains and step results of all ranks.
+	struct domain *domains;
+	struct rank_stats *stats;
+	// The locally essential pseudo-particles for and from a single rank.
+	struct point_mass *let, *imports;
+	size_t let_len, let_cap, imports_cap;
+} dist = { .tree = { .root = ARENA_NULL, .arena = &dist.arena } };
+
+static int check_options(void);
+static int dist_run(const char *transport);
+static int dist_init(void);
+static void dist_deinit(void);
+static int decompose(float radius);
+static int exchange_essential(void);
+static int reserve(void **buf, size_t *cap, size_t len, size_t size);
+static inline unsigned peer_to(unsigned k);
+static inline unsigned peer_from(unsigned k);
+static inline long time_diff(const struct timespec *start,
+	const struct timespec *stop);
+
+int
+dist_main(void)
+{
+	int res;
+	if ((res = check_options()))
+		return res;
+
+	if (options.rank >= 0)
+		return dist_run(options.transport);
+
+	// Launch all ranks on this machine.
+	char dir[] = "/tmp/barnes-hut-XXXXXX";
+	char spec[sizeof(dir) + 5];
+	if (options.transport == NULL) {
+		if (mkdtemp(dir) == NULL) {
+			res = errno;
+			fprintf(stderr, "Failed to create transport directory: %s\n",
+				strerror(res));
+			return res;
+		}
+		snprintf(spec, sizeof(spec), "unix:%s", dir);
+	}
+	const char *transport = (options.transport) ? options.transport : spec;
+
+	pid_t *pids = malloc(sizeof(pid_t) * options.ranks);
+	if (unlikely(pids == NULL))
+		return ENOMEM;
+
+	// Nothing buffered may be written twice by the forked processes.
+	fflush(stdout);
+	fflush(stderr);
+
+	unsigned r;
+	for (r = 1; r < options.ranks; r++) {
+		if ((pids[r] = fork()) < 0) {
+			res = errno;
+			fprintf(stderr, "Failed to fork rank %u: %s\n", r, strerror(res));
+			break;
+		}
+		if (pids[r] == 0) {
+			options.rank = (int)r;
+			res			 = dist_run(transport);
+			fflush(stdout);
+			_exit((res > 0) ? res : 0);
+		}
+	}
+
+	if (r == options.ranks) {
+		options.rank = 0;
+		res			 = dist_run(transport);
+	}
+
+	for (unsigned i = 1; i < r; i++) {
+		int status;
+		if (waitpid(pids[i], &status, 0) < 0)
+			continue;
+		if (WIFEXITED(status) && WEXITSTATUS(status)) {
+			fprintf(stderr, "Rank %u failed: %s\n", i,
+				strerror(WEXITSTATUS(status)));
+			if (res == 0)
+				res = WEXITSTATUS(status);
+		} else if (WIFSIGNALED(status)) {
+			fprintf(stderr, "Rank %u terminated by signal %d\n", i,
+				WTERMSIG(status));
+			if (res == 0)
+				res = ECHILD;
+		}
+	}
+
+	free(pids);
+	if (options.transport == NULL)
+		(void)rmdir(dir);
+	return res;
+}
+
+// Rejects all options that require the particles of all ranks in a single
+// process.
+static int
+check_options(void)
+{
+	const struct {
+		bool set;
+		const char *name;
+	} unsupported[] = {
+		{ options.threads > 1, "threads" },
+		{ options.solver != SOLVER_TREE && options.solver != SOLVER_AUTO,
+			"solver" },
+		{ options.optimize, "optimize" },
+		{ options.checkpoint != NULL, "checkpoint" },
+		{ options.restore != NULL, "restore" },
+		{ options.snapshot != NULL, "snapshot" },
+		{ options.frames != NULL, "frames" },
+		{ options.shm != NULL, "shm" },
+		{ options.phases != NULL, "phases" },
+		{ options.trace != NULL, "trace" },
+		{ options.accuracy > 0, "accuracy" },
+		{ options.diagnostics > 0, "diagnostics" },
+		{ options.packed, "packed" },
+		{ options.autotune > 0, "autotune" },
+	};
+
+#ifdef RENDER
+	fprintf(stderr, "Invalid ranks arg: Not supported by RENDER builds\n");
+	return EINVAL;
+#endif // RENDER
+
+	for (size_t i = 0; i < sizeof(unsupported) / sizeof(unsupported[0]); i++)
+		if (unsupported[i].set) {
+			fprintf(stderr,
+				"Invalid ranks arg: Not supported with --%s (each rank is "
+				"a single-threaded process)\n",
+				unsupported[i].name);
+			return EINVAL;
+		}
+
+	if (options.rank >= (int)options.ranks) {
+		fprintf(stderr, "Invalid rank arg: Must be less than ranks\n");
+		return EINVAL;
+	}
+	if (options.rank >= 0 && options.transport == NULL) {
+		fprintf(stderr, "Invalid rank arg: Requires --transport\n");
+		return EINVAL;
+	}
+	if (options.particles < options.ranks) {
+		fprintf(stderr, "Invalid ranks arg: More ranks than particles\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+static int
+dist_run(const char *transport)
+{
+	const unsigned rank = (unsigned)options.rank;
+	int res;
+
+	if ((res = transport_open(&dist.net, transport, rank, options.ranks))) {
+		fprintf(stderr, "Failed to connect rank %u: %s\n", rank,
+			strerror(res));
+		return res;
+	}
+	if ((res = dist_init()))
+		goto out;
+
+	if (rank == 0) {
+		if (options.verbose)
+			fprintf(stderr, "begin simulation with %u ranks ...\n",
+				options.ranks);
+		else
+			fprintf(stdout,
+				"step,decompose,build,exchange,simulate,particles_min,"
+				"particles_max,imported\n");
+	}
+
+	float radius = options.radius;
+	for (unsigned step = 0; options.steps == 0 || step < options.steps;
+		 step++) {
+		struct timespec t0, t1, t2, t3, t4, t5;
+		struct rank_stats *mine = &dist.stats[rank];
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if ((res = decompose(radius)))
+			goto out;
+
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		if (dist.len > 0
+			&& (res = particle_tree_build(&dist.tree, dist.particles, dist.len,
+					radius)))
+			goto out;
+
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		if ((res = exchange_essential()))
+			goto out;
+
+		// The forces on the own particles are computed with a tree of the own
+		// and all imported particles.
+		clock_gettime(CLOCK_MONOTONIC, &t3);
+		if (dist.len > 0
+			&& (res = particle_tree_build(&dist.tree, dist.particles,
+					dist.len + dist.imported, radius)))
+			goto out;
+
+		clock_gettime(CLOCK_MONOTONIC, &t4);
+		const struct particle_slice slice = {
+			.offset = 0,
+			.len	= dist.len,
+			.from	= dist.particles,
+		};
+		mine->radius = (dist.len > 0)
+			? particle_tree_simulate(&dist.tree, &slice, options.dt)
+			: 0.0;
+		clock_gettime(CLOCK_MONOTONIC, &t5);
+
+		mine->len		   = dist.len;
+		mine->imported	   = dist.imported;
+		mine->decompose_us = time_diff(&t0, &t1);
+		mine->build_us	   = time_diff(&t1, &t2) + time_diff(&t3, &t4);
+		mine->exchange_us  = time_diff(&t2, &t3);
+		mine->simulate_us  = time_diff(&t4, &t5);
+
+		for (unsigned k = 1; k < options.ranks; k++) {
+			const unsigned from = peer_from(k);
+			if ((res = transport_exchange(&dist.net, peer_to(k), mine,
+					 sizeof(*mine), from, &dist.stats[from],
+					 sizeof(dist.stats[from]))))
+				goto out;
+		}
+
+		// All ranks agree on the radius of the next step, the times are those
+		// of the slowest rank.
+		struct rank_stats max = *mine;
+		uint64_t min_len	  = mine->len;
+		uint64_t imported	  = 0;
+		for (unsigned r = 0; r < options.ranks; r++) {
+			const struct rank_stats *stats = &dist.stats[r];
+			if (stats->radius > max.radius)
+				max.radius = stats->radius;
+			if (stats->len < min_len)
+				min_len = stats->len;
+			if (stats->len > max.len)
+				max.len = stats->len;
+			if (stats->decompose_us > max.decompose_us)
+				max.decompose_us = stats->decompose_us;
+			if (stats->build_us > max.build_us)
+				max.build_us = stats->build_us;
+			if (stats->exchange_us > max.exchange_us)
+				max.exchange_us = stats->exchange_us;
+			if (stats->simulate_us > max.simulate_us)
+				max.simulate_us = stats->simulate_us;
+			imported += stats->imported;
+		}
+		radius = max.radius;
+
+		if (rank != 0)
+			continue;
+		if (options.verbose)
+			fprintf(stderr,
+				"step t = %u:\n"
+				"\tdecomposed in: %ld us, %llu..%llu particles per rank\n"
+				"\tbuilt trees in: %ld us, %llu imported pseudo-particles\n"
+				"\texchanged essential trees in: %ld us\n"
+				"\tsimulation in: %ld us, %.3f radius\n",
+				step, max.decompose_us, (unsigned long long)min_len,
+				(unsigned long long)max.len, max.build_us,
+				(unsigned long long)imported, max.exchange_us,
+				max.simulate_us, radius);
+		else
+			fprintf(stdout, "%u,%ld,%ld,%ld,%ld,%llu,%llu,%llu\n", step,
+				max.decompose_us, max.build_us, max.exchange_us,
+				max.simulate_us, (unsigned long long)min_len,
+				(unsigned long long)max.len, (unsigned long long)imported);
+	}
+
+out:
+	if (res)
+		fprintf(stderr, "Rank %u failed: %s\n", rank, strerror(res));
+	dist_deinit();
+	transport_close(&dist.net);
+	return res;
+}
+
+static int
+dist_init(void)
+{
+	const unsigned rank = dist.net.rank;
+	const size_t ranks	= dist.net.ranks;
+	int res;
+
+	// A rank's tree holds a varying share of the particles and the imported
+	// pseudo-particles, so the arena is reserved (lazily backed by pages) for
+	// all particles.
+	if ((res = particle_tree_arena_init(&dist.arena, options.particles)))
+		return res;
+	dist.tree.theta = options.theta;
+
+	dist.counts	  = malloc(sizeof(uint32_t) * DIST_BUCKETS);
+	dist.totals	  = malloc(sizeof(uint32_t) * DIST_BUCKETS);
+	dist.received = malloc(sizeof(uint32_t) * DIST_BUCKETS);
+	dist.owners	  = malloc(sizeof(unsigned) * DIST_BUCKETS);
+	dist.sends	  = malloc(sizeof(size_t) * ranks);
+	dist.domains  = malloc(sizeof(struct domain) * ranks);
+	dist.stats	  = calloc(ranks, sizeof(struct rank_stats));
+	if (dist.counts == NULL || dist.totals == NULL || dist.received == NULL
+		|| dist.owners == NULL || dist.sends == NULL || dist.domains == NULL
+		|| dist.stats == NULL)
+		return ENOMEM;
+
+	// Each rank starts with an equal share of the particles, randomized
+	// exactly as by a single process.
+	const size_t from = rank * options.particles / ranks;
+	const size_t len  = (rank + 1) * options.particles / ranks - from;
+	if ((res = reserve((void **)&dist.particles, &dist.cap, len,
+			 sizeof(struct particle))))
+		return res;
+
+#ifdef USE_MT19937
+	struct mt19937_64 rng;
+	mt1993764_init_state(&rng, (options.seed != 0) ? options.seed : 5489ULL);
+	for (unsigned r = 0; r < rank; r++)
+		if ((res = mt1993764_jump(&rng)))
+			return res;
+	randomize_particles(dist.particles, from, len, &options, &rng);
+#else
+	randomize_particles(dist.particles, from, len, &options, NULL);
+#endif // USE_MT19937
+	dist.len = len;
+
+	return 0;
+}
+
+static void
+dist_deinit(void)
+{
+	free(dist.particles);
+	free(dist.sorted);
+	free(dist.buckets);
+	free(dist.counts);
+	free(dist.totals);
+	free(dist.received);
+	free(dist.owners);
+	free(dist.sends);
+	free(dist.domains);
+	free(dist.stats);
+	free(dist.let);
+	free(dist.imports);
+	arena_deinit(&dist.arena);
+}
+
+// Splits the key space of `options.order` into one contiguous range per rank,
+// each holding about the same number of particles, and migrates all own
+// particles outside of the rank's range to their new owners.
+static int
+decompose(float radius)
+{
+	const unsigned rank	 = dist.net.rank;
+	const unsigned ranks = dist.net.ranks;
+	const unsigned shift = 63 - 3 * DIST_LEVELS;
+	int res;
+
+	if ((res = reserve((void **)&dist.buckets, &dist.buckets_cap, dist.len,
+			 sizeof(uint32_t))))
+		return res;
+
+	memset(dist.counts, 0, sizeof(uint32_t) * DIST_BUCKETS);
+	for (size_t i = 0; i < dist.len; i++) {
+		const uint64_t key
+			= particle_key(&dist.particles[i].part, radius, options.order);
+		const uint32_t bucket = (uint32_t)(key >> shift);
+		dist.buckets[i] = bucket;
+		dist.counts[bucket] += 1;
+	}
+
+	// Sum the histograms of all ranks.
+	memcpy(dist.totals, dist.counts, sizeof(uint32_t) * DIST_BUCKETS);
+	for (unsigned k = 1; k < ranks; k++) {
+		if ((res = transport_exchange(&dist.net, peer_to(k), dist.counts,
+				 sizeof(uint32_t) * DIST_BUCKETS, peer_from(k), dist.received,
+				 sizeof(uint32_t) * DIST_BUCKETS)))
+			return res;
+		for (size_t b = 0; b < DIST_BUCKETS; b++)
+			dist.totals[b] += dist.received[b];
+	}
+
+	// Each bucket belongs to the rank its median particle falls into, which
+	// all ranks compute alike from the same histogram.
+	uint64_t total = 0;
+	for (size_t b = 0; b < DIST_BUCKETS; b++)
+		total += dist.totals[b];
+	uint64_t prefix = 0;
+	for (size_t b = 0; b < DIST_BUCKETS; b++) {
+		const uint64_t owner = (prefix + dist.totals[b] / 2) * ranks / total;
+		dist.owners[b]		 = (owner < ranks) ? (unsigned)owner : ranks - 1;
+		prefix += dist.totals[b];
+	}
+
+	// Sort the own particles by destination rank (counting sort).
+	if ((res = reserve((void **)&dist.sorted, &dist.sorted_cap, dist.len,
+			 sizeof(struct particle))))
+		return res;
+	memset(dist.sends, 0, sizeof(size_t) * ranks);
+	for (size_t i = 0; i < dist.len; i++)
+		dist.sends[dist.owners[dist.buckets[i]]] += 1;
+
+	size_t offset = 0;
+	for (unsigned r = 0; r < ranks; r++) {
+		const size_t len = dist.sends[r];
+		dist.sends[r]	 = offset;
+		offset += len;
+	}
+	for (size_t i = 0; i < dist.len; i++)
+		dist.sorted[dist.sends[dist.owners[dist.buckets[i]]]++]
+			= dist.particles[i];
+	// `sends[r]` is now the end of rank r's particles.
+
+	// Keep the particles staying with this rank, then receive the migrating
+	// ones from all other ranks.
+	const size_t begin = (rank > 0) ? dist.sends[rank - 1] : 0;
+	dist.len		   = dist.sends[rank] - begin;
+	memcpy(dist.particles, &dist.sorted[begin],
+		sizeof(struct particle) * dist.len);
+
+	for (unsigned k = 1; k < ranks; k++) {
+		const unsigned to	= peer_to(k);
+		const size_t sbegin = (to > 0) ? dist.sends[to - 1] : 0;
+		const uint64_t slen = dist.sends[to] - sbegin;
+		uint64_t rlen;
+
+		if ((res = transport_exchange(&dist.net, to, &slen, sizeof(slen),
+				 peer_from(k), &rlen, sizeof(rlen))))
+			return res;
+		if ((res = reserve((void **)&dist.particles, &dist.cap,
+				 dist.len + rlen, sizeof(struct particle))))
+			return res;
+		if ((res = transport_exchange(&dist.net, to, &dist.sorted[sbegin],
+				 sizeof(struct particle) * slen, peer_from(k),
+				 &dist.particles[dist.len], sizeof(struct particle) * rlen)))
+			return res;
+		dist.len += rlen;
+	}
+
+	return 0;
+}
+
+// Exchanges the bounding boxes of all ranks and sends each rank the locally
+// essential pseudo-particles of the own tree for its box, appending those
+// received from all other ranks to the own particles.
+static int
+exchange_essential(void)
+{
+	const unsigned rank	 = dist.net.rank;
+	const unsigned ranks = dist.net.ranks;
+	int res;
+
+	struct domain *mine = &dist.domains[rank];
+	*mine				= (struct domain) { .len = dist.len };
+	if (dist.len > 0)
+		mine->lo = mine->hi = dist.particles[0].part.pos;
+	for (size_t i = 1; i < dist.len; i++) {
+		const struct vec3 *pos = &dist.particles[i].part.pos;
+		mine->lo.x			   = (pos->x < mine->lo.x) ? pos->x : mine->lo.x;
+		mine->lo.y			   = (pos->y < mine->lo.y) ? pos->y : mine->lo.y;
+		mine->lo.z			   = (pos->z < mine->lo.z) ? pos->z : mine->lo.z;
+		mine->hi.x			   = (pos->x > mine->hi.x) ? pos->x : mine->hi.x;
+		mine->hi.y			   = (pos->y > mine->hi.y) ? pos->y : mine->hi.y;
+		mine->hi.z			   = (pos->z > mine->hi.z) ? pos->z : mine->hi.z;
+	}
+
+	for (unsigned k = 1; k < ranks; k++) {
+		const unsigned from = peer_from(k);
+		if ((res = transport_exchange(&dist.net, peer_to(k), mine,
+				 sizeof(*mine), from, &dist.domains[from],
+				 sizeof(dist.domains[from]))))
+			return res;
+	}
+
+	dist.imported = 0;
+	for (unsigned k = 1; k < ranks; k++) {
+		const unsigned to	 = peer_to(k);
+		const struct domain *domain = &dist.domains[to];
+
+		dist.let_len = 0;
+		if (dist.len > 0 && domain->len > 0
+			&& (res = particle_tree_essential(&dist.tree, &domain->lo,
+					&domain->hi, &dist.let, &dist.let_len, &dist.let_cap)))
+			return res;
+
+		const uint64_t slen = dist.let_len;
+		uint64_t rlen;
+		if ((res = transport_exchange(&dist.net, to, &slen, sizeof(slen),
+				 peer_from(k), &rlen, sizeof(rlen))))
+			return res;
+		if ((res = reserve((void **)&dist.imports, &dist.imports_cap, rlen,
+				 sizeof(struct point_mass))))
+			return res;
+		if ((res = transport_exchange(&dist.net, to, dist.let,
+				 sizeof(struct point_mass) * slen, peer_from(k), dist.imports,
+				 sizeof(struct point_mass) * rlen)))
+			return res;
+
+		// The pseudo-particles are inserted into the force tree alongside the
+		// own particles, but never advanced.
+		const size_t end = dist.len + dist.imported;
+		if ((res = reserve((void **)&dist.particles, &dist.cap, end + rlen,
+				 sizeof(struct particle))))
+			return res;
+		for (size_t i = 0; i < rlen; i++)
+			dist.particles[end + i] = (struct particle) {
+				.part = dist.imports[i],
+				.vel  = { 0.0, 0.0, 0.0 },
+			};
+		dist.imported += rlen;
+	}
+
+	return 0;
+}
+
+// Grows the given buffer to hold at least `len` elements of `size` bytes.
+static int
+reserve(void **buf, size_t *cap, size_t len, size_t size)
+{
+	if (len <= *cap)
+		return 0;
+
+	size_t new_cap = (*cap > 0) ? *cap : 1024;
+	while (new_cap < len)
+		new_cap *= 2;
+
+	void *resized = realloc(*buf, size * new_cap);
+	if (unlikely(resized == NULL))
+		return ENOMEM;
+
+	*buf = resized;
+	*cap = new_cap;
+	return 0;
+}
+
+// Returns the rank to send to in round `k` of a pairwise exchange, in which
+// every rank sends to the rank `k` after and receives from the rank `k`
+// before itself.
+static inline unsigned
+peer_to(unsigned k)
+{
+	return (dist.net.rank + k) % dist.net.ranks;
+}
+
+// Returns the rank to receive from in round `k` of a pairwise exchange.
+static inline unsigned
+peer_from(unsigned k)
+{
+	return (dist.net.rank + dist.net.ranks - k) % dist.net.ranks;
+}
+
+static inline long
+time_diff(const struct timespec *start, const struct timespec *stop)
+{
+	return (stop->tv_sec - start->tv_sec) * (long)1e6
+		+ ((stop->tv_nsec - start->tv_nsec) / (long)1e3);
+}
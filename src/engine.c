@@ -0,0 +1,594 @@
+// Required for `pthread_barrier` and `pthread_setaffinity_np`.
+#ifdef __linux
+#define _GNU_SOURCE
+#endif // __linux
+
+#include "barnes-hut/engine.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "barnes-hut/affinity.h"
+#include "barnes-hut/barneshut.h"
+#include "barnes-hut/common.h"
+#include "barnes-hut/frames.h"
+#include "barnes-hut/options.h"
+#include "barnes-hut/phys.h"
+#include "barnes-hut/profile.h"
+#include "barnes-hut/sim.h"
+
+// Positions and velocities are handed out as floats with a particle's stride.
+_Static_assert(sizeof(struct particle) % sizeof(float) == 0,
+	"particles must be a multiple of floats");
+
+#ifdef STATS
+static const size_t kib = (size_t)1 << 10;
+static const size_t mib = kib << 10;
+#endif // STATS
+
+static inline long time_diff(const struct timespec *start,
+	const struct timespec *stop);
+static inline bool sort_step(const struct options *opts, unsigned step);
+static int start(struct bh_sim *ctx);
+static void launch(struct bh_sim *ctx, int res);
+static void *thread_main(void *args);
+static int thread_init(struct thread_state *state);
+static int thread_step(struct thread_state *state, unsigned step, long *us);
+static int build_step(struct bh_sim *ctx, long *us);
+static void sync_tree_particles(const struct bh_sim *ctx,
+	struct particle tree_particles[], const struct particle_slice *slice);
+
+int
+bh_create(struct bh_sim **ctx)
+{
+	struct bh_sim *new = calloc(1, sizeof(struct bh_sim));
+	if (unlikely(new == NULL))
+		return ENOMEM;
+
+	// The command line interface creates its context after parsing, all
+	// others never modify the defaults.
+	new->opts = options;
+	*ctx	  = new;
+
+	return 0;
+}
+
+int
+bh_configure(struct bh_sim *ctx, const char *name, const char *value)
+{
+	// Options which rely on process-wide writers set up by the command line.
+	static const char *const cli_only[] = { "checkpoint", "restore",
+		"snapshot", "frames", "shm", "phases", "trace", "pin", "ranks", "rank",
+		"transport", "ensemble", "autotune", "autotune-cache" };
+
+	if (ctx->states != NULL)
+		return EBUSY;
+	for (size_t i = 0; i < sizeof(cli_only) / sizeof(cli_only[0]); i++)
+		if (strcmp(name, cli_only[i]) == 0)
+			return ENOTSUP;
+
+	// The options are parsed without any global state, so contexts can be
+	// configured concurrently.
+	struct options opts = ctx->opts;
+	const int res		= options_set(&opts, name, value);
+	if (res)
+		return (res > 0) ? res : EINVAL;
+
+	ctx->opts = opts;
+	return 0;
+}
+
+int
+bh_load_particles(struct bh_sim *ctx, size_t len, const float *pos,
+	const float *vel, const float *mass)
+{
+	if (ctx->states != NULL)
+		return EBUSY;
+	if (len == 0)
+		return EINVAL;
+
+	struct particle *particles = malloc(sizeof(struct particle) * len);
+	if (unlikely(particles == NULL))
+		return ENOMEM;
+
+	for (size_t p = 0; p < len; p++)
+		particles[p] = (struct particle) {
+			.part = {
+				.pos  = { pos[3 * p], pos[3 * p + 1], pos[3 * p + 2] },
+				.mass = (mass) ? mass[p] : ctx->opts.max_mass,
+			},
+			.vel = (vel) ? (struct vec3) { vel[3 * p], vel[3 * p + 1],
+							   vel[3 * p + 2] }
+						 : (struct vec3) { 0.0, 0.0, 0.0 },
+		};
+
+	if (ctx->owned)
+		free(ctx->particles);
+	ctx->particles = particles;
+	ctx->len	   = len;
+	ctx->owned	   = true;
+
+	return 0;
+}
+
+int
+bh_adopt_particles(struct bh_sim *ctx, struct particle particles[],
+	size_t len, unsigned step)
+{
+	if (ctx->states != NULL)
+		return EBUSY;
+
+	if (ctx->owned)
+		free(ctx->particles);
+	ctx->particles = particles;
+	ctx->len	   = len;
+	ctx->owned	   = false;
+	ctx->step	   = step;
+
+	return 0;
+}
+
+int
+bh_step(struct bh_sim *ctx)
+{
+	int res;
+
+	if (ctx->error)
+		return ctx->error;
+	if (!ctx->running && (res = start(ctx)))
+		goto fail;
+
+	struct thread_state *state = &ctx->states[0];
+	profile_step(0, ctx->step);
+	if ((res = build_step(ctx, &ctx->build_us)))
+		goto fail;
+	if ((res = thread_step(state, ctx->step, &ctx->step_us)))
+		goto fail;
+
+	// Recalculate the radius for the next iteration step.
+	//
+	// All other threads will wait in barrier, so it is safe to iterate and
+	// update each thread's radius.
+	const unsigned threads = ctx->sim.opts.threads;
+	float max_radius	   = 0.0;
+	for (unsigned t = 0; t < threads; t++) {
+		const float radius = ctx->states[t].radius;
+		if (radius > max_radius)
+			max_radius = radius;
+	}
+
+	for (unsigned t = 0; t < threads; t++)
+		ctx->states[t].radius = max_radius;
+	ctx->sim.radius = max_radius;
+	ctx->step += 1;
+
+	return 0;
+
+fail:
+	// All other threads either failed to start or exited.
+	ctx->running = false;
+	ctx->error	 = res;
+	return res;
+}
+
+const float *
+bh_positions(const struct bh_sim *ctx, size_t *len, size_t *stride)
+{
+	*len	= ctx->len;
+	*stride = sizeof(struct particle) / sizeof(float);
+	return (ctx->particles) ? &ctx->particles[0].part.pos.x : NULL;
+}
+
+const float *
+bh_velocities(const struct bh_sim *ctx, size_t *len, size_t *stride)
+{
+	*len	= ctx->len;
+	*stride = sizeof(struct particle) / sizeof(float);
+	return (ctx->particles) ? &ctx->particles[0].vel.x : NULL;
+}
+
+unsigned
+bh_steps(const struct bh_sim *ctx)
+{
+	return ctx->step;
+}
+
+void
+bh_destroy(struct bh_sim *ctx)
+{
+	if (ctx->running) {
+		// Release the threads waiting for the next step.
+		atomic_store_explicit(&ctx->thread_errno, BHE_EARLY_EXIT,
+			memory_order_release);
+		pthread_barrier_wait(&ctx->barrier);
+	}
+
+	verbose_printf("joining threads %u ...\n", ctx->started);
+	for (unsigned t = 1; t <= ctx->started; t++) {
+		void *thread_res;
+		pthread_join(ctx->threads[t - 1], &thread_res);
+
+		int tres = (int)((uintptr_t)thread_res);
+		if (tres > 0)
+			fprintf(stderr, "Error in joined thread %u: %s\n", t,
+				strerror(tres));
+	}
+
+	if (ctx->states != NULL) {
+		for (unsigned t = 0; t < ctx->sim.opts.threads; t++)
+			free(ctx->states[t].particles);
+#ifdef STATS
+		verbose_printf("arena high-water mark: %zu octants (%.1f MiB)\n",
+			(size_t)ctx->sim.arena_peak,
+			(double)ctx->sim.arena_peak * sizeof(struct octant) / mib);
+#endif // STATS
+		sim_deinit(&ctx->sim);
+		arena_deinit(&ctx->arena);
+		pthread_cond_destroy(&ctx->launch_cond);
+		pthread_mutex_destroy(&ctx->launch_lock);
+		pthread_barrier_destroy(&ctx->barrier);
+	}
+
+	free(ctx->threads);
+	free(ctx->states);
+	if (ctx->owned)
+		free(ctx->particles);
+	free(ctx);
+}
+
+static inline long
+time_diff(const struct timespec *start, const struct timespec *stop)
+{
+	return (stop->tv_sec - start->tv_sec) * (long)1e6
+		+ ((stop->tv_nsec - start->tv_nsec) / (long)1e3);
+}
+
+// Returns whether `sim_build` sorts the particles in the given step.
+static inline bool
+sort_step(const struct options *opts, unsigned step)
+{
+	return opts->optimize && step % opts->sort_every == 0;
+}
+
+// Allocates the simulation's state and spawns all threads, which randomize the
+// particles unless they were loaded.
+static int
+start(struct bh_sim *ctx)
+{
+	int res;
+
+	if (ctx->particles != NULL)
+		ctx->opts.particles = ctx->len;
+	const unsigned threads = ctx->opts.threads;
+	if (threads == 0 || ctx->opts.particles == 0)
+		return EINVAL;
+
+	struct thread_state *states = calloc(threads, sizeof(struct thread_state));
+	pthread_t *handles			= malloc(sizeof(pthread_t) * threads);
+	if (unlikely(states == NULL || handles == NULL)) {
+		res = ENOMEM;
+		goto free;
+	}
+	if ((res = pthread_barrier_init(&ctx->barrier, NULL, threads)))
+		goto free;
+	if ((res = pthread_mutex_init(&ctx->launch_lock, NULL)))
+		goto barrier;
+	if ((res = pthread_cond_init(&ctx->launch_cond, NULL)))
+		goto lock;
+	if (unlikely((res = particle_tree_arena_init(&ctx->arena,
+					  ctx->opts.particles)))) {
+		if (res == EOVERFLOW)
+			fprintf(stderr, "Too many particles for 32-bit octant indices, "
+							"rebuild with LARGE=1\n");
+		goto cond;
+	}
+	// The simulation is initialized with the (possibly loaded) particle
+	// count, a partially initialized one is released by `sim_deinit`.
+	if ((res = sim_init(&ctx->sim, &ctx->opts, &ctx->arena)))
+		goto sim;
+
+	if (ctx->particles == NULL) {
+		// The particles are randomized by all threads in `thread_init`, so
+		// the memory is deliberately left untouched here.
+		ctx->particles = malloc(sizeof(struct particle) * ctx->opts.particles);
+		if (unlikely(ctx->particles == NULL)) {
+			res = ENOMEM;
+			goto sim;
+		}
+		ctx->len	   = ctx->opts.particles;
+		ctx->owned	   = true;
+		ctx->randomize = true;
+
+		verbose_printf("randomizing %zu particles within radius %.3f.\n",
+			ctx->opts.particles, ctx->opts.radius);
+	}
+	ctx->sim.particles = ctx->particles;
+
+#ifdef USE_MT19937
+	// Derive non-overlapping streams for all threads from the seeded state.
+	struct mt19937_64 rng;
+	mt1993764_init_state(&rng,
+		(ctx->opts.seed != 0) ? ctx->opts.seed : 5489ULL);
+	for (unsigned t = 0; t < threads; t++) {
+		states[t].rng = rng;
+		if (t + 1 < threads && (res = mt1993764_jump(&rng)))
+			goto sim;
+	}
+#endif // USE_MT19937
+
+	for (unsigned t = 0; t < threads; t++) {
+		states[t].id  = t;
+		states[t].ctx = ctx;
+	}
+	ctx->states	 = states;
+	ctx->threads = handles;
+
+	// Spawn p - 1 additional worker threads. They wait to be launched, as
+	// the barrier in `thread_init` needs all of them: if creating one fails,
+	// the started ones exit instead and are joined by `bh_destroy`.
+	for (unsigned t = 1; t < threads; t++) {
+		if ((res = pthread_create(&handles[t - 1], NULL, thread_main,
+				 &states[t]))) {
+			launch(ctx, res);
+			return res;
+		}
+		ctx->started += 1;
+	}
+	launch(ctx, 0);
+
+	// Init the main thread state.
+	if ((res = thread_init(&states[0]))) {
+		atomic_store_explicit(&ctx->thread_errno, res, memory_order_release);
+		return res;
+	}
+
+	ctx->running = true;
+	return 0;
+
+sim:
+	sim_deinit(&ctx->sim);
+	arena_deinit(&ctx->arena);
+cond:
+	pthread_cond_destroy(&ctx->launch_cond);
+lock:
+	pthread_mutex_destroy(&ctx->launch_lock);
+barrier:
+	pthread_barrier_destroy(&ctx->barrier);
+free:
+	free(handles);
+	free(states);
+	return res;
+}
+
+// Releases the worker threads waiting in `thread_main`, which exit if `res`
+// is non-zero.
+static void
+launch(struct bh_sim *ctx, int res)
+{
+	pthread_mutex_lock(&ctx->launch_lock);
+	if (res)
+		atomic_store_explicit(&ctx->thread_errno, res, memory_order_release);
+	ctx->launched = true;
+	pthread_cond_broadcast(&ctx->launch_cond);
+	pthread_mutex_unlock(&ctx->launch_lock);
+}
+
+static void *
+thread_main(void *args)
+{
+	struct thread_state *state = args;
+	struct bh_sim *ctx		   = state->ctx;
+	int res;
+
+	pthread_mutex_lock(&ctx->launch_lock);
+	while (!ctx->launched)
+		pthread_cond_wait(&ctx->launch_cond, &ctx->launch_lock);
+	pthread_mutex_unlock(&ctx->launch_lock);
+	if (atomic_load_explicit(&ctx->thread_errno, memory_order_acquire))
+		return NULL;
+
+	if ((res = thread_init(state))) {
+		atomic_store_explicit(&ctx->thread_errno, res,
+			memory_order_release);
+		return (void *)((uintptr_t)res);
+	}
+
+	// The threads compute steps until the context is destroyed.
+	for (unsigned step = ctx->step;; step++) {
+		profile_step(state->id, step);
+		if ((res = thread_step(state, step, NULL)))
+			break;
+	}
+
+	return (res > 0) ? (void *)((uintptr_t)res) : NULL;
+}
+
+static int
+thread_init(struct thread_state *state)
+{
+	struct bh_sim *ctx		   = state->ctx;
+	const struct options *opts = &ctx->sim.opts;
+	const unsigned id		   = state->id;
+	int res;
+
+	// Pin the thread before allocating, so its local particle copy is placed
+	// on the node it runs on.
+	if ((res = affinity_pin(id)))
+		fprintf(stderr, "Failed to pin thread %u: %s\n", id, strerror(res));
+	profile_thread_init(id);
+
+	const size_t len	   = opts->particles / opts->threads;
+	const size_t rem	   = opts->particles % opts->threads;
+	const size_t start	   = (size_t)id * len;
+	const size_t slice_len = (id == opts->threads - 1) ? len + rem : len;
+
+	// Each thread randomizes its own slice of the global particles, which
+	// also places the slice's pages on the thread's node (first touch).
+	if (ctx->randomize) {
+#ifdef USE_MT19937
+		struct mt19937_64 *rng = &state->rng;
+#else
+		struct mt19937_64 *rng = NULL;
+#endif // USE_MT19937
+		randomize_particles(&ctx->sim.particles[start], start, slice_len, opts,
+			rng);
+	}
+
+	// All particles must be randomized before they are copied by any thread.
+	pthread_barrier_wait(&ctx->barrier);
+
+	// In lean mode, all threads update their slices of the global particles
+	// in place, which the tree (holding copies of all point masses) is not
+	// affected by.
+	if (id == 0 || opts->lean)
+		state->particles = NULL;
+	else {
+		const size_t size = sizeof(struct particle) * opts->particles;
+		if (unlikely((state->particles = malloc(size)) == NULL))
+			return ENOMEM;
+	}
+
+	state->slice = (struct particle_slice) {
+		.offset = start,
+		.len	= slice_len,
+		.from	= (state->particles == NULL) ? &ctx->sim.particles[start]
+											 : &state->particles[start],
+	};
+	state->radius = opts->radius;
+
+	// A first step sorting the particles replaces the copy in `thread_step`
+	// anyway, while the main thread is already sorting them.
+	if (state->particles != NULL && !sort_step(opts, ctx->step))
+		sync_tree_particles(ctx, state->particles, NULL);
+
+	return 0;
+}
+
+static int
+thread_step(struct thread_state *state, unsigned step, long *us)
+{
+	struct bh_sim *ctx		   = state->ctx;
+	const struct options *opts = &ctx->sim.opts;
+	struct timespec start, stop;
+
+	profile_enter(state->id, PHASE_WAIT);
+	pthread_barrier_wait(&ctx->barrier);
+
+	if (atomic_load_explicit(&ctx->thread_errno, memory_order_acquire))
+		return BHE_EARLY_EXIT;
+
+	if (state->id == 0)
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// Sorting moved the particles between the slices, so the whole private
+	// copy is replaced before its slice is advanced.
+	if (state->particles != NULL && sort_step(opts, step)) {
+		profile_enter(state->id, PHASE_SYNC);
+		sync_tree_particles(ctx, state->particles, NULL);
+	}
+
+	if (opts->diagnostics && step % opts->diagnostics == 0) {
+		// The quantities are computed from the same positions as the tree,
+		// before the slice is advanced.
+		struct timespec diag_start, diag_stop;
+		profile_enter(state->id, PHASE_DIAGNOSTICS);
+		clock_gettime(CLOCK_MONOTONIC, &diag_start);
+		sim_diagnostics(&ctx->sim, &state->slice, &state->diag);
+		clock_gettime(CLOCK_MONOTONIC, &diag_stop);
+		state->diag_us = time_diff(&diag_start, &diag_stop);
+	}
+
+	profile_enter(state->id, PHASE_FORCE);
+	const float radius = state->radius;
+	state->radius	   = sim_simulate(&ctx->sim, &state->slice);
+#ifdef STATS
+	// Publish the counters of this step (including the main thread's tree
+	// build) for the reduction after the barrier below.
+	state->stats = tree_stats;
+	tree_stats	 = (struct tree_stats) { 0 };
+#endif // STATS
+
+	// Each thread splats its own updated slice into its private tile, which
+	// the main thread reduces once all threads passed the barrier below.
+	if (opts->frames && step % opts->frames_every == 0) {
+		profile_enter(state->id, PHASE_OUTPUT);
+		frames_splat(state->id, state->slice.from, state->slice.len, radius);
+	}
+	if (state->particles != NULL) {
+		// Synchronize updated particles back.
+		profile_enter(state->id, PHASE_COPY);
+		memcpy(&ctx->sim.particles[state->slice.offset], state->slice.from,
+			sizeof(struct particle) * state->slice.len);
+	}
+
+	// Wait for all threads to complete the current simulation step and
+	// propagate their results, before synchronizing the global particle slice
+	// with the thread's local one.
+	profile_enter(state->id, PHASE_WAIT);
+	pthread_barrier_wait(&ctx->barrier);
+
+	// Before a sorting step, the main thread may already be sorting the
+	// particles, and the whole copy is replaced after the next first barrier
+	// anyway.
+	if (state->particles != NULL && !sort_step(opts, step + 1)) {
+		profile_enter(state->id, PHASE_SYNC);
+		sync_tree_particles(ctx, state->particles, &state->slice);
+	}
+	profile_leave(state->id);
+
+	if (state->id == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+		*us = time_diff(&start, &stop);
+	}
+
+	return 0;
+}
+
+static int
+build_step(struct bh_sim *ctx, long *us)
+{
+	struct timespec start, stop;
+	int res;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (unlikely((res = sim_build(&ctx->sim, ctx->step)))) {
+		atomic_store_explicit(&ctx->thread_errno, res, memory_order_release);
+		pthread_barrier_wait(&ctx->barrier);
+		return res;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	*us = time_diff(&start, &stop);
+
+	return 0;
+}
+
+static void
+sync_tree_particles(const struct bh_sim *ctx, struct particle tree_particles[],
+	const struct particle_slice *slice)
+{
+	const struct particle *particles = ctx->sim.particles;
+	const size_t total				 = ctx->sim.opts.particles;
+
+	if (slice == NULL) {
+		memcpy(tree_particles, particles, sizeof(struct particle) * total);
+		return;
+	}
+
+	// Copy everything before the slice over into the local particle slice.
+	memcpy(&tree_particles[0], &particles[0],
+		sizeof(struct particle) * slice->offset);
+	// Copy everything after the slice over into the local particle slice.
+	const size_t after = slice->offset + slice->len;
+	const size_t len   = total - after;
+	memcpy(&tree_particles[after], &particles[after],
+		sizeof(struct particle) * len);
+}
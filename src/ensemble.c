@@ -0,0 +1,478 @@
+// Required for `getline`, `strtok_r` and `optind`.
+#define _XOPEN_SOURCE 700
+
+#include "barnes-hut/ensemble.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "barnes-hut/affinity.h"
+#include "barnes-hut/arena.h"
+#include "barnes-hut/common.h"
+#include "barnes-hut/diagnostics.h"
+#include "barnes-hut/options.h"
+#include "barnes-hut/phys.h"
+#include "barnes-hut/sim.h"
+
+#ifdef USE_MT19937
+#include "barnes-hut/mt19937_64.h"
+#endif // USE_MT19937
+
+// A simulation of the ensemble.
+struct member {
+	// The simulation's options.
+	struct options opts;
+	// The line the options were parsed from (referenced by `opts`).
+	char *line;
+	// The line's number within the ensemble file.
+	unsigned lineno;
+};
+
+// The totals of a completed simulation.
+struct result {
+	// The times spent initializing, building and simulating.
+	long init_us, build_us, simulate_us;
+	// The (resolved) force solver.
+	enum solver solver;
+	// The particle space radius after the last step.
+	float radius;
+	// The conserved quantities of the latest diagnostics step and the energy
+	// drift relative to the first one.
+	struct diagnostics diag;
+	double drift;
+};
+
+// The state of a worker thread.
+struct worker {
+	// The worker's ID.
+	unsigned id;
+	// The memory arena for octant allocation, shared by all simulations run by
+	// the worker.
+	struct arena arena;
+	// The particles of the worker's current simulation (grown as needed).
+	struct particle *particles;
+	size_t cap;
+} aligned(64);
+
+// The ensemble's state.
+static struct {
+	struct member *members;
+	size_t len;
+	// The index of the next simulation to run.
+	atomic_size_t next;
+	// The error of the first failed simulation.
+	atomic_int error;
+	// The lock serializing the output of completed simulations.
+	pthread_mutex_t lock;
+	struct worker *workers;
+} ensemble = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int read_members(const char *path);
+static int parse_member(struct member *member, const char *path);
+static int check_options(const struct options *opts, unsigned lineno);
+static void *worker_main(void *args);
+static int run_member(struct worker *worker, const struct member *member,
+	struct result *result);
+static void print_result(const struct member *member,
+	const struct result *result);
+static inline long time_diff(const struct timespec *start,
+	const struct timespec *stop);
+
+int
+ensemble_main(void)
+{
+	struct timespec start, stop;
+	int res;
+
+	if ((res = check_options(&options, 0)))
+		return res;
+	if ((res = read_members(options.ensemble)))
+		goto out;
+	if ((res = affinity_init(options.pin, options.pin_list))) {
+		fprintf(stderr, "Failed to determine thread placement: %s\n",
+			strerror(res));
+		goto out;
+	}
+
+	const unsigned threads = (ensemble.len < options.threads)
+		? (unsigned)ensemble.len
+		: options.threads;
+	ensemble.workers = calloc(threads, sizeof(struct worker));
+	pthread_t *handles = malloc(sizeof(pthread_t) * threads);
+	if (unlikely(ensemble.workers == NULL || handles == NULL)) {
+		free(handles);
+		res = ENOMEM;
+		goto out;
+	}
+
+	verbose_printf("running %zu simulations on %u threads ...\n",
+		ensemble.len, threads);
+	if (!options.verbose) {
+		fprintf(stdout,
+			"line,particles,steps,seed,theta,dt,solver,init,build,simulate,"
+			"radius");
+		if (options.diagnostics)
+			fprintf(stdout, ",energy_drift,momentum,angular_momentum");
+		fputc('\n', stdout);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// The calling thread is worker 0.
+	unsigned t;
+	for (t = 1; t < threads; t++) {
+		ensemble.workers[t].id = t;
+		if ((res = pthread_create(&handles[t], NULL, worker_main,
+				 &ensemble.workers[t]))) {
+			atomic_store_explicit(&ensemble.error, res, memory_order_relaxed);
+			break;
+		}
+	}
+	worker_main(&ensemble.workers[0]);
+	for (unsigned i = 1; i < t; i++)
+		pthread_join(handles[i], NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	const long us = time_diff(&start, &stop);
+	verbose_printf("ran %zu simulations in %ld us (%.3g simulations/s).\n",
+		ensemble.len, us, (us > 0) ? (double)ensemble.len * 1e6 / us : 0.0);
+
+	res = atomic_load_explicit(&ensemble.error, memory_order_relaxed);
+	for (unsigned i = 0; i < threads; i++) {
+		if (ensemble.workers[i].arena.memory != NULL)
+			arena_deinit(&ensemble.workers[i].arena);
+		free(ensemble.workers[i].particles);
+	}
+	free(ensemble.workers);
+	free(handles);
+	affinity_deinit();
+
+out:
+	for (size_t i = 0; i < ensemble.len; i++)
+		free(ensemble.members[i].line);
+	free(ensemble.members);
+	return res;
+}
+
+// Reads the simulations from the ensemble file at the given path.
+static int
+read_members(const char *path)
+{
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		const int res = errno;
+		fprintf(stderr, "Failed to open ensemble %s: %s\n", path,
+			strerror(res));
+		return res;
+	}
+
+	char *line	   = NULL;
+	size_t len	   = 0;
+	size_t cap	   = 0;
+	unsigned count = 0;
+	int res		   = 0;
+	while (getline(&line, &len, file) >= 0) {
+		count += 1;
+
+		const char *first = line + strspn(line, " \t\r\n");
+		if (*first == '\0' || *first == '#')
+			continue;
+
+		if (ensemble.len == cap) {
+			cap = (cap > 0) ? 2 * cap : 64;
+			struct member *resized
+				= realloc(ensemble.members, sizeof(struct member) * cap);
+			if (unlikely(resized == NULL)) {
+				res = ENOMEM;
+				break;
+			}
+			ensemble.members = resized;
+		}
+
+		// The member takes over the line, which its options point into.
+		struct member *member = &ensemble.members[ensemble.len++];
+		member->line		  = line;
+		member->lineno		  = count;
+		line				  = NULL;
+		len					  = 0;
+		if ((res = parse_member(member, path)))
+			break;
+	}
+
+	if (res == 0 && ferror(file))
+		res = EIO;
+	if (res == 0 && ensemble.len == 0) {
+		fprintf(stderr, "Invalid ensemble arg: %s lists no simulations\n",
+			path);
+		res = EINVAL;
+	}
+
+	free(line);
+	fclose(file);
+	return res;
+}
+
+// Parses the options of the given member's line on top of the command line's.
+static int
+parse_member(struct member *member, const char *path)
+{
+	// No line has more arguments than half its characters (plus the name).
+	const size_t max = strlen(member->line) / 2 + 2;
+	char **argv		 = malloc(sizeof(char *) * max);
+	if (unlikely(argv == NULL))
+		return ENOMEM;
+
+	int argc	 = 0;
+	char *save	 = NULL;
+	argv[argc++] = (char *)path;
+	for (char *arg = strtok_r(member->line, " \t\r\n", &save); arg != NULL;
+		 arg = strtok_r(NULL, " \t\r\n", &save))
+		argv[argc++] = arg;
+
+	member->opts  = options;
+	const int res = options_parse_args(&member->opts, argc, argv);
+	free(argv);
+
+	if (res == BHE_EARLY_EXIT || (res == 0 && optind < argc)) {
+		fprintf(stderr,
+			"Invalid ensemble arg: Unexpected arguments on line %u\n",
+			member->lineno);
+		return EINVAL;
+	}
+	if (res) {
+		fprintf(stderr, "Invalid ensemble arg: Invalid options on line %u\n",
+			member->lineno);
+		return res;
+	}
+
+	return check_options(&member->opts, member->lineno);
+}
+
+// Checks that the given options (of the command line or a line of the ensemble
+// file) are supported in an ensemble.
+static int
+check_options(const struct options *opts, unsigned lineno)
+{
+	const struct {
+		bool set;
+		const char *name;
+	} unsupported[] = {
+		// The threads, placement and ensemble apply to the whole pool.
+		{ opts->threads != options.threads, "threads" },
+		{ opts->pin != options.pin || opts->pin_list != options.pin_list,
+			"pin" },
+		{ opts->ensemble != options.ensemble, "ensemble" },
+		{ opts->ranks > 1, "ranks" },
+		{ opts->checkpoint != NULL, "checkpoint" },
+		{ opts->restore != NULL, "restore" },
+		{ opts->snapshot != NULL, "snapshot" },
+		{ opts->frames != NULL, "frames" },
+		{ opts->shm != NULL, "shm" },
+		{ opts->phases != NULL, "phases" },
+		{ opts->trace != NULL, "trace" },
+		{ opts->accuracy > 0, "accuracy" },
+		{ opts->diagnostics != options.diagnostics, "diagnostics" },
+		{ opts->autotune > 0, "autotune" },
+	};
+
+#ifdef RENDER
+	fprintf(stderr, "Invalid ensemble arg: Not supported by RENDER builds\n");
+	return EINVAL;
+#endif // RENDER
+
+	for (size_t i = 0; i < sizeof(unsupported) / sizeof(unsupported[0]); i++)
+		if (unsupported[i].set) {
+			if (lineno > 0)
+				fprintf(stderr,
+					"Invalid ensemble arg: --%s on line %u is not supported "
+					"per simulation\n",
+					unsupported[i].name, lineno);
+			else
+				fprintf(stderr,
+					"Invalid ensemble arg: Not supported with --%s\n",
+					unsupported[i].name);
+			return EINVAL;
+		}
+
+	// The command line's defaults may be overridden by every line.
+	if (lineno > 0 && (opts->steps == 0 || opts->particles == 0)) {
+		fprintf(stderr,
+			"Invalid ensemble arg: The simulation on line %u needs particles "
+			"and a finite number of steps\n",
+			lineno);
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+static void *
+worker_main(void *args)
+{
+	struct worker *worker = args;
+	int res;
+
+	if ((res = affinity_pin(worker->id)))
+		fprintf(stderr, "Failed to pin thread %u: %s\n", worker->id,
+			strerror(res));
+
+	while (!atomic_load_explicit(&ensemble.error, memory_order_relaxed)) {
+		const size_t i = atomic_fetch_add_explicit(&ensemble.next, 1,
+			memory_order_relaxed);
+		if (i >= ensemble.len)
+			break;
+
+		const struct member *member = &ensemble.members[i];
+		struct result result;
+		if ((res = run_member(worker, member, &result))) {
+			fprintf(stderr, "Failed to run simulation on line %u: %s\n",
+				member->lineno, strerror(res));
+			atomic_store_explicit(&ensemble.error, res, memory_order_relaxed);
+			break;
+		}
+
+		pthread_mutex_lock(&ensemble.lock);
+		print_result(member, &result);
+		pthread_mutex_unlock(&ensemble.lock);
+	}
+
+	return NULL;
+}
+
+// Runs the given simulation to completion on the calling thread.
+static int
+run_member(struct worker *worker, const struct member *member,
+	struct result *result)
+{
+	const struct options *opts = &member->opts;
+	struct timespec t0, t1, t2;
+	struct sim sim;
+	int res;
+
+	*result = (struct result) { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	// The arena (lazily backed by pages) and the particles only grow, so
+	// later simulations of at most as many particles allocate nothing.
+	if (opts->particles > worker->cap) {
+		if (worker->arena.memory != NULL)
+			arena_deinit(&worker->arena);
+		if ((res = particle_tree_arena_init(&worker->arena,
+				 opts->particles))) {
+			worker->arena.memory = NULL;
+			return res;
+		}
+
+		struct particle *resized = realloc(worker->particles,
+			sizeof(struct particle) * opts->particles);
+		if (unlikely(resized == NULL))
+			return ENOMEM;
+		worker->particles = resized;
+		worker->cap		  = opts->particles;
+	}
+
+	if ((res = sim_init(&sim, opts, &worker->arena)))
+		return res;
+	sim.particles  = worker->particles;
+	result->solver = sim.opts.solver;
+
+	// The particles are randomized exactly as by a single-threaded process.
+#ifdef USE_MT19937
+	struct mt19937_64 rng;
+	mt1993764_init_state(&rng, (opts->seed != 0) ? opts->seed : 5489ULL);
+	randomize_particles(sim.particles, 0, opts->particles, opts, &rng);
+#else
+	randomize_particles(sim.particles, 0, opts->particles, opts, NULL);
+#endif // USE_MT19937
+
+	const struct particle_slice slice = {
+		.offset = 0,
+		.len	= opts->particles,
+		.from	= sim.particles,
+	};
+	double initial_energy = 0.0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	result->init_us = time_diff(&t0, &t1);
+
+	for (unsigned step = 0; step < opts->steps; step++) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if ((res = sim_build(&sim, step)))
+			goto out;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		if (opts->diagnostics && step % opts->diagnostics == 0) {
+			sim_diagnostics(&sim, &slice, &result->diag);
+			const double energy = diagnostics_energy(&result->diag);
+			if (step == 0)
+				initial_energy = energy;
+			result->drift = (initial_energy != 0.0)
+				? (energy - initial_energy) / fabs(initial_energy)
+				: 0.0;
+		}
+		sim.radius = sim_simulate(&sim, &slice);
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+
+		result->build_us += time_diff(&t0, &t1);
+		result->simulate_us += time_diff(&t1, &t2);
+	}
+	result->radius = sim.radius;
+
+out:
+	sim_deinit(&sim);
+	return res;
+}
+
+// Prints the totals of the given completed simulation, either as CSV row or as
+// verbose output.
+static void
+print_result(const struct member *member, const struct result *result)
+{
+	const struct options *opts = &member->opts;
+	const char *solver = (result->solver == SOLVER_DIRECT) ? "direct" : "tree";
+
+	if (options.verbose) {
+		fprintf(stderr,
+			"simulation on line %u: %zu particles, %u steps, %s solver\n"
+			"\tinit in: %ld us, built trees in: %ld us, simulation in: %ld "
+			"us, %.3f radius\n",
+			member->lineno, opts->particles, opts->steps, solver,
+			result->init_us, result->build_us, result->simulate_us,
+			result->radius);
+		if (opts->diagnostics)
+			fprintf(stderr,
+				"\tenergy: %.3g relative drift, momentum: %.6g linear, "
+				"%.6g angular\n",
+				result->drift, diagnostics_norm(result->diag.momentum),
+				diagnostics_norm(result->diag.angular));
+		return;
+	}
+
+	fprintf(stdout, "%u,%zu,%u,%u,%g,%g,%s,%ld,%ld,%ld,%.3f", member->lineno,
+		opts->particles, opts->steps, opts->seed, opts->theta, opts->dt,
+		solver, result->init_us, result->build_us, result->simulate_us,
+		result->radius);
+	if (opts->diagnostics)
+		fprintf(stdout, ",%.6g,%.6g,%.6g", result->drift,
+			diagnostics_norm(result->diag.momentum),
+			diagnostics_norm(result->diag.angular));
+	fputc('\n', stdout);
+	fflush(stdout);
+}
+
+static inline long
+time_diff(const struct timespec *start, const struct timespec *stop)
+{
+	return (stop->tv_sec - start->tv_sec) * (long)1e6
+		+ ((stop->tv_nsec - start->tv_nsec) / (long)1e3);
+}
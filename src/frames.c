@@ -0,0 +1,288 @@
+#define _XOPEN_SOURCE 700
+
+#include "barnes-hut/frames.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#include "barnes-hut/common.h"
+#include "barnes-hut/options.h"
+
+// The frame size, matching the interactive renderer's window.
+static const unsigned width	 = 1280;
+static const unsigned height = 960;
+
+#define FRAMES_SLOTS 2
+
+// The states of a density image buffer.
+enum slot_state {
+	// The buffer is unused and may be filled by the simulation.
+	SLOT_FREE,
+	// The buffer is filled and waits for the writer thread.
+	SLOT_FULL,
+	// The buffer is being written by the writer thread.
+	SLOT_BUSY,
+};
+
+// A buffer holding the reduced particle counts per pixel of a single step.
+struct slot {
+	enum slot_state state;
+	// The submission sequence number (for writing in submission order).
+	unsigned long seq;
+	unsigned step;
+	uint32_t *density;
+};
+
+// The global frame writer state.
+static struct {
+	const char *dir;
+	unsigned threads;
+	// The per-thread density tiles, each covering the entire frame.
+	uint32_t **tiles;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stop;
+	unsigned long seq;
+	struct slot slots[FRAMES_SLOTS];
+	// The writer thread's RGB output buffer.
+	unsigned char *rgb;
+	// The statistics reported on exit.
+	unsigned long written;
+} writer;
+
+static void *writer_main(void *args);
+static int write_frame(const struct slot *slot);
+
+int
+frames_init(const char *dir, unsigned threads)
+{
+	const size_t pixels = (size_t)width * height;
+	int res;
+
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		return errno;
+
+	writer.dir	   = dir;
+	writer.threads = threads;
+	writer.stop	   = false;
+	writer.seq	   = 0;
+	writer.written = 0;
+
+	// The tiles are zeroed by their threads before each splat, so their pages
+	// are first touched by the thread using them.
+	writer.tiles = calloc(threads, sizeof(uint32_t *));
+	writer.rgb	 = malloc(3 * pixels);
+	if (unlikely(writer.tiles == NULL || writer.rgb == NULL))
+		goto nomem;
+
+	for (unsigned t = 0; t < threads; t++)
+		if (unlikely((writer.tiles[t] = malloc(sizeof(uint32_t) * pixels))
+				== NULL))
+			goto nomem;
+
+	for (unsigned s = 0; s < FRAMES_SLOTS; s++) {
+		writer.slots[s].state	= SLOT_FREE;
+		writer.slots[s].density = malloc(sizeof(uint32_t) * pixels);
+		if (unlikely(writer.slots[s].density == NULL))
+			goto nomem;
+	}
+
+	pthread_mutex_init(&writer.lock, NULL);
+	pthread_cond_init(&writer.cond, NULL);
+	if ((res = pthread_create(&writer.thread, NULL, writer_main, NULL))) {
+		pthread_cond_destroy(&writer.cond);
+		pthread_mutex_destroy(&writer.lock);
+		goto error;
+	}
+
+	return 0;
+
+nomem:
+	res = ENOMEM;
+error:
+	for (unsigned s = 0; s < FRAMES_SLOTS; s++)
+		free(writer.slots[s].density);
+	for (unsigned t = 0; writer.tiles != NULL && t < threads; t++)
+		free(writer.tiles[t]);
+	free(writer.tiles);
+	free(writer.rgb);
+	writer.dir = NULL;
+	return res;
+}
+
+void
+frames_deinit(void)
+{
+	if (writer.dir == NULL)
+		return;
+
+	pthread_mutex_lock(&writer.lock);
+	writer.stop = true;
+	pthread_cond_broadcast(&writer.cond);
+	pthread_mutex_unlock(&writer.lock);
+	pthread_join(writer.thread, NULL);
+
+	pthread_cond_destroy(&writer.cond);
+	pthread_mutex_destroy(&writer.lock);
+
+	verbose_printf("wrote %lu frames to %s\n", writer.written, writer.dir);
+
+	for (unsigned s = 0; s < FRAMES_SLOTS; s++)
+		free(writer.slots[s].density);
+	for (unsigned t = 0; t < writer.threads; t++)
+		free(writer.tiles[t]);
+	free(writer.tiles);
+	free(writer.rgb);
+	writer.dir = NULL;
+}
+
+void
+frames_splat(unsigned id, const struct particle particles[], size_t len,
+	float radius)
+{
+	uint32_t *tile = writer.tiles[id];
+	memset(tile, 0, sizeof(uint32_t) * width * height);
+
+	// The camera basis of `gluLookAt` from (r, r, r) to the origin with the y
+	// axis up, i.e., right = (1, 0, -1) / sqrt(2) and up = (-1, 2, -1) /
+	// sqrt(6), folded into the orthographic scale of [-r, r] to pixels.
+	const float sx = 0.5f * (float)width / (radius * sqrtf(2.0f));
+	const float sy = 0.5f * (float)height / (radius * sqrtf(6.0f));
+	const float cx = 0.5f * (float)width;
+	const float cy = 0.5f * (float)height;
+
+	for (size_t p = 0; p < len; p++) {
+		const struct vec3 *v = &particles[p].part.pos;
+		// Rows are stored top to bottom.
+		const float x = cx + sx * (v->x - v->z);
+		const float y = cy - sy * (2.0f * v->y - v->x - v->z);
+		if (x < 0.0f || y < 0.0f || x >= (float)width || y >= (float)height)
+			continue;
+
+		tile[(size_t)y * width + (size_t)x] += 1;
+	}
+}
+
+void
+frames_submit(unsigned step)
+{
+	struct slot *slot = NULL;
+
+	pthread_mutex_lock(&writer.lock);
+	while (true) {
+		for (unsigned s = 0; s < FRAMES_SLOTS && slot == NULL; s++)
+			if (writer.slots[s].state == SLOT_FREE)
+				slot = &writer.slots[s];
+		if (slot != NULL)
+			break;
+		// Unlike snapshots, frames are never dropped so movies stay smooth.
+		pthread_cond_wait(&writer.cond, &writer.lock);
+	}
+	pthread_mutex_unlock(&writer.lock);
+
+	const size_t pixels = (size_t)width * height;
+	memcpy(slot->density, writer.tiles[0], sizeof(uint32_t) * pixels);
+	for (unsigned t = 1; t < writer.threads; t++) {
+		const uint32_t *tile = writer.tiles[t];
+		for (size_t i = 0; i < pixels; i++)
+			slot->density[i] += tile[i];
+	}
+
+	pthread_mutex_lock(&writer.lock);
+	slot->state = SLOT_FULL;
+	slot->step	= step;
+	slot->seq	= writer.seq++;
+	pthread_cond_broadcast(&writer.cond);
+	pthread_mutex_unlock(&writer.lock);
+}
+
+static void *
+writer_main(void *args)
+{
+	int res;
+
+	pthread_mutex_lock(&writer.lock);
+	while (true) {
+		// Pick the oldest filled buffer.
+		struct slot *slot = NULL;
+		for (unsigned s = 0; s < FRAMES_SLOTS; s++) {
+			struct slot *curr = &writer.slots[s];
+			if (curr->state == SLOT_FULL
+				&& (slot == NULL || curr->seq < slot->seq))
+				slot = curr;
+		}
+
+		if (slot == NULL) {
+			if (writer.stop)
+				break;
+			pthread_cond_wait(&writer.cond, &writer.lock);
+			continue;
+		}
+
+		slot->state = SLOT_BUSY;
+		pthread_mutex_unlock(&writer.lock);
+
+		if ((res = write_frame(slot)))
+			fprintf(stderr, "Failed to write frame for step %u: %s\n",
+				slot->step, strerror(res));
+
+		pthread_mutex_lock(&writer.lock);
+		slot->state = SLOT_FREE;
+		// Wake a simulation thread waiting for a free buffer.
+		pthread_cond_broadcast(&writer.cond);
+	}
+	pthread_mutex_unlock(&writer.lock);
+
+	return NULL;
+}
+
+static int
+write_frame(const struct slot *slot)
+{
+	const size_t pixels = (size_t)width * height;
+
+	uint32_t max = 0;
+	for (size_t i = 0; i < pixels; i++)
+		if (slot->density[i] > max)
+			max = slot->density[i];
+
+	// Map the log density onto a black-red-yellow-white ramp, so both the
+	// sparse halo and the dense core remain visible.
+	const float scale = (max > 0) ? 765.0f / log1pf((float)max) : 0.0f;
+	for (size_t i = 0; i < pixels; i++) {
+		const float v	   = log1pf((float)slot->density[i]) * scale;
+		unsigned char *rgb = &writer.rgb[3 * i];
+		rgb[0]			   = (unsigned char)fminf(v, 255.0f);
+		rgb[1]			   = (unsigned char)fminf(fmaxf(v - 255.0f, 0.0f), 255.0f);
+		rgb[2]			   = (unsigned char)fminf(fmaxf(v - 510.0f, 0.0f), 255.0f);
+	}
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/frame-%06u.ppm", writer.dir, slot->step);
+
+	FILE *file = fopen(path, "wb");
+	if (file == NULL)
+		return errno;
+
+	int res = 0;
+	if (fprintf(file, "P6\n%u %u\n255\n", width, height) < 0
+		|| fwrite(writer.rgb, 3, pixels, file) != pixels)
+		res = EIO;
+	if (fclose(file) && res == 0)
+		res = errno;
+
+	if (res == 0)
+		writer.written += 1;
+	return res;
+}
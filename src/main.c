@@ -1,91 +1,47 @@
-// Required for `pthread_barrier`.
-#ifdef __linux
-#define _XOPEN_SOURCE 600
-#endif // __linux
+// Required for `nanosleep`.
+#define _XOPEN_SOURCE 700
 
-#include <stdatomic.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <errno.h>
-#include <pthread.h>
+#include <math.h>
 #include <string.h>
 #include <time.h>
 
-#include <sys/mman.h>
+#include <sys/resource.h>
 
+#include "barnes-hut/affinity.h"
 #include "barnes-hut/arena.h"
+#include "barnes-hut/autotune.h"
+#include "barnes-hut/barneshut.h"
+#include "barnes-hut/checkpoint.h"
 #include "barnes-hut/common.h"
+#include "barnes-hut/diagnostics.h"
+#include "barnes-hut/direct.h"
+#include "barnes-hut/dist.h"
+#include "barnes-hut/engine.h"
+#include "barnes-hut/ensemble.h"
+#include "barnes-hut/frames.h"
 #include "barnes-hut/options.h"
 #include "barnes-hut/phys.h"
-
-#ifdef USE_MT19937
-#include "barnes-hut/mt19937_64.h"
-#endif // USE_MT19937
+#include "barnes-hut/profile.h"
+#include "barnes-hut/shm.h"
+#include "barnes-hut/sim.h"
+#include "barnes-hut/snapshot.h"
 
 #ifdef RENDER
 #include "barnes-hut/render.h"
 #endif // RENDER
 
-// The per-thread simulation state.
-struct thread_state {
-	// The thread's ID.
-	unsigned id;
-	// The thread's local copy of the global particle list.
-	struct particle *particles;
-	// The thread's assigned particle slice.
-	struct particle_slice slice;
-	// The particle space radius to use for the next simulation step.
-	//
-	// After completion of a step, the thread sets this field to the greatest
-	// distance from center of any calculated particle position in the latest
-	// iteration.
-	//
-	// The main thread then aggregates all thread values of this field and
-	// calculates (maximum) the radius for the next iteration.
-	//
-	// Access to this field must be synchronized using `barrier`.
-	float radius;
-} aligned(64);
-
-// The global memory arena for octant allocation.
-struct arena arena;
-
-// The global thread error flag.
-static atomic_int thread_errno = 0;
-// The global thread synchronization barrier.
-static pthread_barrier_t barrier;
-// The globally shared and synchronized region of all simulated particles.
-static struct particle *particles;
-// The globally shared and synchronized tree of particles.
-//
-// Access to the tree must be synchronized using `barrier`.
-static struct particle_tree tree = { .root = ARENA_NULL };
-// The TLS holding the state of all threads.
-static struct threads {
-	unsigned len;
-	struct thread_state states[];
-} *tls = NULL;
-
-static inline long time_diff(const struct timespec *start,
-	const struct timespec *stop);
-static int init_barrier(void);
-static struct threads *init_tls(void);
-static struct particle *init_particles(void);
-static void *thread_main(void *args);
-static int thread_init(unsigned id);
-static void thread_deinit(unsigned id);
-static int thread_step(struct thread_state *state, unsigned step, long *us);
-static int build_step(unsigned step, float radius, long *us);
-static void sync_tree_particles(struct particle tree_particles[],
-	const struct particle_slice *slice);
 static void msleep(unsigned ms);
-
-static const size_t kib		   = (size_t)1 << 10;
-static const size_t mib		   = kib << 10;
-static const size_t gib		   = mib << 10;
-static const size_t arena_size = 4 * gib;
+#ifdef STATS
+static void print_stats(const struct bh_sim *ctx);
+#endif // STATS
+static void print_accuracy(const struct bh_sim *ctx);
+static void print_diagnostics(const struct bh_sim *ctx, unsigned step);
+static void print_memory(void);
 
 static inline bool
 step_continue(unsigned step)
@@ -96,89 +52,170 @@ step_continue(unsigned step)
 int
 main(int argc, char *argv[argc])
 {
+	struct particle *restored = NULL;
+	unsigned first_step		  = 0;
+	struct bh_sim *ctx;
 	int res;
+
 	if ((res = options_parse(argc, argv)))
 		return (res == BHE_EARLY_EXIT) ? 0 : res;
+	if (options.ensemble)
+		return ensemble_main();
+	if (options.ranks > 1)
+		return dist_main();
+
+	if (options.restore) {
+		float radius;
+
+		// Restoring updates the options (particle count, radius, ...) the
+		// context is created with.
+		verbose_printf("restoring checkpoint %s ...\n", options.restore);
+		res = checkpoint_restore(options.restore, &restored, &first_step,
+			&radius);
+		if (res) {
+			fprintf(stderr, "Failed to restore checkpoint %s: %s\n",
+				options.restore, strerror(res));
+			return res;
+		}
+
+		verbose_printf("restored %zu particles at step %u, radius %.3f.\n",
+			options.particles, first_step, radius);
+	}
 
+	// The tuned settings replace the parsed ones before the writers sized by
+	// the thread count are initialized.
+	if (options.autotune > 0 && (res = autotune(restored)))
+		return res;
+
+	// Initialize the writers of the command line's output.
+
+	if (options.phases
+		&& (res = profile_init(options.phases, options.perf_counters,
+				options.threads, first_step))) {
+		fprintf(stderr, "Failed to open phase profile %s: %s\n",
+			options.phases, strerror(res));
+		return res;
+	}
+#ifdef TRACE
+	if (options.trace && (res = trace_init(options.trace, options.threads)))
+		return res;
+#endif // TRACE
+	if (options.snapshot
+		&& (res = snapshot_init(options.snapshot, options.snapshot_bits))) {
+		fprintf(stderr, "Failed to open snapshot file %s: %s\n",
+			options.snapshot, strerror(res));
+		return res;
+	}
+	if (options.frames
+		&& (res = frames_init(options.frames, options.threads))) {
+		fprintf(stderr, "Failed to prepare frames directory %s: %s\n",
+			options.frames, strerror(res));
+		return res;
+	}
+	if (options.shm && (res = shm_feed_init(options.shm))) {
+		fprintf(stderr, "Failed to create shared memory feed %s: %s\n",
+			options.shm, strerror(res));
+		return res;
+	}
 #ifdef RENDER
+	// The frame buffers are sized by the (possibly restored) particle count.
 	if ((res = render_init()))
 		return res;
 #endif // RENDER
-
-	// Initialize the global (shared) state.
-
-	if (unlikely((res = init_barrier())))
-		return ENOMEM;
-	if (unlikely((res = arena_init(&arena, arena_size, sizeof(struct octant)))))
+	if ((res = affinity_init(options.pin, options.pin_list))) {
+		fprintf(stderr, "Failed to determine thread placement: %s\n",
+			strerror(res));
 		return res;
-	if (unlikely((particles = init_particles()) == NULL))
-		return ENOMEM;
-	if (unlikely((tls = init_tls()) == NULL))
-		return ENOMEM;
-
-	// Spawn p - 1 additional worker threads.
-	const unsigned pthreads = options.threads - 1;
-	pthread_t *threads		= malloc(sizeof(pthread_t) * pthreads);
-	if (unlikely(threads == NULL))
-		return ENOMEM;
-
-	unsigned t;
-	for (t = 0; t < pthreads; t++) {
-		pthread_attr_t attr;
-		pthread_attr_init(&attr);
-		res = pthread_create(&threads[t], &attr, thread_main,
-			(void *)(uintptr_t)(t + 1));
-		pthread_attr_destroy(&attr);
-
-		if (res)
-			goto exit;
 	}
 
-	// Init the main thread state.
-	if ((res = thread_init(0))) {
-		atomic_store_explicit(&thread_errno, res, memory_order_release);
+	// The context starts with the parsed options, all threads are spawned by
+	// its first step.
+	if ((res = bh_create(&ctx)))
+		return res;
+	if (restored
+		&& (res = bh_adopt_particles(ctx, restored, options.particles,
+				first_step)))
 		goto exit;
-	}
 
 	if (options.verbose)
 		fprintf(stderr, "begin simulation ...\n");
-	else
+	else {
 		// Print only the CSV file header.
-		fprintf(stdout, "step,build,simulate\n");
+		fprintf(stdout,
+			"step,build,simulate"
+#ifdef STATS
+			",nodes,peak,depth,visits,accepted,pairs,interactions_per_s"
+#endif // STATS
+		);
+		if (options.accuracy)
+			fprintf(stdout, ",rms_error,max_error");
+		if (options.diagnostics)
+			fprintf(stdout,
+				",kinetic,potential,energy_drift,momentum,angular_momentum,"
+				"diagnostics");
+		fputc('\n', stdout);
+	}
 
-	struct thread_state *state = &tls->states[0];
-	for (unsigned step = 0; step_continue(step); step++) {
-		long build_us, step_us;
-		if ((res = build_step(step, state->radius, &build_us)))
-			goto exit;
-		if ((res = thread_step(state, step, &step_us)))
+	for (unsigned step = first_step; step_continue(step); step++) {
+		if ((res = bh_step(ctx))) {
+			const struct arena *arena = &ctx->arena;
+			if (res == ENOMEM && arena->last > 0 && arena->curr == arena->last)
+				fprintf(stderr, "Octant arena exhausted (%zu octants)\n",
+					(size_t)arena->last);
+			else if (res > 0)
+				fprintf(stderr, "Failed to compute step %u: %s\n", step,
+					strerror(res));
 			goto exit;
+		}
 
+		profile_enter(0, PHASE_OUTPUT);
+		// All threads have entered the current step, so the previous one is
+		// complete.
+		if (step > first_step)
+			profile_flush(step - 1);
+
+		const struct sim *sim = &ctx->sim;
 		if (options.verbose)
 			fprintf(stderr,
 				"step t = %u:\n"
-				"\tbuilt tree in: %ld us, %u tree nodes, %.3f radius\n"
+				"\tbuilt tree in: %ld us, %zu tree nodes, %.3f radius\n"
 				"\tsimulation in: %ld us\n",
-				step, build_us, arena.curr, state->radius, step_us);
+				step, ctx->build_us, (size_t)ctx->arena.curr, sim->radius,
+				ctx->step_us);
 		else
-			fprintf(stdout, "%u,%ld,%ld\n", step, build_us, step_us);
-
-		// Recalculate the radius for the next iteration step.
-		//
-		// All other threads will either wait in barrier or exit, so it is safe
-		// to iterate and update each thread's radius.
-		float max_radius = 0.0;
-		for (unsigned t = 0; t < options.threads; t++) {
-			const float radius = tls->states[t].radius;
-			if (radius > max_radius)
-				max_radius = radius;
+			fprintf(stdout, "%u,%ld,%ld", step, ctx->build_us, ctx->step_us);
+#ifdef STATS
+		print_stats(ctx);
+#endif // STATS
+		if (options.accuracy)
+			print_accuracy(ctx);
+		if (options.diagnostics)
+			print_diagnostics(ctx, step);
+		if (!options.verbose)
+			fputc('\n', stdout);
+
+		if (options.checkpoint && (step + 1) % options.checkpoint_every == 0) {
+			verbose_printf("writing checkpoint for step %u ...\n", step + 1);
+			const int cres = checkpoint_write(options.checkpoint,
+				sim->particles, step + 1, sim->radius);
+			if (cres)
+				fprintf(stderr, "Failed to write checkpoint %s: %s\n",
+					options.checkpoint, strerror(cres));
 		}
 
-		for (unsigned t = 0; t < options.threads; t++)
-			tls->states[t].radius = max_radius;
+		if (options.snapshot && step % options.snapshot_every == 0
+			&& !snapshot_submit(sim->particles, step))
+			verbose_printf("snapshot writer busy, dropped step %u\n", step);
+
+		if (options.frames && step % options.frames_every == 0)
+			frames_submit(step);
+
+		if (options.shm)
+			shm_feed_publish(sim->particles, step, sim->radius);
 
 #ifdef RENDER
-		if (render_scene(particles, max_radius))
+		// The tree of the completed step is left intact until the next build.
+		if (render_publish(sim->particles, &sim->tree, sim->radius))
 			goto exit;
 #endif // RENDER
 		if (options.delay)
@@ -186,243 +223,147 @@ main(int argc, char *argv[argc])
 	}
 
 exit:
-	verbose_printf("joining threads %u ...\n", t);
-	for (unsigned i = 0; i < t; i++) {
-		void *thread_res;
-		pthread_join(threads[i], &thread_res);
-
-		int tres = (int)((uintptr_t)thread_res);
-		if (tres > 0)
-			fprintf(stderr, "Error in joined thread %d: %s\n", i,
-				strerror(tres));
-		thread_deinit(i);
-	}
+	profile_leave(0);
+	bh_destroy(ctx);
+
+	snapshot_deinit();
+	profile_deinit();
+#ifdef TRACE
+	trace_deinit();
+#endif // TRACE
+	frames_deinit();
+	shm_feed_deinit();
 
-	free(threads);
-	free(tls);
-	free(particles);
-	arena_deinit(&arena);
+	if (restored)
+		checkpoint_unmap();
+	affinity_deinit();
 
 #ifdef RENDER
 	render_deinit();
 #endif // RENDER
+	if (options.verbose)
+		print_memory();
 
 	return (res != BHE_EARLY_EXIT) ? res : 0;
 }
 
-int
-arena_init(struct arena *arena, size_t size, size_t item_size)
-{
-	arena->memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
-		MAP_PRIVATE | MAP_ANON, -1, 0);
-	if (unlikely(arena->memory == MAP_FAILED))
-		return errno;
-
-	arena->size		 = size;
-	arena->item_size = item_size;
-	arena->curr		 = 0;
-	arena->last		 = (size / item_size) + 1;
-
-	return 0;
-}
-
-void
-arena_deinit(struct arena *arena)
-{
-	if (munmap(arena->memory, arena->size))
-		fprintf(stderr, "Failed to unmap arena: %s\n", strerror(errno));
-}
-
-static inline long
-time_diff(const struct timespec *start, const struct timespec *stop)
-{
-	return (stop->tv_sec - start->tv_sec) * (long)1e6
-		+ ((stop->tv_nsec - start->tv_nsec) / (long)1e3);
-}
-
-static int
-init_barrier(void)
-{
-	pthread_barrierattr_t attr;
-	int res;
-
-	if ((res = pthread_barrierattr_init(&attr)))
-		return res;
-	if ((res = pthread_barrier_init(&barrier, &attr, options.threads)))
-		return res;
-
-	return 0;
-}
-
-static struct threads *
-init_tls(void)
-{
-	struct threads *tls = malloc(sizeof(struct threads)
-		+ (sizeof(struct thread_state) * options.threads));
-	if (unlikely(tls == NULL))
-		return NULL;
-
-	tls->len = options.threads;
-
-	return tls;
-}
-
-static struct particle *
-init_particles(void)
-{
-	if (options.seed != 0)
-#ifdef USE_MT19937
-		mt1993764_init(options.seed);
-#else
-		srandom(options.seed);
-#endif // USE_MT19937
-
-	struct particle *particles
-		= malloc(sizeof(struct particle) * options.particles);
-	if (unlikely(particles == NULL))
-		return NULL;
-
-	verbose_printf("randomizing %zu particles within radius %.3f.\n",
-		options.particles, options.radius);
-	randomize_particles(particles, options.radius);
-	verbose_printf("particle randomization complete.\n");
-
-	return particles;
-}
-
-static void *
-thread_main(void *args)
+#ifdef STATS
+// Reduces and prints the tree work counters of all threads for the latest
+// step, either as CSV columns or as verbose output.
+static void
+print_stats(const struct bh_sim *ctx)
 {
-	int res;
-
-	const unsigned id = (unsigned)((uintptr_t)args);
-	if ((res = thread_init(id))) {
-		atomic_store_explicit(&thread_errno, res, memory_order_release);
-		return (void *)((uintptr_t)res);
+	const long step_us	  = ctx->step_us;
+	struct tree_stats sum = { 0 };
+	for (unsigned t = 0; t < options.threads; t++) {
+		const struct tree_stats *stats = &ctx->states[t].stats;
+		sum.visits += stats->visits;
+		sum.accepted += stats->accepted;
+		sum.pairs += stats->pairs;
+		if (stats->depth > sum.depth)
+			sum.depth = stats->depth;
 	}
 
-	struct thread_state *state = &tls->states[id];
-	for (unsigned step = 0; step_continue(step); step++)
-		if ((res = thread_step(state, step, NULL)))
-			return (void *)((uintptr_t)res);
+	const double ips = (step_us > 0)
+		? (double)(sum.accepted + sum.pairs) * 1e6 / (double)step_us
+		: 0.0;
 
-	return NULL;
+	if (options.verbose)
+		fprintf(stderr,
+			"\ttree work: %llu visits, %llu accepted cells, %llu pairs, "
+			"depth %u, %.3g interactions/s\n",
+			sum.visits, sum.accepted, sum.pairs, sum.depth, ips);
+	else
+		fprintf(stdout, ",%zu,%zu,%u,%llu,%llu,%llu,%.0f",
+			(size_t)ctx->arena.curr, (size_t)ctx->sim.arena_peak, sum.depth,
+			sum.visits, sum.accepted, sum.pairs, ips);
 }
+#endif // STATS
 
-static int
-thread_init(unsigned id)
+// Compares the tree's forces against direct summation for the particles of the
+// latest step and prints the errors, either as CSV columns or as verbose
+// output.
+//
+// The tree and the packed sources are left intact until the next build, so
+// this may run while the other threads wait for the next step.
+static void
+print_accuracy(const struct bh_sim *ctx)
 {
-	struct thread_state *state = &tls->states[id];
-
-	if (id == 0)
-		state->particles = NULL;
-	else {
-		const size_t size = sizeof(struct particle) * options.particles;
-		if (unlikely((state->particles = malloc(size)) == NULL))
-			return ENOMEM;
-	}
-
-	const size_t len   = options.particles / options.threads;
-	const size_t rem   = options.particles % options.threads;
-	const size_t start = (size_t)id * len;
-
-	state->id	 = id;
-	state->slice = (struct particle_slice) {
-		.offset = start,
-		.len	= (id == options.threads - 1) ? len + rem : len,
-		.from	= (id == 0) ? particles : &state->particles[start],
-	};
-	state->radius = options.radius;
+	const struct direct_error err = direct_accuracy(&ctx->sim.sources,
+		&ctx->sim.tree, options.accuracy);
+#ifdef STATS
+	// The sampled tree walks are not part of the simulation's work.
+	tree_stats = (struct tree_stats) { 0 };
+#endif // STATS
 
-	if (id != 0)
-		sync_tree_particles(state->particles, NULL);
-
-	return 0;
+	if (options.verbose)
+		fprintf(stderr,
+			"\tforce error: %.3g rms, %.3g max (relative, %zu samples)\n",
+			err.rms, err.max, options.accuracy);
+	else
+		fprintf(stdout, ",%.6g,%.6g", err.rms, err.max);
 }
 
+// Reduces and prints the conserved quantities of all threads' slices, either as
+// CSV columns (left empty for steps without diagnostics) or as verbose output.
+//
+// The energy drift is relative to the energy of the first diagnostics step,
+// the cost is that of the slowest thread (and included in the step's time).
 static void
-thread_deinit(unsigned id)
-{
-	struct thread_state *state = &tls->states[id];
-	free(state->particles);
-}
-
-static int
-thread_step(struct thread_state *state, unsigned step, long *us)
+print_diagnostics(const struct bh_sim *ctx, unsigned step)
 {
-	struct timespec start, stop;
-
-	pthread_barrier_wait(&barrier);
-
-	if (atomic_load_explicit(&thread_errno, memory_order_acquire))
-		return BHE_EARLY_EXIT;
-
-	if (state->id == 0)
-		clock_gettime(CLOCK_MONOTONIC, &start);
-
-	state->radius = particle_tree_simulate(&tree, &state->slice);
-	if (state->id != 0)
-		// Synchronize updated particles back.
-		memcpy(&particles[state->slice.offset], state->slice.from,
-			sizeof(struct particle) * state->slice.len);
-
-	// Wait for all threads to complete the current simulation step and
-	// propagate their results, before synchronizing the global particle slice
-	// with the thread's local one.
-	pthread_barrier_wait(&barrier);
-
-	if (state->id != 0)
-		sync_tree_particles(state->particles, &state->slice);
+	static bool initial = true;
+	static double initial_energy;
 
-	if (state->id == 0) {
-		clock_gettime(CLOCK_MONOTONIC, &stop);
-		*us = time_diff(&start, &stop);
+	if (step % options.diagnostics != 0) {
+		if (!options.verbose)
+			fprintf(stdout, ",,,,,,");
+		return;
 	}
 
-	return 0;
-}
-
-static int
-build_step(unsigned step, float radius, long *us)
-{
-	struct timespec start, stop;
-	int res;
-
-	clock_gettime(CLOCK_MONOTONIC, &start);
-	if (options.optimize && step % 10 == 0)
-		sort_particles(particles);
-
-	res = particle_tree_build(&tree, particles, radius);
-	if (unlikely(res)) {
-		atomic_store_explicit(&thread_errno, res, memory_order_release);
-		pthread_barrier_wait(&barrier);
-		return res;
+	struct diagnostics sum = { 0 };
+	long diag_us		   = 0;
+	for (unsigned t = 0; t < options.threads; t++) {
+		const struct thread_state *state = &ctx->states[t];
+		diagnostics_add(&sum, &state->diag);
+		if (state->diag_us > diag_us)
+			diag_us = state->diag_us;
 	}
 
-	clock_gettime(CLOCK_MONOTONIC, &stop);
-	*us = time_diff(&start, &stop);
+	const double energy = diagnostics_energy(&sum);
+	if (initial) {
+		initial_energy = energy;
+		initial		   = false;
+	}
+	const double drift = (initial_energy != 0.0)
+		? (energy - initial_energy) / fabs(initial_energy)
+		: 0.0;
 
-	return 0;
+	if (options.verbose)
+		fprintf(stderr,
+			"\tdiagnostics in: %ld us\n"
+			"\tenergy: %.6g kinetic, %.6g potential, %.3g relative drift\n"
+			"\tmomentum: %.6g linear, %.6g angular\n",
+			diag_us, sum.kinetic, sum.potential, drift,
+			diagnostics_norm(sum.momentum), diagnostics_norm(sum.angular));
+	else
+		fprintf(stdout, ",%.9g,%.9g,%.6g,%.6g,%.6g,%ld", sum.kinetic,
+			sum.potential, drift, diagnostics_norm(sum.momentum),
+			diagnostics_norm(sum.angular), diag_us);
 }
 
+// Prints the process's peak resident memory in total and per particle.
 static void
-sync_tree_particles(struct particle tree_particles[],
-	const struct particle_slice *slice)
+print_memory(void)
 {
-	if (slice == NULL) {
-		memcpy(tree_particles, particles,
-			sizeof(struct particle) * options.particles);
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage))
 		return;
-	}
 
-	// Copy everything before the slice over into the local particle slice.
-	memcpy(&tree_particles[0], &particles[0],
-		sizeof(struct particle) * slice->offset);
-	// Copy everything after the slice over into the local particle slice.
-	const size_t after = slice->offset + slice->len;
-	const size_t len   = options.particles - after;
-	memcpy(&tree_particles[after], &particles[after],
-		sizeof(struct particle) * len);
+	// The maximum resident set size is given in KiB.
+	const double bytes = (double)usage.ru_maxrss * 1024;
+	fprintf(stderr, "peak memory: %.1f MiB (%.1f bytes per particle)\n",
+		bytes / (1024 * 1024), bytes / (double)options.particles);
 }
 
 static void
@@ -53,57 +53,159 @@
    email: m-mat @ math.sci.hiroshima-u.ac.jp (remove spaces)
 */
 
-#define NN 312
+#include "barnes-hut/mt19937_64.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <pthread.h>
+
+#define NN MT19937_64_NN
 #define MM 156
 #define MATRIX_A 0xB5026F5AA96619E9ULL
 #define UM 0xFFFFFFFF80000000ULL /* Most significant 33 bits */
 #define LM 0x7FFFFFFFULL /* Least significant 31 bits */
 
-/* The array for the state vector */
-static unsigned long long mt[NN];
-/* mti==NN+1 means mt[NN] is not initialized */
-static int mti = NN + 1;
+/* The degree of the characteristic polynomial (the period exponent) */
+#define MEXP 19937
+/* The number of 64-bit words of a polynomial of degree < 2 * MEXP */
+#define PW ((2 * MEXP + 63) / 64 + 1)
+
+/* A 4-lane vector of state words (AVX2 or 2x SSE2, depending on -march) */
+typedef unsigned long long v4u64 __attribute__((vector_size(32)));
+#define LANES 4
+/* Unaligned vector loads and stores (macros, as passing vectors by value
+   depends on the enabled instruction set) */
+#define V4_LOAD(v, p) memcpy(&(v), (p), sizeof(v4u64))
+#define V4_STORE(p, v) memcpy((p), &(v), sizeof(v4u64))
+
+/* The global generator state for the single value API */
+static struct mt19937_64 global = { .mti = NN + 1 };
+
+/* The jump polynomial x^(2^64) mod the characteristic polynomial, computed
+   once by the first jump of any thread (or the error computing it) */
+static uint64_t *jump_poly = NULL;
+static int jump_poly_err = 0;
+static pthread_once_t jump_poly_once = PTHREAD_ONCE_INIT;
+
+static void twist(unsigned long long mt[NN]);
+static inline unsigned long long temper(unsigned long long x);
+static void init_jump_poly(void);
 
 void
 mt1993764_init(unsigned long long seed)
 {
-	mt[0] = seed;
-	for (mti = 1; mti < NN; mti++)
-		mt[mti] = (6364136223846793005ULL * (mt[mti - 1] ^ (mt[mti - 1] >> 62))
-			+ mti);
+	mt1993764_init_state(&global, seed);
 }
 
 unsigned long long
 mt1993764_int64(void)
 {
-	int i;
-	unsigned long long x;
-	static unsigned long long mag01[2] = { 0ULL, MATRIX_A };
-
-	if (mti >= NN) { /* generate NN words at one time */
+	if (global.mti >= NN) { /* generate NN words at one time */
 		/* if init_genrand64() has not been called, */
 		/* a default initial seed is used     */
-		if (mti == NN + 1)
-			mt1993764_init(5489ULL);
+		if (global.mti == NN + 1)
+			mt1993764_init_state(&global, 5489ULL);
 
-		for (i = 0; i < NN - MM; i++) {
-			x	  = (mt[i] & UM) | (mt[i + 1] & LM);
-			mt[i] = mt[i + MM] ^ (x >> 1) ^ mag01[(int)(x & 1ULL)];
-		}
+		twist(global.mt);
+		global.mti = 0;
+	}
+
+	return temper(global.mt[global.mti++]);
+}
+
+void
+mt1993764_init_state(struct mt19937_64 *state, unsigned long long seed)
+{
+	unsigned long long *mt = state->mt;
+
+	mt[0] = seed;
+	for (unsigned i = 1; i < NN; i++)
+		mt[i] = (6364136223846793005ULL * (mt[i - 1] ^ (mt[i - 1] >> 62)) + i);
+	state->mti = NN;
+}
+
+void
+mt1993764_fill(struct mt19937_64 *state, unsigned long long out[], size_t len)
+{
+	/* drain the remainder of the current block */
+	while (len > 0 && state->mti < NN) {
+		*out++ = temper(state->mt[state->mti++]);
+		len--;
+	}
 
-		for (; i < NN - 1; i++) {
-			x	  = (mt[i] & UM) | (mt[i + 1] & LM);
-			mt[i] = mt[i + (MM - NN)] ^ (x >> 1) ^ mag01[(int)(x & 1ULL)];
+	/* generate and temper whole blocks straight into the output */
+	while (len > 0) {
+		twist(state->mt);
+
+		const size_t n = (len < NN) ? len : NN;
+		size_t i	   = 0;
+		for (; i + LANES <= n; i += LANES) {
+			v4u64 x;
+			V4_LOAD(x, &state->mt[i]);
+			x ^= (x >> 29) & 0x5555555555555555ULL;
+			x ^= (x << 17) & 0x71D67FFFEDA60000ULL;
+			x ^= (x << 37) & 0xFFF7EEE000000000ULL;
+			x ^= (x >> 43);
+			V4_STORE(&out[i], x);
 		}
+		for (; i < n; i++)
+			out[i] = temper(state->mt[i]);
+
+		state->mti = n;
+		out += n;
+		len -= n;
+	}
+}
+
+/* Regenerates all NN words of the state at once. */
+static void
+twist(unsigned long long mt[NN])
+{
+	unsigned i = 0;
+	unsigned long long x;
 
-		x		   = (mt[NN - 1] & UM) | (mt[0] & LM);
-		mt[NN - 1] = mt[MM - 1] ^ (x >> 1) ^ mag01[(int)(x & 1ULL)];
+	/*
+	 * Within each of the two loops, every new word only depends on words that
+	 * are not written by the same loop, so LANES words can be computed at once.
+	 */
+	for (; i + LANES <= NN - MM; i += LANES) {
+		v4u64 cur, nxt, far;
+		V4_LOAD(cur, &mt[i]);
+		V4_LOAD(nxt, &mt[i + 1]);
+		V4_LOAD(far, &mt[i + MM]);
+		const v4u64 y = (cur & UM) | (nxt & LM);
+		cur			  = far ^ (y >> 1) ^ (-(y & 1ULL) & MATRIX_A);
+		V4_STORE(&mt[i], cur);
+	}
+	for (; i < NN - MM; i++) {
+		x	  = (mt[i] & UM) | (mt[i + 1] & LM);
+		mt[i] = mt[i + MM] ^ (x >> 1) ^ (-(x & 1ULL) & MATRIX_A);
+	}
 
-		mti = 0;
+	for (; i + LANES <= NN - 1; i += LANES) {
+		v4u64 cur, nxt, far;
+		V4_LOAD(cur, &mt[i]);
+		V4_LOAD(nxt, &mt[i + 1]);
+		V4_LOAD(far, &mt[i + (MM - NN)]);
+		const v4u64 y = (cur & UM) | (nxt & LM);
+		cur			  = far ^ (y >> 1) ^ (-(y & 1ULL) & MATRIX_A);
+		V4_STORE(&mt[i], cur);
+	}
+	for (; i < NN - 1; i++) {
+		x	  = (mt[i] & UM) | (mt[i + 1] & LM);
+		mt[i] = mt[i + (MM - NN)] ^ (x >> 1) ^ (-(x & 1ULL) & MATRIX_A);
 	}
 
-	x = mt[mti++];
+	x		   = (mt[NN - 1] & UM) | (mt[0] & LM);
+	mt[NN - 1] = mt[MM - 1] ^ (x >> 1) ^ (-(x & 1ULL) & MATRIX_A);
+}
 
+static inline unsigned long long
+temper(unsigned long long x)
+{
 	x ^= (x >> 29) & 0x5555555555555555ULL;
 	x ^= (x << 17) & 0x71D67FFFEDA60000ULL;
 	x ^= (x << 37) & 0xFFF7EEE000000000ULL;
@@ -111,3 +213,228 @@ mt1993764_int64(void)
 
 	return x;
 }
+
+/*
+ * Jump-ahead (Haramoto et al., "Efficient Jump Ahead for F2-Linear Random
+ * Number Generators", 2008).
+ *
+ * The state sequence satisfies the recurrence given by the characteristic
+ * polynomial p(x) of the transition matrix A, which is recovered with the
+ * Berlekamp-Massey algorithm from 2 * MEXP output bits. Jumping J steps ahead
+ * then amounts to evaluating g(A) * s for g(x) = x^J mod p(x).
+ *
+ * Polynomials over GF(2) are bit arrays of PW words, bit i is the coefficient
+ * of x^i.
+ */
+
+/* Advances a state in incremental form (word `*p` is regenerated next). */
+static inline void
+step(unsigned long long mt[NN], unsigned *p)
+{
+	const unsigned i		   = *p;
+	const unsigned long long x = (mt[i] & UM) | (mt[(i + 1) % NN] & LM);
+	mt[i]					   = mt[(i + MM) % NN] ^ (x >> 1)
+		^ (-(x & 1ULL) & MATRIX_A);
+	*p = (i + 1) % NN;
+}
+
+static inline unsigned
+poly_bit(const uint64_t *a, size_t i)
+{
+	return (a[i / 64] >> (i % 64)) & 1;
+}
+
+/* Returns the 64 bits of `a` starting at bit `off` (zero beyond PW words). */
+static inline uint64_t
+poly_bits(const uint64_t *a, size_t off)
+{
+	const size_t w	 = off / 64;
+	const unsigned s = off % 64;
+	if (w >= PW)
+		return 0;
+
+	uint64_t res = a[w] >> s;
+	if (s > 0 && w + 1 < PW)
+		res |= a[w + 1] << (64 - s);
+	return res;
+}
+
+/* Computes dst ^= src * x^shift (truncated to PW words). */
+static void
+poly_xor_shifted(uint64_t *dst, const uint64_t *src, size_t shift)
+{
+	const size_t w	 = shift / 64;
+	const unsigned s = shift % 64;
+
+	for (size_t i = PW; i-- > w;) {
+		uint64_t v = src[i - w] << s;
+		if (s > 0 && i > w)
+			v |= src[i - w - 1] >> (64 - s);
+		dst[i] ^= v;
+	}
+}
+
+/* Reduces `a` (degree < 2 * MEXP) modulo the monic `mod` of degree MEXP. */
+static void
+poly_mod(uint64_t *a, const uint64_t *mod)
+{
+	for (size_t i = 2 * MEXP; i-- > MEXP;)
+		if (poly_bit(a, i))
+			poly_xor_shifted(a, mod, i - MEXP);
+}
+
+/* Computes a = a^2 mod `mod`. */
+static void
+poly_sqr_mod(uint64_t *a, uint64_t *tmp, const uint64_t *mod)
+{
+	/* squaring over GF(2) spreads bit i to bit 2i */
+	memset(tmp, 0, sizeof(uint64_t) * PW);
+	for (size_t i = 0; i < (MEXP + 63) / 64; i++)
+		for (unsigned half = 0; half < 2; half++) {
+			uint64_t x = (a[i] >> (32 * half)) & 0xFFFFFFFFULL;
+			x		   = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+			x		   = (x | (x << 8)) & 0x00FF00FF00FF00FFULL;
+			x		   = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+			x		   = (x | (x << 2)) & 0x3333333333333333ULL;
+			x		   = (x | (x << 1)) & 0x5555555555555555ULL;
+			if (2 * i + half < PW)
+				tmp[2 * i + half] = x;
+		}
+
+	poly_mod(tmp, mod);
+	memcpy(a, tmp, sizeof(uint64_t) * PW);
+}
+
+/* Recovers the characteristic polynomial with Berlekamp-Massey. */
+static int
+char_poly(uint64_t *res)
+{
+	const size_t n = 2 * MEXP;
+	uint64_t *rev  = calloc(PW, sizeof(uint64_t));
+	uint64_t *c	   = calloc(PW, sizeof(uint64_t));
+	uint64_t *b	   = calloc(PW, sizeof(uint64_t));
+	uint64_t *t	   = calloc(PW, sizeof(uint64_t));
+	int err		   = 0;
+
+	if (rev == NULL || c == NULL || b == NULL || t == NULL) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	/* the sequence s_i (lowest bit of each new word), stored reversed */
+	struct mt19937_64 state;
+	unsigned p = 0;
+	mt1993764_init_state(&state, 5489ULL);
+	for (size_t i = 0; i < n; i++) {
+		step(state.mt, &p);
+		const size_t k = n - 1 - i;
+		rev[k / 64] |= (uint64_t)(state.mt[(p + NN - 1) % NN] & 1) << (k % 64);
+	}
+
+	/* c(x) is the connection polynomial, s_i = sum_{j=1..L} c_j s_{i-j} */
+	size_t len = 0, m = 1;
+	c[0] = b[0] = 1;
+	for (size_t i = 0; i < n; i++) {
+		/* the discrepancy sum_{j=0..L} c_j s_{i-j} over reversed bits */
+		uint64_t d = 0;
+		for (size_t w = 0; w <= len / 64; w++)
+			d ^= c[w] & poly_bits(rev, (n - 1 - i) + 64 * w);
+		if (!__builtin_parityll(d)) {
+			m++;
+			continue;
+		}
+
+		if (2 * len <= i) {
+			memcpy(t, c, sizeof(uint64_t) * PW);
+			poly_xor_shifted(c, b, m);
+			len = i + 1 - len;
+			memcpy(b, t, sizeof(uint64_t) * PW);
+			m = 1;
+		} else {
+			poly_xor_shifted(c, b, m);
+			m++;
+		}
+	}
+
+	if (len != MEXP) {
+		err = EINVAL;
+		goto out;
+	}
+
+	/* the characteristic polynomial is the reciprocal x^L c(1/x) */
+	memset(res, 0, sizeof(uint64_t) * PW);
+	for (size_t i = 0; i <= len; i++)
+		if (poly_bit(c, len - i))
+			res[i / 64] |= (uint64_t)1 << (i % 64);
+
+out:
+	free(t);
+	free(b);
+	free(c);
+	free(rev);
+	return err;
+}
+
+static void
+init_jump_poly(void)
+{
+	uint64_t *mod = calloc(PW, sizeof(uint64_t));
+	uint64_t *tmp = calloc(PW, sizeof(uint64_t));
+	uint64_t *g	  = calloc(PW, sizeof(uint64_t));
+	int err;
+
+	if (mod == NULL || tmp == NULL || g == NULL) {
+		err = ENOMEM;
+		goto error;
+	}
+
+	if ((err = char_poly(mod)))
+		goto error;
+
+	/* g(x) = x^(2^64) mod p(x) by 64 successive squarings of x */
+	g[0] = 2;
+	for (unsigned i = 0; i < 64; i++)
+		poly_sqr_mod(g, tmp, mod);
+
+	free(tmp);
+	free(mod);
+	jump_poly = g;
+	return;
+
+error:
+	free(g);
+	free(tmp);
+	free(mod);
+	jump_poly_err = err;
+}
+
+int
+mt1993764_jump(struct mt19937_64 *state)
+{
+	if (state->mti != NN)
+		return EINVAL;
+	pthread_once(&jump_poly_once, init_jump_poly);
+	if (jump_poly == NULL)
+		return jump_poly_err;
+
+	/*
+	 * Accumulates g(A) * s = sum_i g_i * A^i * s, with every A^i * s aligned
+	 * to its regeneration index `p` (a state with `mti == NN` is exactly an
+	 * incremental state with p = 0).
+	 */
+	struct mt19937_64 t = *state;
+	unsigned long long acc[NN];
+	unsigned p = 0;
+
+	memset(acc, 0, sizeof(acc));
+	for (size_t i = 0; i < MEXP; i++) {
+		if (poly_bit(jump_poly, i))
+			for (unsigned k = 0; k < NN; k++)
+				acc[k] ^= t.mt[(p + k) % NN];
+		step(t.mt, &p);
+	}
+
+	memcpy(state->mt, acc, sizeof(acc));
+	state->mti = NN;
+	return 0;
+}
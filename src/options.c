@@ -15,137 +15,463 @@
 
 // The default configuration options.
 struct options options = {
-	.steps	   = 0,
-	.particles = 100000,
-	.max_mass  = 1e12,
-	.radius	   = 250.0,
-	.theta	   = 0.3,
-	.dt		   = 0.01,
-	.threads   = 1,
-	.seed	   = 0,
-	.delay	   = 0,
-	.optimize  = false,
-	.flat	   = false,
-	.verbose   = false,
+	.steps			  = 0,
+	.particles		  = 100000,
+	.max_mass		  = 1e12,
+	.radius			  = 250.0,
+	.theta			  = 0.3,
+	.dt				  = 0.01,
+	.threads		  = 1,
+	.seed			  = 0,
+	.delay			  = 0,
+	.optimize		  = false,
+	.order			  = ORDER_MORTON,
+	.sort_every		  = 10,
+	.flat			  = false,
+	.verbose		  = false,
+	.pin			  = PIN_NONE,
+	.pin_list		  = NULL,
+	.checkpoint		  = NULL,
+	.checkpoint_every = 100,
+	.restore		  = NULL,
+	.theta_set		  = false,
+	.dt_set			  = false,
+	.optimize_set	  = false,
+	.snapshot		  = NULL,
+	.snapshot_every	  = 10,
+	.snapshot_bits	  = 16,
+	.frames			  = NULL,
+	.frames_every	  = 1,
+	.lod			  = 0.0,
+	.shm			  = NULL,
+	.phases			  = NULL,
+	.perf_counters	  = false,
+	.trace			  = NULL,
+	.clusters		  = 0,
+	.solver			  = SOLVER_TREE,
+	.accuracy		  = 0,
+	.diagnostics	  = 0,
+	.ranks			  = 1,
+	.rank			  = -1,
+	.transport		  = NULL,
+	.ensemble		  = NULL,
+	.lean			  = false,
+	.packed			  = false,
+	.autotune		  = 0.0,
+	.autotune_cache	  = NULL,
 };
 
 static inline int parse_arg_ull(const char *name, const char *optarg,
 	unsigned long long *res);
 static inline int parse_arg_float(const char *name, const char *optarg,
 	float *res);
+static int parse_opt(struct options *opts, int opt, const char *optarg);
 static int print_usage(const char *exe);
 
 #define THETA 1000
 #define DT 1001
+#define PIN 1002
+#define CHECKPOINT 1003
+#define CHECKPOINT_EVERY 1004
+#define RESTORE 1005
+#define SNAPSHOT 1006
+#define SNAPSHOT_EVERY 1007
+#define SNAPSHOT_BITS 1008
+#define FRAMES 1009
+#define FRAMES_EVERY 1010
+#define LOD 1011
+#define SHM 1012
+#define PHASE_PROFILE 1013
+#define PERF_COUNTERS 1014
+#define TRACE_FILE 1015
+#define CLUSTERS 1016
+#define SOLVER 1017
+#define ACCURACY 1018
+#define DIAGNOSTICS 1019
+#define RANKS 1020
+#define RANK 1021
+#define TRANSPORT 1022
+#define ENSEMBLE 1023
+#define LEAN 1024
+#define PACKED 1025
+#define ORDER 1026
+#define SORT_EVERY 1027
+#define AUTOTUNE 1028
+#define AUTOTUNE_CACHE 1029
 
 static const char *argsstrs[] = {
-	['t']	= "steps",
-	['n']	= "num",
-	['m']	= "mass",
-	['r']	= "radius",
-	['p']	= "threads",
-	['s']	= "seed",
-	['d']	= "delay",
-	[THETA] = "theta",
-	[DT]	= "dt",
+	['t']			   = "steps",
+	['n']			   = "num",
+	['m']			   = "mass",
+	['r']			   = "radius",
+	['p']			   = "threads",
+	['s']			   = "seed",
+	['d']			   = "delay",
+	[THETA]			   = "theta",
+	[DT]			   = "dt",
+	[PIN]			   = "pin",
+	[CHECKPOINT]	   = "checkpoint",
+	[CHECKPOINT_EVERY] = "checkpoint-every",
+	[RESTORE]		   = "restore",
+	[SNAPSHOT]		   = "snapshot",
+	[SNAPSHOT_EVERY]   = "snapshot-every",
+	[SNAPSHOT_BITS]	   = "snapshot-bits",
+	[FRAMES]		   = "frames",
+	[FRAMES_EVERY]	   = "frames-every",
+	[LOD]			   = "lod",
+	[SHM]			   = "shm",
+	[PHASE_PROFILE]	   = "phases",
+	[PERF_COUNTERS]	   = "perf-counters",
+	[TRACE_FILE]	   = "trace",
+	[CLUSTERS]		   = "clusters",
+	[SOLVER]		   = "solver",
+	[ACCURACY]		   = "accuracy",
+	[DIAGNOSTICS]	   = "diagnostics",
+	[RANKS]			   = "ranks",
+	[RANK]			   = "rank",
+	[TRANSPORT]		   = "transport",
+	[ENSEMBLE]		   = "ensemble",
+	[LEAN]			   = "lean",
+	[PACKED]		   = "packed",
+	[ORDER]			   = "order",
+	[SORT_EVERY]	   = "sort-every",
+	[AUTOTUNE]		   = "autotune",
+	[AUTOTUNE_CACHE]   = "autotune-cache",
+};
+
+static const struct option long_opts[] = {
+	{ "steps", required_argument, NULL, 't' },
+	{ "num", required_argument, NULL, 'n' },
+	{ "mass", required_argument, NULL, 'm' },
+	{ "radius", required_argument, NULL, 'r' },
+	{ "theta", required_argument, NULL, THETA },
+	{ "dt", required_argument, NULL, DT },
+	{ "threads", required_argument, NULL, 'p' },
+	{ "seed", required_argument, NULL, 's' },
+	{ "delay", required_argument, NULL, 'd' },
+	{ "pin", required_argument, NULL, PIN },
+	{ "checkpoint", required_argument, NULL, CHECKPOINT },
+	{ "checkpoint-every", required_argument, NULL, CHECKPOINT_EVERY },
+	{ "restore", required_argument, NULL, RESTORE },
+	{ "snapshot", required_argument, NULL, SNAPSHOT },
+	{ "snapshot-every", required_argument, NULL, SNAPSHOT_EVERY },
+	{ "snapshot-bits", required_argument, NULL, SNAPSHOT_BITS },
+	{ "frames", required_argument, NULL, FRAMES },
+	{ "frames-every", required_argument, NULL, FRAMES_EVERY },
+	{ "lod", required_argument, NULL, LOD },
+	{ "shm", required_argument, NULL, SHM },
+	{ "phases", required_argument, NULL, PHASE_PROFILE },
+	{ "perf-counters", no_argument, NULL, PERF_COUNTERS },
+	{ "trace", required_argument, NULL, TRACE_FILE },
+	{ "clusters", required_argument, NULL, CLUSTERS },
+	{ "solver", required_argument, NULL, SOLVER },
+	{ "accuracy", required_argument, NULL, ACCURACY },
+	{ "diagnostics", required_argument, NULL, DIAGNOSTICS },
+	{ "ranks", required_argument, NULL, RANKS },
+	{ "rank", required_argument, NULL, RANK },
+	{ "transport", required_argument, NULL, TRANSPORT },
+	{ "ensemble", required_argument, NULL, ENSEMBLE },
+	{ "lean", no_argument, NULL, LEAN },
+	{ "packed", no_argument, NULL, PACKED },
+	{ "order", required_argument, NULL, ORDER },
+	{ "sort-every", required_argument, NULL, SORT_EVERY },
+	{ "autotune", optional_argument, NULL, AUTOTUNE },
+	{ "autotune-cache", required_argument, NULL, AUTOTUNE_CACHE },
+	{ "optimize", no_argument, NULL, 'o' },
+	{ "flat", no_argument, NULL, 'f' },
+	{ "verbose", no_argument, NULL, 'v' },
+	{ 0, 0, 0, 0 },
 };
 
 int
 options_parse(int argc, char *argv[argc])
 {
-	static const struct option long_opts[] = {
-		{ "steps", required_argument, NULL, 't' },
-		{ "num", required_argument, NULL, 'n' },
-		{ "mass", required_argument, NULL, 'm' },
-		{ "radius", required_argument, NULL, 'r' },
-		{ "theta", required_argument, NULL, THETA },
-		{ "dt", required_argument, NULL, DT },
-		{ "threads", required_argument, NULL, 'p' },
-		{ "seed", required_argument, NULL, 's' },
-		{ "delay", required_argument, NULL, 'd' },
-		{ "optimize", no_argument, NULL, 'o' },
-		{ "flat", no_argument, NULL, 'f' },
-		{ "verbose", no_argument, NULL, 'v' },
-		{ 0, 0, 0, 0 },
-	};
+	const int res = options_parse_args(&options, argc, argv);
+	if (res)
+		print_usage(argv[0]);
+	return res;
+}
 
+int
+options_parse_args(struct options *opts, int argc, char *argv[argc])
+{
 	int res = 0;
+	// Restart scanning, the arguments may not be the first ones parsed.
+	optind = 0;
 	while (true) {
 		const int opt
 			= getopt_long(argc, argv, "t:n:m:r:p:s:d:hofv", long_opts, NULL);
-
-		unsigned long long ull;
-		float f;
-
 		if (opt == -1)
 			break;
-
-		switch (opt) {
-		case 't':
-			if ((res = parse_arg_ull(argsstrs[opt], optarg, &ull)))
-				goto out;
-			options.steps = (unsigned)ull;
-			break;
-		case 'n':
-			if ((res = parse_arg_ull(argsstrs[opt], optarg, &ull)))
-				goto out;
-			options.particles = ull;
-			break;
-		case 'm':
-			if ((res = parse_arg_float(argsstrs[opt], optarg, &f)))
-				goto out;
-			options.max_mass = f;
-			break;
-		case 'r':
-			if ((res = parse_arg_float(argsstrs[opt], optarg, &f)))
-				goto out;
-			options.radius = f;
-			break;
-		case 'p':
-			if ((res = parse_arg_ull(argsstrs[opt], optarg, &ull)))
-				goto out;
-			options.threads = (unsigned)ull;
-			break;
-		case 's':
-			if ((res = parse_arg_ull(argsstrs[opt], optarg, &ull)))
-				goto out;
-			options.seed = (unsigned)ull;
-			break;
-		case 'd':
-			if ((res = parse_arg_ull(argsstrs[opt], optarg, &ull)))
-				goto out;
-			options.delay = (unsigned)ull;
-			break;
-		case THETA:
-			if ((res = parse_arg_float(argsstrs[opt], optarg, &f)))
-				goto out;
-			options.theta = f;
-			break;
-		case DT:
-			if ((res = parse_arg_float(argsstrs[opt], optarg, &f)))
-				goto out;
-			options.dt = f;
-			break;
-		case 'o':
-			options.optimize = true;
+		if ((res = parse_opt(opts, opt, optarg)))
 			break;
-		case 'f':
-			options.flat = true;
-			break;
-		case 'v':
-			options.verbose = true;
-			break;
-		case 'h':
-			res = BHE_EARLY_EXIT;
+	}
+
+	return res;
+}
+
+int
+options_set(struct options *opts, const char *name, const char *value)
+{
+	for (const struct option *o = long_opts; o->name != NULL; o++) {
+		if (strcmp(name, o->name) != 0)
+			continue;
+		if ((o->has_arg == no_argument && value != NULL)
+			|| (o->has_arg == required_argument && value == NULL))
+			return EINVAL;
+		return parse_opt(opts, o->val, value);
+	}
+
+	return EINVAL;
+}
+
+// Parses the option `opt` (a short option or one of the long option
+// constants) with the given argument into `opts`.
+static int
+parse_opt(struct options *opts, int opt, const char *optarg)
+{
+	unsigned long long ull;
+	float f;
+	int res = 0;
+
+	switch (opt) {
+	case 't':
+		if ((res = parse_arg_ull(argsstrs[opt], optarg, &ull)))
+			goto out;
+		opts->steps = (unsigned)ull;
+		break;
+	case 'n':
+		if ((res = parse_arg_ull(argsstrs[opt], optarg, &ull)))
+			goto out;
+		opts->particles = ull;
+		break;
+	case 'm':
+		if ((res = parse_arg_float(argsstrs[opt], optarg, &f)))
+			goto out;
+		opts->max_mass = f;
+		break;
+	case 'r':
+		if ((res = parse_arg_float(argsstrs[opt], optarg, &f)))
+			goto out;
+		opts->radius = f;
+		break;
+	case 'p':
+		if ((res = parse_arg_ull(argsstrs[opt], optarg, &ull)))
+			goto out;
+		opts->threads = (unsigned)ull;
+		break;
+	case 's':
+		if ((res = parse_arg_ull(argsstrs[opt], optarg, &ull)))
+			goto out;
+		opts->seed = (unsigned)ull;
+		break;
+	case 'd':
+		if ((res = parse_arg_ull(argsstrs[opt], optarg, &ull)))
+			goto out;
+		opts->delay = (unsigned)ull;
+		break;
+	case THETA:
+		if ((res = parse_arg_float(argsstrs[opt], optarg, &f)))
+			goto out;
+		opts->theta		= f;
+		opts->theta_set = true;
+		break;
+	case DT:
+		if ((res = parse_arg_float(argsstrs[opt], optarg, &f)))
+			goto out;
+		opts->dt	 = f;
+		opts->dt_set = true;
+		break;
+	case PIN:
+		if ((res = affinity_parse(optarg, &opts->pin)))
+			goto out;
+		opts->pin_list = optarg;
+		break;
+	case CHECKPOINT:
+		opts->checkpoint = optarg;
+		break;
+	case CHECKPOINT_EVERY:
+		if ((res = parse_arg_ull(argsstrs[opt], optarg, &ull)))
+			goto out;
+		if (ull == 0) {
+			fprintf(stderr, "Invalid %s arg: Must be positive\n",
+				argsstrs[opt]);
+			res = EINVAL;
 			goto out;
-		default:
-			break;
 		}
+		opts->checkpoint_every = (unsigned)ull;
+		break;
+	case RESTORE:
+		opts->restore = optarg;
+		break;
+	case SNAPSHOT:
+		opts->snapshot = optarg;
+		break;
+	case SNAPSHOT_EVERY:
+		if ((res = parse_arg_ull(argsstrs[opt], optarg, &ull)))
+			goto out;
+		if (ull == 0) {
+			fprintf(stderr, "Invalid %s arg: Must be positive\n",
+				argsstrs[opt]);
+			res = EINVAL;
+			goto out;
+		}
+		opts->snapshot_every = (unsigned)ull;
+		break;
+	case SNAPSHOT_BITS:
+		if ((res = parse_arg_ull(argsstrs[opt], optarg, &ull)))
+			goto out;
+		if (ull == 0 || ull > 21) {
+			fprintf(stderr, "Invalid %s arg: Must be within 1..21\n",
+				argsstrs[opt]);
+			res = EINVAL;
+			goto out;
+		}
+		opts->snapshot_bits = (unsigned)ull;
+		break;
+	case FRAMES:
+		opts->frames = optarg;
+		break;
+	case FRAMES_EVERY:
+		if ((res = parse_arg_ull(argsstrs[opt], optarg, &ull)))
+			goto out;
+		if (ull == 0) {
+			fprintf(stderr, "Invalid %s arg: Must be positive\n",
+				argsstrs[opt]);
+			res = EINVAL;
+			goto out;
+		}
+		opts->frames_every = (unsigned)ull;
+		break;
+	case LOD:
+		if ((res = parse_arg_float(argsstrs[opt], optarg, &f)))
+			goto out;
+		opts->lod = f;
+		break;
+	case SHM:
+		opts->shm = optarg;
+		break;
+	case PHASE_PROFILE:
+		opts->phases = optarg;
+		break;
+	case PERF_COUNTERS:
+		opts->perf_counters = true;
+		break;
+	case TRACE_FILE:
+#ifndef TRACE
+		fprintf(stderr, "Invalid %s arg: Requires a build with TRACE=1\n",
+			argsstrs[opt]);
+		res = EINVAL;
+		goto out;
+#endif // TRACE
+		opts->trace = optarg;
+		break;
+	case CLUSTERS:
+		if ((res = parse_arg_ull(argsstrs[opt], optarg, &ull)))
+			goto out;
+		opts->clusters = (unsigned)ull;
+		break;
+	case SOLVER:
+		if ((res = direct_parse(optarg, &opts->solver)))
+			goto out;
+		break;
+	case ACCURACY:
+		if ((res = parse_arg_ull(argsstrs[opt], optarg, &ull)))
+			goto out;
+		opts->accuracy = ull;
+		break;
+	case DIAGNOSTICS:
+		if ((res = parse_arg_ull(argsstrs[opt], optarg, &ull)))
+			goto out;
+		opts->diagnostics = (unsigned)ull;
+		break;
+	case RANKS:
+		if ((res = parse_arg_ull(argsstrs[opt], optarg, &ull)))
+			goto out;
+		if (ull == 0 || ull > 4096) {
+			fprintf(stderr, "Invalid %s arg: Must be within 1..4096\n",
+				argsstrs[opt]);
+			res = EINVAL;
+			goto out;
+		}
+		opts->ranks = (unsigned)ull;
+		break;
+	case RANK:
+		if ((res = parse_arg_ull(argsstrs[opt], optarg, &ull)))
+			goto out;
+		if (ull >= 4096) {
+			fprintf(stderr, "Invalid %s arg: Must be within 0..4095\n",
+				argsstrs[opt]);
+			res = EINVAL;
+			goto out;
+		}
+		opts->rank = (int)ull;
+		break;
+	case TRANSPORT:
+		opts->transport = optarg;
+		break;
+	case ENSEMBLE:
+		opts->ensemble = optarg;
+		break;
+	case LEAN:
+		opts->lean = true;
+		break;
+	case PACKED:
+		opts->packed = true;
+		break;
+	case ORDER:
+		if ((res = particle_order_parse(optarg, &opts->order)))
+			goto out;
+		break;
+	case SORT_EVERY:
+		if ((res = parse_arg_ull(argsstrs[opt], optarg, &ull)))
+			goto out;
+		if (ull == 0) {
+			fprintf(stderr, "Invalid %s arg: Must be positive\n",
+				argsstrs[opt]);
+			res = EINVAL;
+			goto out;
+		}
+		opts->sort_every = (unsigned)ull;
+		break;
+	case AUTOTUNE:
+		// Without a bound, the error stays near that of the default theta.
+		f = 0.005;
+		if (optarg && (res = parse_arg_float(argsstrs[opt], optarg, &f)))
+			goto out;
+		if (f <= 0.0) {
+			fprintf(stderr, "Invalid %s arg: Must be positive\n",
+				argsstrs[opt]);
+			res = EINVAL;
+			goto out;
+		}
+		opts->autotune = f;
+		break;
+	case AUTOTUNE_CACHE:
+		opts->autotune_cache = optarg;
+		break;
+	case 'o':
+		opts->optimize	   = true;
+		opts->optimize_set = true;
+		break;
+	case 'f':
+		opts->flat = true;
+		break;
+	case 'v':
+		opts->verbose = true;
+		break;
+	case 'h':
+		res = BHE_EARLY_EXIT;
+		goto out;
+	case '?':
+		// The unknown option was reported by `getopt_long`.
+		res = EINVAL;
+		goto out;
+	default:
+		break;
 	}
 
 out:
-	if (res)
-		print_usage(argv[0]);
 	return res;
 }
 
@@ -218,7 +544,35 @@ print_usage(const char *exe)
 		"-v, --verbose                      The flag for enabling verbose output.\n"
 		"-h, --help                         Print this help and exit.\n"
 		"--theta                            The ???\n"
-		"--dt                               The g-force dampening factor\n",
+		"--dt                               The g-force dampening factor\n"
+		"--pin=[POLICY]                     The thread placement policy (compact, scatter, physical or a CPU list like 0,2,4-7).\n"
+		"--checkpoint=[FILE]                The file to periodically write checkpoints to.\n"
+		"--checkpoint-every=[STEPS]         The number of steps between two checkpoints (default 100).\n"
+		"--restore=[FILE]                   The checkpoint file to restore the simulation from.\n"
+		"--snapshot=[FILE]                  The file to write compressed position snapshots to.\n"
+		"--snapshot-every=[STEPS]           The number of steps between two snapshots (default 10).\n"
+		"--snapshot-bits=[BITS]             The quantization bits per axis for snapshots (1..21, default 16).\n"
+		"--frames=[DIR]                     The directory to write rendered log-density frames (PPM) to.\n"
+		"--frames-every=[STEPS]             The number of steps between two frames (default 1).\n"
+		"--lod=[PIXELS]                     Render tree nodes smaller than PIXELS on screen as single sprites (default 0, off).\n"
+		"--shm=[NAME]                       The POSIX shared memory object (e.g. /bh) to publish positions to each step.\n"
+		"--phases=[FILE]                    The CSV file to write per-thread phase times of each step to.\n"
+		"--perf-counters                    The flag for adding hardware counters to the phase times.\n"
+		"--trace=[FILE]                     The Chrome trace-event JSON file to write a timeline of all threads to (TRACE=1 builds).\n"
+		"--clusters=[CLUSTERS]              The number of clusters to generate the particles in (default 0, uniform).\n"
+		"--solver=[SOLVER]                  The force solver (tree, direct or auto for direct summation of small N, default tree).\n"
+		"--accuracy=[SAMPLES]               Report the tree's force error against direct summation for SAMPLES particles each step.\n"
+		"--diagnostics=[STEPS]              Report energy and momentum conservation every STEPS steps (default 0, off).\n"
+		"--ranks=[RANKS]                    The number of processes to distribute the simulation over (default 1).\n"
+		"--rank=[RANK]                      The rank of this process (default: launch all ranks locally).\n"
+		"--transport=[SPEC]                 The transport connecting the ranks (unix:DIR).\n"
+		"--ensemble=[FILE]                  Run one simulation per line of FILE (extra options per line), one per thread.\n"
+		"--lean                             Update the particles in place instead of in per-thread copies (less memory).\n"
+		"--packed                           Compute forces from compressed tree nodes (16-bit positions, bfloat16 masses).\n"
+		"--order=[ORDER]                    The curve to sort (-o) and split the particles along (morton or hilbert, default morton).\n"
+		"--sort-every=[STEPS]               The number of steps between two sorts with -o (default 10).\n"
+		"--autotune[=MAX_ERROR]             Choose the fastest threads, theta, sorting and --packed within the RMS force error (default 0.005).\n"
+		"--autotune-cache=[FILE]            The file to reuse and store the autotuner's choices (per machine and particle count).\n",
 		// clang-format on
 		exe);
 
@@ -5,6 +5,7 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include <errno.h>
@@ -15,14 +16,30 @@
 #include "barnes-hut/common.h"
 #include "barnes-hut/options.h"
 
+#include "barnes-hut/philox.h"
+
 #ifdef USE_MT19937
 #include "barnes-hut/mt19937_64.h"
+#endif // USE_MT19937
+
+#ifdef USE_MT19937
 #include <limits.h>
 #endif // USE_MT19937
 
 // The zero/origin vector.
 static const struct vec3 zero_vec = { 0.0, 0.0, 0.0 };
 
+#ifdef STATS
+_Thread_local struct tree_stats tree_stats;
+// The binary exponent of the calling thread's current tree's root octant
+// width.
+static _Thread_local int root_exp;
+
+#define STATS_ADD(field, n) (tree_stats.field += (n))
+#else
+#define STATS_ADD(field, n) ((void)0)
+#endif // STATS
+
 // Returns `x * x`.
 static inline float
 sq(float x)
@@ -34,26 +51,37 @@ sq(float x)
 static inline bool
 feql(float a, float b)
 {
-	static const float eps = 0.001;
-	return fabsf(a - b) <= eps;
+	return fabsf(a - b) <= PHYS_EPS;
 }
 
+#ifdef USE_MT19937
 // Returns a random float between 0.0 and 1.0.
 static inline float
-randomf(void)
+randomf(unsigned long long x)
 {
-#ifdef USE_MT19937
-	return (float)mt1993764_int64() / (float)ULONG_MAX;
-#else
-	return (float)random() / (float)RAND_MAX;
-#endif // USE_MT19937
+	return (float)x / (float)ULONG_MAX;
 }
+#endif // USE_MT19937
+
+static inline struct vec3 sphere_point(const float u[3], float r, bool flat);
+// A particle and its key along a space-filling curve.
+struct keyed_particle {
+	uint64_t key;
+	struct particle part;
+};
 
 // Returns the morton number for the given x, y, z coordinates.
 static inline uint64_t morton_number(unsigned x, unsigned y, unsigned z);
+// Returns the Hilbert index for the given x, y, z coordinates (21 bits each).
+static inline uint64_t hilbert_number(unsigned x, unsigned y, unsigned z);
 static inline int sort_by_z_curve(const struct particle *p0,
 	const struct particle *p1);
-static struct vec3 gforce(const struct point_mass *p0,
+static inline int sort_by_key(const struct keyed_particle *p0,
+	const struct keyed_particle *p1);
+// Returns the potential energy of the pair of point masses.
+static forceinline float gpotential(const struct point_mass *p0,
+	const struct point_mass *p1);
+static forceinline struct vec3 gforce(const struct point_mass *p0,
 	const struct point_mass *p1);
 
 // Adds vector `u` to vector `v`.
@@ -72,32 +100,135 @@ static inline float vec3_dist_sq(const struct vec3 *v, const struct vec3 *u);
 static inline float vec3_dist(const struct vec3 *v, const struct vec3 *u);
 
 void
-randomize_particles(struct particle particles[], float r)
+randomize_particles(struct particle particles[], size_t from, size_t len,
+	const struct options *opts, struct mt19937_64 *rng)
 {
-	for (size_t p = 0; p < options.particles; p++) {
-		const float x	 = randomf() * 2 * r - r;
-		const float ymax = sqrtf(sq(r) - sq(x));
-		const float y	 = randomf() * 2 * ymax - ymax;
-		const float zmax = sqrt(sq(r) - sq(x) - sq(y));
-		const float z	 = (!options.flat) ? randomf() * 2 * zmax - zmax : 0.0;
+	const float r = opts->radius;
+
+#ifdef USE_MT19937
+	// Random numbers are drawn from the stream in blocks of 64 particles.
+	unsigned long long block[3 * 64];
+	unsigned next = 64;
+#endif // USE_MT19937
 
-		particles[p] = (struct particle){
+	for (size_t p = from; p < from + len; p++) {
+		float u[3];
+#ifdef USE_MT19937
+		if (next == 64) {
+			mt1993764_fill(rng, block, 3 * 64);
+			next = 0;
+		}
+
+		for (unsigned i = 0; i < 3; i++)
+			u[i] = randomf(block[3 * next + i]);
+		next += 1;
+#else
+		// The coordinates of particle `p` only depend on the seed and `p`.
+		const struct philox4x32 rnd = philox4x32(p, 0, opts->seed);
+		for (unsigned i = 0; i < 3; i++)
+			u[i] = philox_unit(rnd.v[i]);
+#endif // USE_MT19937
+
+		struct vec3 pos;
+		if (opts->clusters > 0) {
+			// Particle `p` belongs to cluster `p % clusters`, whose center
+			// only depends on the seed and the cluster.
+			const float cr				 = r / (2 * cbrtf(opts->clusters));
+			const struct philox4x32 crnd = philox4x32(p % opts->clusters, 1,
+				opts->seed);
+			const float cu[3] = { philox_unit(crnd.v[0]),
+				philox_unit(crnd.v[1]), philox_unit(crnd.v[2]) };
+
+			const struct vec3 center = sphere_point(cu, r - cr, opts->flat);
+			pos						 = sphere_point(u, cr, opts->flat);
+			vec3_addassign(&pos, &center);
+		} else
+			pos = sphere_point(u, r, opts->flat);
+
+		particles[p - from] = (struct particle){
         .part =
             {
-                .pos = {x, y, z},
-                .mass = options.max_mass,
+                .pos = pos,
+                .mass = opts->max_mass,
             },
         .vel = zero_vec,
     };
 	}
 }
 
-void
-sort_particles(struct particle particles[])
+// Maps three uniform numbers within [0.0, 1.0) to a point within a sphere
+// (or disk, with `flat`) of radius `r` around the origin.
+static inline struct vec3
+sphere_point(const float u[3], float r, bool flat)
+{
+	const float x	 = u[0] * 2 * r - r;
+	const float ymax = sqrtf(sq(r) - sq(x));
+	const float y	 = u[1] * 2 * ymax - ymax;
+	const float zmax = sqrt(sq(r) - sq(x) - sq(y));
+	const float z	 = (!flat) ? u[2] * 2 * zmax - zmax : 0.0;
+
+	return (struct vec3) { x, y, z };
+}
+
+int
+particle_order_parse(const char *arg, enum order *order)
+{
+	if (strcmp(arg, "morton") == 0)
+		*order = ORDER_MORTON;
+	else if (strcmp(arg, "hilbert") == 0)
+		*order = ORDER_HILBERT;
+	else {
+		fprintf(stderr, "Invalid order arg: %s\n", arg);
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+uint64_t
+particle_key(const struct point_mass *part, float radius, enum order order)
+{
+	// 21 bits per axis fill 63 bits of the key.
+	static const float max = (float)((1u << 21) - 1);
+	const float scale	   = max / (2 * radius);
+
+	const float x = fminf(fmaxf((part->pos.x + radius) * scale, 0.0), max);
+	const float y = fminf(fmaxf((part->pos.y + radius) * scale, 0.0), max);
+	const float z = fminf(fmaxf((part->pos.z + radius) * scale, 0.0), max);
+	return (order == ORDER_HILBERT)
+		? hilbert_number((unsigned)x, (unsigned)y, (unsigned)z)
+		: morton_number((unsigned)x, (unsigned)y, (unsigned)z);
+}
+
+int
+sort_particles(struct particle particles[], size_t len, enum order order,
+	float radius)
 {
 	typedef int (*cmp_fn)(const void *, const void *);
-	qsort(particles, options.particles, sizeof(struct particle),
-		(cmp_fn)&sort_by_z_curve);
+
+	if (order == ORDER_MORTON) {
+		qsort(particles, len, sizeof(struct particle),
+			(cmp_fn)&sort_by_z_curve);
+		return 0;
+	}
+
+	// Hilbert keys are too expensive to be recomputed by each comparison, so
+	// the particles are sorted along with their precomputed keys.
+	struct keyed_particle *keyed = malloc(sizeof(*keyed) * len);
+	if (unlikely(keyed == NULL))
+		return ENOMEM;
+
+	for (size_t i = 0; i < len; i++)
+		keyed[i] = (struct keyed_particle) {
+			.key  = particle_key(&particles[i].part, radius, order),
+			.part = particles[i],
+		};
+	qsort(keyed, len, sizeof(*keyed), (cmp_fn)&sort_by_key);
+	for (size_t i = 0; i < len; i++)
+		particles[i] = keyed[i].part;
+
+	free(keyed);
+	return 0;
 }
 
 struct octant_malloc_return_t {
@@ -109,68 +240,143 @@ struct octant_malloc_return_t {
 static inline bool octant_is_leaf(const struct octant *oct);
 // Arena-allocates and initializes a new octant for the given center and
 // dimensions.
-static inline struct octant_malloc_return_t octant_malloc(
+static inline struct octant_malloc_return_t octant_malloc(struct arena *arena,
 	struct point_mass center, float x, float y, float z, float len);
 // Inserts the given particle into one of the octant's children.
-static int octant_insert(struct octant *oct, const struct point_mass *part);
+static int octant_insert(struct arena *arena, struct octant *oct,
+	const struct point_mass *part);
 // Inserts the particle into the given child octant.
-static int octant_insert_child(struct octant *oct,
+static int octant_insert_child(struct arena *arena, struct octant *oct,
 	const struct point_mass *part);
 // Recursively updates the center point of the given octant.
-static struct vec3 octant_update_center(struct octant *oct);
+static struct vec3 octant_update_center(struct arena *arena,
+	struct octant *oct);
 // Recursively updates and applies gravitational force to all particles
 // contained in the given octant.
-static void octant_update_force(const struct octant *oct,
+multiversioned static void octant_update_force(
+	const struct particle_tree *tree, const struct octant *oct,
 	const struct point_mass *part, struct vec3 *force);
+// Recursively appends the locally essential octants of the given one for the
+// given box.
+static int octant_essential(const struct particle_tree *tree,
+	const struct octant *oct, const struct vec3 *lo, const struct vec3 *hi,
+	struct point_mass **parts, size_t *len, size_t *cap);
+// Recursively sums the potential energy of the given particle and all
+// particles contained in the given octant.
+static float octant_potential(const struct particle_tree *tree,
+	const struct octant *oct, const struct point_mass *part);
+// Returns the number of octants to reserve for trees of `len` particles.
+static inline size_t arena_octants(size_t len);
+// Returns the given float rounded to a bfloat16.
+static inline uint16_t bfloat16_encode(float f);
+// Returns the float of the given bfloat16.
+static inline float bfloat16_decode(uint16_t h);
+// Returns the quantized offset of `pos` within [corner, corner + len].
+static inline uint16_t packed_encode(float pos, float corner, float len);
+// Recursively packs the given inner octant and its subtree into the given
+// (allocated) packed octant.
+static int packed_insert(struct particle_tree *tree,
+	struct packed_octant *node, const struct octant *oct);
+// Recursively applies the gravitational force of all particles contained in
+// the given packed inner octant, whose cube has the given corner and width.
+multiversioned static void packed_update_force(
+	const struct particle_tree *tree, const struct packed_octant *node,
+	struct vec3 corner, float len, const struct point_mass *part,
+	struct vec3 *force);
+
+int
+particle_tree_arena_init(struct arena *arena, size_t len)
+{
+	const size_t octants = arena_octants(len);
+	return arena_init(arena, octants * sizeof(struct octant),
+		sizeof(struct octant));
+}
+
+int
+particle_tree_packed_init(struct arena *arena, size_t len)
+{
+	const size_t octants = arena_octants(len);
+	return arena_init(arena, octants * sizeof(struct packed_octant),
+		sizeof(struct packed_octant));
+}
 
 int
 particle_tree_build(struct particle_tree *tree,
-	const struct particle particles[], float radius)
+	const struct particle particles[], size_t len, float radius)
+{
+	int res;
+
+	if (unlikely((res = particle_tree_insert(tree, particles, len, radius))))
+		return res;
+
+	particle_tree_center(tree);
+	return 0;
+}
+
+int
+particle_tree_insert(struct particle_tree *tree,
+	const struct particle particles[], size_t len, float radius)
 {
 	int res;
 
 	if (likely(tree->root != ARENA_NULL))
-		arena_reset(&arena);
+		arena_reset(tree->arena);
 
 	// Initialize the root octant covering the entire galaxy.
-	struct octant_malloc_return_t root = octant_malloc(particles[0].part,
-		-1 * radius, -1 * radius, -1 * radius, 2 * radius);
+	struct octant_malloc_return_t root = octant_malloc(tree->arena,
+		particles[0].part, -1 * radius, -1 * radius, -1 * radius, 2 * radius);
 	if (unlikely((tree->root = root.item) == ARENA_NULL))
 		return ENOMEM;
+#ifdef STATS
+	root_exp = ilogbf(2 * radius);
+#endif // STATS
 
 	// Insert each remaining particle into the tree.
-	for (size_t i = 1; i < options.particles; i++) {
+	for (size_t i = 1; i < len; i++) {
 		const struct point_mass *part = &particles[i].part;
-		if ((res = unlikely(octant_insert(root.octant, part))))
+		if (unlikely((res = octant_insert(tree->arena, root.octant, part))))
 			return res;
 	}
 
-	(void)octant_update_center(root.octant);
 	return 0;
 }
 
+void
+particle_tree_center(struct particle_tree *tree)
+{
+	(void)octant_update_center(tree->arena,
+		arena_get(tree->arena, tree->root));
+}
+
+int
+particle_tree_pack(struct particle_tree *tree)
+{
+	arena_reset(tree->packed);
+
+	const struct octant *root = arena_get(tree->arena, tree->root);
+	if (octant_is_leaf(root))
+		return 0;
+
+	const arena_item_t item
+		= arena_malloc(tree->packed, sizeof(struct packed_octant));
+	if (unlikely(item == ARENA_NULL))
+		return ENOMEM;
+
+	return packed_insert(tree, arena_get(tree->packed, item), root);
+}
+
 float
 particle_tree_simulate(const struct particle_tree *tree,
-	const struct particle_slice *slice)
+	const struct particle_slice *slice, float dt)
 {
-	struct octant *root = arena_get(&arena, tree->root);
-	float max_dist_sq	= 0.0;
-	float dist_sq		= 0.0;
+	float max_dist_sq = 0.0;
+	float dist_sq	  = 0.0;
 
 	for (size_t p = 0; p < slice->len; p++) {
-		struct vec3 force	= zero_vec;
-		struct particle *ap = &slice->from[p];
-		octant_update_force(root, &ap->part, &force);
-
-		// Apply the calculated force to the particle's velocity.
-		vec3_mulassign(&force, options.dt / ap->part.mass);
-		vec3_addassign(&ap->vel, &force);
-		// Apply the calculated velocity the particle's position.
-		struct vec3 vel_dampened = ap->vel;
-		vec3_mulassign(&vel_dampened, options.dt);
-		vec3_addassign(&ap->part.pos, &vel_dampened);
-
-		dist_sq = vec3_dist_sq(&zero_vec, &ap->part.pos);
+		struct particle *ap		= &slice->from[p];
+		const struct vec3 force = particle_tree_force(tree, &ap->part);
+
+		dist_sq = particle_advance(ap, force, dt);
 		if (dist_sq > max_dist_sq)
 			max_dist_sq = dist_sq;
 	}
@@ -178,6 +384,54 @@ particle_tree_simulate(const struct particle_tree *tree,
 	return sqrtf(max_dist_sq);
 }
 
+struct vec3
+particle_tree_force(const struct particle_tree *tree,
+	const struct point_mass *part)
+{
+	const struct octant *root = arena_get(tree->arena, tree->root);
+	struct vec3 force		  = zero_vec;
+
+	// Trees of a single leaf have no packed octants.
+	if (tree->packed != NULL && !octant_is_leaf(root)) {
+		const struct vec3 corner = { root->x, root->y, root->z };
+		packed_update_force(tree, arena_get(tree->packed, 0), corner,
+			root->len, part, &force);
+	} else
+		octant_update_force(tree, root, part, &force);
+
+	return force;
+}
+
+float
+particle_tree_potential(const struct particle_tree *tree,
+	const struct point_mass *part)
+{
+	return octant_potential(tree, arena_get(tree->arena, tree->root), part);
+}
+
+int
+particle_tree_essential(const struct particle_tree *tree,
+	const struct vec3 *lo, const struct vec3 *hi, struct point_mass **parts,
+	size_t *len, size_t *cap)
+{
+	return octant_essential(tree, arena_get(tree->arena, tree->root), lo, hi,
+		parts, len, cap);
+}
+
+float
+particle_advance(struct particle *part, struct vec3 force, float dt)
+{
+	// Apply the calculated force to the particle's velocity.
+	vec3_mulassign(&force, dt / part->part.mass);
+	vec3_addassign(&part->vel, &force);
+	// Apply the calculated velocity the particle's position.
+	struct vec3 vel_dampened = part->vel;
+	vec3_mulassign(&vel_dampened, dt);
+	vec3_addassign(&part->part.pos, &vel_dampened);
+
+	return vec3_dist_sq(&zero_vec, &part->part.pos);
+}
+
 static inline bool
 octant_is_leaf(const struct octant *oct)
 {
@@ -185,13 +439,14 @@ octant_is_leaf(const struct octant *oct)
 }
 
 static inline struct octant_malloc_return_t
-octant_malloc(struct point_mass center, float x, float y, float z, float len)
+octant_malloc(struct arena *arena, struct point_mass center, float x, float y,
+	float z, float len)
 {
-	const arena_item_t item = arena_malloc(&arena, sizeof(struct octant));
+	const arena_item_t item = arena_malloc(arena, sizeof(struct octant));
 	if (unlikely(item == ARENA_NULL))
 		return (struct octant_malloc_return_t) { ARENA_NULL, NULL };
 
-	struct octant *oct = arena_get(&arena, item);
+	struct octant *oct = arena_get(arena, item);
 
 	*oct = (struct octant) {
 		.center = center,
@@ -209,7 +464,8 @@ octant_malloc(struct point_mass center, float x, float y, float z, float len)
 }
 
 static int
-octant_insert(struct octant *oct, const struct point_mass *part)
+octant_insert(struct arena *arena, struct octant *oct,
+	const struct point_mass *part)
 {
 	int res;
 
@@ -221,20 +477,21 @@ octant_insert(struct octant *oct, const struct point_mass *part)
 			return 0;
 		}
 
-		if (unlikely((res = octant_insert_child(oct, &oct->center))))
+		if (unlikely((res = octant_insert_child(arena, oct, &oct->center))))
 			return res;
 	}
 
 	oct->bodies += 1;
 	oct->center.mass += part->mass;
-	if (unlikely((res = octant_insert_child(oct, part))))
+	if (unlikely((res = octant_insert_child(arena, oct, part))))
 		return res;
 
 	return 0;
 }
 
 static int
-octant_insert_child(struct octant *oct, const struct point_mass *part)
+octant_insert_child(struct arena *arena, struct octant *oct,
+	const struct point_mass *part)
 {
 	const float sub_len = oct->len / 2.0;
 
@@ -260,21 +517,28 @@ octant_insert_child(struct octant *oct, const struct point_mass *part)
 	}
 
 	if (oct->children[c] != ARENA_NULL) {
-		struct octant *child = arena_get(&arena, oct->children[c]);
-		return octant_insert(child, part);
+		struct octant *child = arena_get(arena, oct->children[c]);
+		return octant_insert(arena, child, part);
 	}
 
 	struct octant_malloc_return_t child
-		= octant_malloc(*part, x, y, z, sub_len);
+		= octant_malloc(arena, *part, x, y, z, sub_len);
 	if (unlikely(child.item == ARENA_NULL))
 		return ENOMEM;
 	oct->children[c] = child.item;
 
+#ifdef STATS
+	// Octant widths are halved exactly, so the depth is the exponent delta.
+	const unsigned depth = (unsigned)(root_exp - ilogbf(sub_len));
+	if (depth > tree_stats.depth)
+		tree_stats.depth = depth;
+#endif // STATS
+
 	return 0;
 }
 
 static struct vec3
-octant_update_center(struct octant *oct)
+octant_update_center(struct arena *arena, struct octant *oct)
 {
 	struct vec3 new_center;
 	if (octant_is_leaf(oct)) {
@@ -286,8 +550,9 @@ octant_update_center(struct octant *oct)
 	new_center = zero_vec;
 	for (unsigned c = 0; c < OTREE_CHILDREN; c++) {
 		if (oct->children[c] != ARENA_NULL) {
-			struct octant *child = arena_get(&arena, oct->children[c]);
-			const struct vec3 child_center = octant_update_center(child);
+			struct octant *child = arena_get(arena, oct->children[c]);
+			const struct vec3 child_center
+				= octant_update_center(arena, child);
 			vec3_addassign(&new_center, &child_center);
 		}
 	}
@@ -299,11 +564,14 @@ octant_update_center(struct octant *oct)
 }
 
 static void
-octant_update_force(const struct octant *oct, const struct point_mass *part,
-	struct vec3 *force)
+octant_update_force(const struct particle_tree *tree, const struct octant *oct,
+	const struct point_mass *part, struct vec3 *force)
 {
+	STATS_ADD(visits, 1);
+
 	if (octant_is_leaf(oct)) {
 		if (!vec3_eql(&oct->center.pos, &part->pos)) {
+			STATS_ADD(pairs, 1);
 			const struct vec3 gf = gforce(part, &oct->center);
 			vec3_addassign(force, &gf);
 		}
@@ -312,19 +580,215 @@ octant_update_force(const struct octant *oct, const struct point_mass *part,
 	}
 
 	const float radius = vec3_dist(&part->pos, &oct->center.pos);
-	if (oct->len / radius < options.theta) {
+	if (oct->len / radius < tree->theta) {
+		STATS_ADD(accepted, 1);
 		const struct vec3 gf = gforce(part, &oct->center);
 		vec3_addassign(force, &gf);
 	} else {
 		for (unsigned c = 0; c < OTREE_CHILDREN; c++)
 			if (oct->children[c] != ARENA_NULL) {
 				const struct octant *child
-					= arena_get(&arena, oct->children[c]);
-				octant_update_force(child, part, force);
+					= arena_get(tree->arena, oct->children[c]);
+				octant_update_force(tree, child, part, force);
 			}
 	}
 }
 
+static int
+octant_essential(const struct particle_tree *tree, const struct octant *oct,
+	const struct vec3 *lo, const struct vec3 *hi, struct point_mass **parts,
+	size_t *len, size_t *cap)
+{
+	// The distance from the box to the octant's center of mass is a lower
+	// bound of the distance of any particle within the box, so an octant
+	// accepted for the box is accepted by all of its particles.
+	const struct vec3 *com = &oct->center.pos;
+	const float dx		   = fmaxf(fmaxf(lo->x - com->x, com->x - hi->x), 0.0);
+	const float dy		   = fmaxf(fmaxf(lo->y - com->y, com->y - hi->y), 0.0);
+	const float dz		   = fmaxf(fmaxf(lo->z - com->z, com->z - hi->z), 0.0);
+	const float dist	   = sqrtf(sq(dx) + sq(dy) + sq(dz));
+
+	if (octant_is_leaf(oct) || oct->len < tree->theta * dist) {
+		if (unlikely(*len == *cap)) {
+			const size_t new_cap = (*cap > 0) ? 2 * *cap : 1024;
+			struct point_mass *resized
+				= realloc(*parts, sizeof(struct point_mass) * new_cap);
+			if (unlikely(resized == NULL))
+				return ENOMEM;
+
+			*parts = resized;
+			*cap   = new_cap;
+		}
+
+		(*parts)[(*len)++] = oct->center;
+		return 0;
+	}
+
+	int res;
+	for (unsigned c = 0; c < OTREE_CHILDREN; c++)
+		if (oct->children[c] != ARENA_NULL) {
+			const struct octant *child
+				= arena_get(tree->arena, oct->children[c]);
+			if (unlikely((res = octant_essential(tree, child, lo, hi, parts,
+							  len, cap))))
+				return res;
+		}
+
+	return 0;
+}
+
+static float
+octant_potential(const struct particle_tree *tree, const struct octant *oct,
+	const struct point_mass *part)
+{
+	// The same opening criterion as for the forces, so the potential is
+	// consistent with the simulated dynamics.
+	const bool accept = octant_is_leaf(oct)
+		|| oct->len / vec3_dist(&part->pos, &oct->center.pos) < tree->theta;
+	if (accept)
+		return gpotential(part, &oct->center);
+
+	float potential = 0.0;
+	for (unsigned c = 0; c < OTREE_CHILDREN; c++)
+		if (oct->children[c] != ARENA_NULL)
+			potential += octant_potential(tree,
+				arena_get(tree->arena, oct->children[c]), part);
+
+	return potential;
+}
+
+static int
+packed_insert(struct particle_tree *tree, struct packed_octant *node,
+	const struct octant *oct)
+{
+	struct arena *packed = tree->packed;
+	int res;
+
+	node->pos[0]   = packed_encode(oct->center.pos.x, oct->x, oct->len);
+	node->pos[1]   = packed_encode(oct->center.pos.y, oct->y, oct->len);
+	node->pos[2]   = packed_encode(oct->center.pos.z, oct->z, oct->len);
+	node->mass	   = bfloat16_encode(oct->center.mass);
+	node->first	   = packed->curr;
+	node->children = 0;
+	node->leaves   = 0;
+
+	// All children are allocated before any of their subtrees.
+	for (unsigned c = 0; c < OTREE_CHILDREN; c++)
+		if (oct->children[c] != ARENA_NULL) {
+			if (unlikely(arena_malloc(packed, sizeof(struct packed_octant))
+					== ARENA_NULL))
+				return ENOMEM;
+			node->children |= 1u << c;
+		}
+
+	arena_item_t item = node->first;
+	for (unsigned c = 0; c < OTREE_CHILDREN; c++) {
+		if (oct->children[c] == ARENA_NULL)
+			continue;
+
+		const struct octant *child_oct = arena_get(tree->arena,
+			oct->children[c]);
+		struct packed_octant *child = arena_get(packed, item++);
+		if (octant_is_leaf(child_oct)) {
+			child->leaf = child_oct->center;
+			node->leaves |= 1u << c;
+		} else if (unlikely((res = packed_insert(tree, child, child_oct))))
+			return res;
+	}
+
+	return 0;
+}
+
+static void
+packed_update_force(const struct particle_tree *tree,
+	const struct packed_octant *node, struct vec3 corner, float len,
+	const struct point_mass *part, struct vec3 *force)
+{
+	STATS_ADD(visits, 1);
+
+	const float scale			   = len / PACKED_POS_MAX;
+	const struct point_mass center = {
+		.pos  = { corner.x + node->pos[0] * scale,
+			 corner.y + node->pos[1] * scale,
+			 corner.z + node->pos[2] * scale },
+		.mass = bfloat16_decode(node->mass),
+	};
+
+	const float radius = vec3_dist(&part->pos, &center.pos);
+	if (len / radius < tree->theta) {
+		STATS_ADD(accepted, 1);
+		const struct vec3 gf = gforce(part, &center);
+		vec3_addassign(force, &gf);
+		return;
+	}
+
+	// The children's cubes are derived like those of `octant_insert_child`.
+	const float sub_len				 = len / 2.0;
+	const struct packed_octant *child = arena_get(tree->packed, node->first);
+	for (unsigned c = 0; c < OTREE_CHILDREN; c++) {
+		const unsigned bit = 1u << c;
+		if (!(node->children & bit))
+			continue;
+
+		if (node->leaves & bit) {
+			STATS_ADD(visits, 1);
+			if (!vec3_eql(&child->leaf.pos, &part->pos)) {
+				STATS_ADD(pairs, 1);
+				const struct vec3 gf = gforce(part, &child->leaf);
+				vec3_addassign(force, &gf);
+			}
+		} else {
+			const struct vec3 sub = {
+				(c & 1) ? corner.x + sub_len : corner.x,
+				(c & 2) ? corner.y + sub_len : corner.y,
+				(c & (OTREE_CHILDREN / 2)) ? corner.z + sub_len : corner.z,
+			};
+			packed_update_force(tree, child, sub, sub_len, part, force);
+		}
+		child++;
+	}
+}
+
+static inline size_t
+arena_octants(size_t len)
+{
+	// Beyond the indices, `arena_init` fails with EOVERFLOW.
+	const size_t max = (size_t)ARENA_NULL - 1;
+	if (len > max / OTREE_ARENA_MIN_FACTOR)
+		return len * OTREE_ARENA_MIN_FACTOR;
+
+	const size_t octants
+		= (len > max / OTREE_ARENA_FACTOR) ? max : len * OTREE_ARENA_FACTOR;
+	return (octants > OTREE_ARENA_MIN) ? octants : OTREE_ARENA_MIN;
+}
+
+static inline uint16_t
+bfloat16_encode(float f)
+{
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(bits));
+	// Round to the nearest, ties to even.
+	bits += 0x7fff + ((bits >> 16) & 1);
+	return (uint16_t)(bits >> 16);
+}
+
+static inline float
+bfloat16_decode(uint16_t h)
+{
+	const uint32_t bits = (uint32_t)h << 16;
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+static inline uint16_t
+packed_encode(float pos, float corner, float len)
+{
+	// Centers of mass can only leave their cube by rounding errors.
+	const float q = roundf((pos - corner) / len * PACKED_POS_MAX);
+	return (uint16_t)fminf(fmaxf(q, 0.0), PACKED_POS_MAX);
+}
+
 static inline void
 vec3_addassign(struct vec3 *v, const struct vec3 *u)
 {
@@ -386,6 +850,42 @@ morton_number(unsigned x, unsigned y, unsigned z)
 	return res;
 }
 
+static inline uint64_t
+hilbert_number(unsigned x, unsigned y, unsigned z)
+{
+	// Skilling's transform ("Programming the Hilbert curve", 2004) of the
+	// coordinates into the transposed index, whose bits are those of the
+	// index when interleaved.
+	static const unsigned top = 1u << 20;
+	unsigned v[3]			  = { x, y, z };
+
+	// Undo the excess work of the inverse transform.
+	for (unsigned q = top; q > 1; q >>= 1) {
+		const unsigned p = q - 1;
+		for (unsigned i = 0; i < 3; i++)
+			if (v[i] & q)
+				v[0] ^= p;
+			else {
+				const unsigned t = (v[0] ^ v[i]) & p;
+				v[0] ^= t;
+				v[i] ^= t;
+			}
+	}
+
+	// Gray encode.
+	v[1] ^= v[0];
+	v[2] ^= v[1];
+	unsigned t = 0;
+	for (unsigned q = top; q > 1; q >>= 1)
+		if (v[2] & q)
+			t ^= q - 1;
+	for (unsigned i = 0; i < 3; i++)
+		v[i] ^= t;
+
+	// The first coordinate holds the most significant bit of each triple.
+	return morton_number(v[2], v[1], v[0]);
+}
+
 static inline int
 sort_by_z_curve(const struct particle *p0, const struct particle *p1)
 {
@@ -406,21 +906,37 @@ sort_by_z_curve(const struct particle *p0, const struct particle *p1)
 	return 0;
 }
 
-static struct vec3
-gforce(const struct point_mass *p0, const struct point_mass *p1)
+static inline int
+sort_by_key(const struct keyed_particle *p0, const struct keyed_particle *p1)
+{
+	return (p0->key > p1->key) - (p0->key < p1->key);
+}
+
+static forceinline float
+gpotential(const struct point_mass *p0, const struct point_mass *p1)
 {
-	static const float G		= 6.6726e-11;
-	static const float min_dist = 2.0;
+	if (unlikely(vec3_eql(&p0->pos, &p1->pos)))
+		return 0.0;
 
+	float dist = vec3_dist(&p0->pos, &p1->pos);
+	if (dist < PHYS_MIN_DIST)
+		dist = PHYS_MIN_DIST;
+
+	return -PHYS_G * p0->mass * p1->mass / dist;
+}
+
+static forceinline struct vec3
+gforce(const struct point_mass *p0, const struct point_mass *p1)
+{
 	if (unlikely(vec3_eql(&p0->pos, &p1->pos)))
 		return zero_vec;
 
 	float dist = vec3_dist(&p0->pos, &p1->pos);
-	if (dist < min_dist)
-		dist = min_dist;
+	if (dist < PHYS_MIN_DIST)
+		dist = PHYS_MIN_DIST;
 
 	const float qd = dist * dist * dist;
-	const float gm = G * p0->mass * p1->mass;
+	const float gm = PHYS_G * p0->mass * p1->mass;
 
 	struct vec3 result = p1->pos;
 	vec3_subassign(&result, &p0->pos);
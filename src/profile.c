@@ -0,0 +1,260 @@
+// Required for `syscall`.
+#define _GNU_SOURCE
+
+#include "barnes-hut/profile.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "barnes-hut/options.h"
+
+bool profile_enabled				   = false;
+struct profile_thread *profile_threads = NULL;
+
+static const char *phase_names[PHASES] = {
+	[PHASE_SORT]		= "sort",
+	[PHASE_INSERT]		= "insert",
+	[PHASE_CENTER]		= "center",
+	[PHASE_FORCE]		= "force",
+	[PHASE_DIAGNOSTICS] = "diagnostics",
+	[PHASE_COPY]		= "copy",
+	[PHASE_WAIT]		= "wait",
+	[PHASE_SYNC]		= "sync",
+	[PHASE_OUTPUT]		= "output",
+};
+
+// The perf event configuration for read misses of the given cache.
+#define CACHE_READ_MISSES(cache)                                               \
+	(PERF_COUNT_HW_CACHE_##cache | (PERF_COUNT_HW_CACHE_OP_READ << 8)          \
+		| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+// The perf event configurations of all counters.
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} events[COUNTERS] = {
+	[COUNTER_CYCLES]	   = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[COUNTER_INSTRUCTIONS] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	[COUNTER_LLC_MISSES]   = { PERF_TYPE_HW_CACHE, CACHE_READ_MISSES(LL) },
+	[COUNTER_DTLB_MISSES]  = { PERF_TYPE_HW_CACHE, CACHE_READ_MISSES(DTLB) },
+};
+
+// The global profiler state.
+static struct {
+	FILE *file;
+	unsigned threads;
+	bool counters;
+	// The next step to write.
+	unsigned next;
+} profile = { NULL, 0, false, 0 };
+
+static inline uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Reads the current values of all counters of the given group.
+static inline void
+read_counters(int fd, uint64_t counts[COUNTERS])
+{
+	// The group read format: the number of events followed by their values.
+	uint64_t values[1 + COUNTERS];
+
+	if (fd < 0 || read(fd, values, sizeof(values)) != sizeof(values)) {
+		memset(counts, 0, sizeof(uint64_t) * COUNTERS);
+		return;
+	}
+	memcpy(counts, &values[1], sizeof(uint64_t) * COUNTERS);
+}
+
+int
+profile_init(const char *path, bool counters, unsigned threads,
+	unsigned first_step)
+{
+	if ((profile.file = fopen(path, "w")) == NULL)
+		return errno;
+
+	profile_threads = aligned_alloc(64,
+		sizeof(struct profile_thread) * threads);
+	if (unlikely(profile_threads == NULL)) {
+		fclose(profile.file);
+		return ENOMEM;
+	}
+
+	for (unsigned t = 0; t < threads; t++) {
+		struct profile_thread *thread = &profile_threads[t];
+		memset(thread, 0, sizeof(*thread));
+		thread->fd	   = -1;
+		thread->phase  = PHASES;
+		thread->record = &thread->records[0];
+	}
+
+	profile.threads	 = threads;
+	profile.counters = counters;
+	profile.next	 = first_step;
+
+	fprintf(profile.file, "step,thread,phase,us%s\n",
+		counters ? ",cycles,instructions,llc_misses,dtlb_misses" : "");
+
+	profile_enabled = true;
+	return 0;
+}
+
+void
+profile_deinit(void)
+{
+	if (profile.file == NULL)
+		return;
+
+	// Write all steps not yet written, the last of which may be incomplete
+	// if the simulation was aborted.
+	for (unsigned t = 0; t < profile.threads; t++)
+		profile_switch(&profile_threads[t], PHASES);
+	while (true) {
+		bool any = false;
+		for (unsigned t = 0; t < profile.threads; t++)
+			for (unsigned r = 0; r < PROFILE_RECORDS; r++) {
+				const struct profile_record *record
+					= &profile_threads[t].records[r];
+				any |= record->valid && record->step == profile.next;
+			}
+		if (!any)
+			break;
+		profile_flush(profile.next);
+	}
+
+	for (unsigned t = 0; t < profile.threads; t++)
+		if (profile_threads[t].fd >= 0)
+			close(profile_threads[t].fd);
+
+	if (fclose(profile.file))
+		fprintf(stderr, "Failed to close phase profile: %s\n", strerror(errno));
+	profile.file	= NULL;
+	profile_enabled = false;
+
+	free(profile_threads);
+	profile_threads = NULL;
+}
+
+void
+profile_thread_init(unsigned id)
+{
+	struct profile_thread *thread = &profile_threads[id];
+	if (!profile_enabled || !profile.counters)
+		return;
+
+	int fds[COUNTERS];
+	for (unsigned c = 0; c < COUNTERS; c++) {
+		struct perf_event_attr attr = {
+			.type		 = events[c].type,
+			.size		 = sizeof(attr),
+			.config		 = events[c].config,
+			.read_format = PERF_FORMAT_GROUP,
+			.disabled	 = (c == 0),
+			// Counting user space only works with `perf_event_paranoid` 2.
+			.exclude_kernel = 1,
+			.exclude_hv		= 1,
+		};
+
+		// Count the calling thread on any CPU.
+		fds[c] = (int)syscall(SYS_perf_event_open, &attr, 0, -1,
+			(c == 0) ? -1 : fds[0], 0);
+		if (fds[c] < 0) {
+			fprintf(stderr, "Failed to open counters of thread %u: %s\n", id,
+				strerror(errno));
+			while (c-- > 0)
+				close(fds[c]);
+			return;
+		}
+	}
+
+	ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	thread->fd = fds[0];
+}
+
+void
+profile_flush(unsigned step)
+{
+	for (unsigned t = 0; t < profile.threads; t++) {
+		struct profile_thread *thread = &profile_threads[t];
+
+		struct profile_record *record = NULL;
+		for (unsigned r = 0; r < PROFILE_RECORDS; r++)
+			if (thread->records[r].valid && thread->records[r].step == step)
+				record = &thread->records[r];
+		if (record == NULL)
+			continue;
+
+		for (unsigned p = 0; p < PHASES; p++) {
+			// Phases a thread never entered are left out.
+			if (record->ns[p] == 0)
+				continue;
+
+			fprintf(profile.file, "%u,%u,%s,%.3f", step, t, phase_names[p],
+				(double)record->ns[p] * 1e-3);
+			if (profile.counters)
+				for (unsigned c = 0; c < COUNTERS; c++)
+					fprintf(profile.file, ",%lu",
+						(unsigned long)record->counts[p][c]);
+			fputc('\n', profile.file);
+		}
+	}
+
+	profile.next = step + 1;
+}
+
+const char *
+profile_phase_name(enum phase phase)
+{
+	return phase_names[phase];
+}
+
+void
+profile_switch(struct profile_thread *thread, enum phase phase)
+{
+	const uint64_t ns = now_ns();
+	uint64_t counts[COUNTERS];
+	if (thread->fd >= 0)
+		read_counters(thread->fd, counts);
+
+	if (thread->phase != PHASES) {
+		struct profile_record *record = thread->record;
+		record->ns[thread->phase] += ns - thread->start_ns;
+		if (thread->fd >= 0)
+			for (unsigned c = 0; c < COUNTERS; c++)
+				record->counts[thread->phase][c]
+					+= counts[c] - thread->start_counts[c];
+	}
+
+	thread->phase	 = phase;
+	thread->start_ns = ns;
+	if (thread->fd >= 0)
+		memcpy(thread->start_counts, counts, sizeof(counts));
+}
+
+void
+profile_begin_step(struct profile_thread *thread, unsigned step)
+{
+	// Account the current phase to the previous step.
+	profile_switch(thread, PHASES);
+
+	struct profile_record *record = &thread->records[step % PROFILE_RECORDS];
+	memset(record, 0, sizeof(*record));
+	record->step   = step;
+	record->valid  = true;
+	thread->record = record;
+}
@@ -1,25 +1,260 @@
+#define GL_GLEXT_PROTOTYPES
+
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
 
 #include <GL/gl.h>
+#include <GL/glext.h>
 #include <GL/glu.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_opengl.h>
 
+#include "barnes-hut/arena.h"
 #include "barnes-hut/common.h"
 #include "barnes-hut/options.h"
 #include "barnes-hut/phys.h"
+#include "barnes-hut/render.h"
 
 static const unsigned width	 = 1280;
 static const unsigned height = 960;
 
+// The number of buffer regions cycled through for uploading positions.
+#define REGIONS 3
+
+// The number of frame buffers exchanged between simulation and render thread.
+#define FRAMES 3
+// The flag marking the shared frame as not yet consumed by the render thread.
+#define FRESH 0x4
+
 static SDL_Window *window	  = NULL;
 static SDL_GLContext *context = NULL;
 
+// A point sprite standing for `weight` particles at the given position.
+struct sprite {
+	struct vec3 pos;
+	float weight;
+};
+
+// A snapshot of all particle sprites of a completed simulation step.
+struct frame {
+	struct sprite *sprites;
+	size_t len;
+	float radius;
+};
+
+// The triple buffer of frames and the render thread's state.
+//
+// The simulation thread exclusively owns the `back` frame and the render
+// thread exclusively owns the `front` frame. The third frame is shared and
+// exchanged atomically by either side, its index is tagged `FRESH` when it
+// holds a frame the render thread has not yet seen. Neither side ever waits
+// for the other, the render thread simply draws the latest frame available
+// and the simulation overwrites frames the display was too slow to show.
+static struct {
+	struct frame frames[FRAMES];
+	unsigned back;
+	unsigned front;
+	atomic_uint shared;
+	// Set by the render thread when the window is closed.
+	atomic_bool quit;
+	// Set by the simulation thread to stop the render thread.
+	atomic_bool stop;
+	pthread_t thread;
+	// The render thread's initialization handshake.
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool init_done;
+	int init_res;
+} renderer;
+
+// The GPU-side particle state.
+static struct {
+	// The shader program computing the colour gradient.
+	GLuint program;
+	// The location of the program's `radius` uniform.
+	GLint radius;
+	// The location of the program's `lod` uniform.
+	GLint lod;
+	// The vertex buffer holding `REGIONS` regions of all sprites.
+	GLuint vbo;
+	// The persistently mapped vertex buffer (NULL, if not supported).
+	struct sprite *mapped;
+	// The fences guarding each region against being overwritten while the
+	// GPU may still read from it.
+	GLsync fences[REGIONS];
+	// The region to upload the next frame's positions into.
+	unsigned region;
+} gpu;
+
+static const char *vertex_shader
+	= "#version 120\n"
+	  "attribute vec3 position;\n"
+	  "attribute float weight;\n"
+	  "uniform float radius;\n"
+	  "uniform float lod;\n"
+	  "varying vec3 color;\n"
+	  "void main() {\n"
+	  "	color = (position + radius) / (2.0 * radius);\n"
+	  "	gl_PointSize = clamp(1.25 * sqrt(weight), 1.25, max(lod, 1.25));\n"
+	  "	gl_Position = gl_ModelViewProjectionMatrix * vec4(position, 1.0);\n"
+	  "}\n";
+
+static const char *fragment_shader = "#version 120\n"
+									 "varying vec3 color;\n"
+									 "void main() {\n"
+									 "	gl_FragColor = vec4(color, 1.0);\n"
+									 "}\n";
+
+static void *render_main(void *args);
+static int window_init(void);
+static void window_deinit(void);
+static void draw_frame(const struct frame *frame);
+static int gpu_init(void);
+static void gpu_deinit(void);
+static GLuint compile_shader(GLenum type, const char *src);
+static struct sprite *upload_begin(GLintptr *offset);
+static void upload_end(void);
 static void render_axes(float radius);
-static void render_point(const struct vec3 *v, float radius);
+static void lod_collect(struct arena *arena, const struct octant *oct,
+	float limit, struct frame *frame);
 
 int
 render_init(void)
+{
+	// Each leaf of a tree holds at least one particle, so no frame ever has
+	// more sprites than particles.
+	const size_t size = sizeof(struct sprite) * options.particles;
+	int res;
+
+	for (unsigned f = 0; f < FRAMES; f++) {
+		renderer.frames[f] = (struct frame) { .len = 0 };
+		if ((renderer.frames[f].sprites = malloc(size)) == NULL) {
+			res = ENOMEM;
+			goto error;
+		}
+	}
+
+	renderer.back  = 0;
+	renderer.front = 1;
+	atomic_init(&renderer.shared, 2);
+	atomic_init(&renderer.quit, false);
+	atomic_init(&renderer.stop, false);
+	renderer.init_done = false;
+
+	pthread_mutex_init(&renderer.lock, NULL);
+	pthread_cond_init(&renderer.cond, NULL);
+
+	if ((res = pthread_create(&renderer.thread, NULL, render_main, NULL)))
+		goto error;
+
+	// The window and GL context are created by the render thread itself.
+	pthread_mutex_lock(&renderer.lock);
+	while (!renderer.init_done)
+		pthread_cond_wait(&renderer.cond, &renderer.lock);
+	res = renderer.init_res;
+	pthread_mutex_unlock(&renderer.lock);
+
+	if (res) {
+		pthread_join(renderer.thread, NULL);
+		goto error;
+	}
+
+	return 0;
+
+error:
+	for (unsigned f = 0; f < FRAMES; f++)
+		free(renderer.frames[f].sprites);
+	return (res == ENOMEM) ? ENOMEM : BHE_RENDER_ERROR;
+}
+
+void
+render_deinit(void)
+{
+	atomic_store_explicit(&renderer.stop, true, memory_order_release);
+	pthread_join(renderer.thread, NULL);
+
+	pthread_cond_destroy(&renderer.cond);
+	pthread_mutex_destroy(&renderer.lock);
+
+	for (unsigned f = 0; f < FRAMES; f++)
+		free(renderer.frames[f].sprites);
+}
+
+bool
+render_publish(const struct particle particles[],
+	const struct particle_tree *tree, float radius)
+{
+	struct frame *frame = &renderer.frames[renderer.back];
+	frame->len			= 0;
+	frame->radius		= radius;
+
+	if (options.lod > 0.0 && tree->root != ARENA_NULL)
+		// Nodes smaller than `lod` pixels on screen are drawn as single
+		// sprites, since the camera is orthographic this does not depend on
+		// a node's distance to the camera.
+		lod_collect(tree->arena, arena_get(tree->arena, tree->root),
+			options.lod * radius / (0.5f * (float)width), frame);
+	else
+		for (size_t p = 0; p < options.particles; p++)
+			frame->sprites[frame->len++]
+				= (struct sprite) { particles[p].part.pos, 1.0f };
+
+	// Publish the frame and take over the previously shared one, which is
+	// either stale or has already been replaced by the render thread.
+	const unsigned prev = atomic_exchange_explicit(&renderer.shared,
+		renderer.back | FRESH, memory_order_acq_rel);
+	renderer.back = prev & ~FRESH;
+
+	return atomic_load_explicit(&renderer.quit, memory_order_acquire);
+}
+
+static void *
+render_main(void *args)
+{
+	const int res = window_init();
+
+	pthread_mutex_lock(&renderer.lock);
+	renderer.init_res  = res;
+	renderer.init_done = true;
+	pthread_cond_signal(&renderer.cond);
+	pthread_mutex_unlock(&renderer.lock);
+
+	if (res)
+		return NULL;
+
+	while (!atomic_load_explicit(&renderer.stop, memory_order_acquire)) {
+		SDL_Event event;
+		while (SDL_PollEvent(&event))
+			if (event.type == SDL_QUIT)
+				atomic_store_explicit(&renderer.quit, true,
+					memory_order_release);
+
+		// Only redraw if the simulation has published a new frame since.
+		if (!(atomic_load_explicit(&renderer.shared, memory_order_acquire)
+				& FRESH)) {
+			SDL_Delay(1);
+			continue;
+		}
+
+		const unsigned prev = atomic_exchange_explicit(&renderer.shared,
+			renderer.front, memory_order_acq_rel);
+		renderer.front = prev & ~FRESH;
+
+		draw_frame(&renderer.frames[renderer.front]);
+	}
+
+	window_deinit();
+	return NULL;
+}
+
+static int
+window_init(void)
 {
 	SDL_SetHint(SDL_HINT_NO_SIGNAL_HANDLERS, "1");
 	SDL_SetHint(SDL_HINT_VIDEODRIVER, "wayland");
@@ -27,6 +262,10 @@ render_init(void)
 	if (SDL_Init(SDL_INIT_VIDEO) < 0)
 		goto error;
 
+	// A compatibility context is required for the fixed-function camera.
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK,
+		SDL_GL_CONTEXT_PROFILE_COMPATIBILITY);
+
 	window = SDL_CreateWindow("barnes-hut", SDL_WINDOWPOS_UNDEFINED,
 		SDL_WINDOWPOS_UNDEFINED, width, height,
 		SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN);
@@ -40,50 +279,228 @@ render_init(void)
 	glViewport(0, 0, width, height);
 
 	glEnable(GL_DEPTH_TEST);
-	glPointSize(1.25);
+	// The point size is computed per sprite by the vertex shader.
+	glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
+
+	if (gpu_init())
+		goto deinit_context;
 
 	render_axes(options.radius);
 
 	SDL_GL_SwapWindow(window);
+	SDL_GL_SetSwapInterval(1);
 	return 0;
 
+deinit_context:
+	SDL_GL_DeleteContext(context);
 deinit_window:
 	SDL_DestroyWindow(window);
 deinit_sdl:
 	SDL_Quit();
 error:
+	fprintf(stderr, "Failed to initialize rendering: %s\n", SDL_GetError());
 	return BHE_RENDER_ERROR;
 }
 
-void
-render_deinit(void)
+static void
+window_deinit(void)
 {
+	gpu_deinit();
 	SDL_GL_DeleteContext(context);
 	SDL_DestroyWindow(window);
 	SDL_Quit();
 }
 
-bool
-render_scene(const struct particle particles[], float radius)
+static void
+draw_frame(const struct frame *frame)
 {
-	SDL_Event event;
-	while (SDL_PollEvent(&event))
-		if (event.type == SDL_QUIT)
-			return true;
+	const float radius = frame->radius;
 
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	glLoadIdentity();
 
 	render_axes(radius);
 
-	glBegin(GL_POINTS);
-	for (size_t p = 0; p < options.particles; p++)
-		render_point(&particles[p].part.pos, radius);
-	glEnd();
+	// Copy all sprites into the vertex buffer, the colour gradient and the
+	// sprite sizes are computed by the vertex shader.
+	GLintptr offset;
+	struct sprite *sprites = upload_begin(&offset);
+	if (sprites == NULL) {
+		// The previous frame stays on screen.
+		verbose_printf("Failed to map the vertex buffer, skipping frame\n");
+		return;
+	}
+	memcpy(sprites, frame->sprites, sizeof(struct sprite) * frame->len);
+	upload_end();
+
+	glUseProgram(gpu.program);
+	glUniform1f(gpu.radius, radius);
+	glUniform1f(gpu.lod, options.lod);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(struct sprite),
+		(const void *)(offset + offsetof(struct sprite, pos)));
+	glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(struct sprite),
+		(const void *)(offset + offsetof(struct sprite, weight)));
+	glDrawArrays(GL_POINTS, 0, frame->len);
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(0);
+	glUseProgram(0);
+
+	if (gpu.mapped) {
+		const unsigned r = (gpu.region + REGIONS - 1) % REGIONS;
+		gpu.fences[r]	 = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
 
 	SDL_GL_SwapWindow(window);
+}
+
+static int
+gpu_init(void)
+{
+	const GLsizeiptr size = sizeof(struct sprite) * options.particles;
+
+	const GLuint vs = compile_shader(GL_VERTEX_SHADER, vertex_shader);
+	const GLuint fs = compile_shader(GL_FRAGMENT_SHADER, fragment_shader);
+	if (vs == 0 || fs == 0)
+		return BHE_RENDER_ERROR;
+
+	gpu.program = glCreateProgram();
+	glAttachShader(gpu.program, vs);
+	glAttachShader(gpu.program, fs);
+	glBindAttribLocation(gpu.program, 0, "position");
+	glBindAttribLocation(gpu.program, 1, "weight");
+	glLinkProgram(gpu.program);
+	glDeleteShader(vs);
+	glDeleteShader(fs);
+
+	GLint status;
+	glGetProgramiv(gpu.program, GL_LINK_STATUS, &status);
+	if (!status) {
+		char log[1024];
+		glGetProgramInfoLog(gpu.program, sizeof(log), NULL, log);
+		fprintf(stderr, "Failed to link shader program: %s\n", log);
+		glDeleteProgram(gpu.program);
+		return BHE_RENDER_ERROR;
+	}
+
+	gpu.radius = glGetUniformLocation(gpu.program, "radius");
+	gpu.lod	   = glGetUniformLocation(gpu.program, "lod");
+
+	glGenBuffers(1, &gpu.vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, gpu.vbo);
+
+	// Prefer an immutable, persistently and coherently mapped buffer (core in
+	// GL 4.4, supported by Mesa's llvmpipe), which is mapped exactly once.
+	GLint major = 0, minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	const bool has_storage = major > 4 || (major == 4 && minor >= 4)
+		|| SDL_GL_ExtensionSupported("GL_ARB_buffer_storage");
+
+	gpu.mapped = NULL;
+	gpu.region = 0;
+	memset(gpu.fences, 0, sizeof(gpu.fences));
+
+	if (has_storage) {
+		const GLbitfield flags
+			= GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_ARRAY_BUFFER, REGIONS * size, NULL, flags);
+		gpu.mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, REGIONS * size, flags);
+	}
 
-	return false;
+	if (gpu.mapped == NULL) {
+		verbose_printf("persistent buffer mapping unavailable, falling back "
+					   "to buffer re-specification\n");
+		// Buffer storage is immutable, so a fresh buffer object is required.
+		if (has_storage) {
+			glDeleteBuffers(1, &gpu.vbo);
+			glGenBuffers(1, &gpu.vbo);
+			glBindBuffer(GL_ARRAY_BUFFER, gpu.vbo);
+		}
+		glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+	}
+
+	return 0;
+}
+
+static void
+gpu_deinit(void)
+{
+	for (unsigned r = 0; r < REGIONS; r++)
+		if (gpu.fences[r])
+			glDeleteSync(gpu.fences[r]);
+
+	glBindBuffer(GL_ARRAY_BUFFER, gpu.vbo);
+	if (gpu.mapped)
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glDeleteBuffers(1, &gpu.vbo);
+	glDeleteProgram(gpu.program);
+}
+
+static GLuint
+compile_shader(GLenum type, const char *src)
+{
+	const GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 1, &src, NULL);
+	glCompileShader(shader);
+
+	GLint status;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if (!status) {
+		char log[1024];
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		fprintf(stderr, "Failed to compile shader: %s\n", log);
+		glDeleteShader(shader);
+		return 0;
+	}
+
+	return shader;
+}
+
+// Returns the memory to write the next frame's sprites into and the
+// corresponding offset within the vertex buffer, or NULL if the re-specified
+// buffer cannot be mapped (then `upload_end` must not be called).
+static struct sprite *
+upload_begin(GLintptr *offset)
+{
+	glBindBuffer(GL_ARRAY_BUFFER, gpu.vbo);
+
+	if (gpu.mapped == NULL) {
+		// Orphan the previous contents, so the driver does not have to wait
+		// for pending draws reading from them.
+		const GLsizeiptr size = sizeof(struct sprite) * options.particles;
+		glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+		*offset = 0;
+		return glMapBufferRange(GL_ARRAY_BUFFER, 0, size,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	}
+
+	// Wait until the GPU has finished drawing from the region (from
+	// `REGIONS` frames ago), which normally has long happened.
+	const unsigned r = gpu.region;
+	if (gpu.fences[r]) {
+		while (glClientWaitSync(gpu.fences[r], GL_SYNC_FLUSH_COMMANDS_BIT,
+				   1000000000)
+			== GL_TIMEOUT_EXPIRED)
+			;
+		glDeleteSync(gpu.fences[r]);
+		gpu.fences[r] = 0;
+	}
+
+	*offset = (GLintptr)r * options.particles * sizeof(struct sprite);
+	return &gpu.mapped[(size_t)r * options.particles];
+}
+
+static void
+upload_end(void)
+{
+	if (gpu.mapped == NULL)
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+	else
+		gpu.region = (gpu.region + 1) % REGIONS;
 }
 
 static void
@@ -121,14 +538,23 @@ render_axes(float radius)
 	glEnd();
 }
 
+// Appends a sprite for each leaf or each octant narrower than `limit` (in
+// world units), whichever is reached first when descending from `oct`.
+//
+// The sprites are placed at the octants' centers of mass as computed by the
+// latest tree build, i.e., lag behind the particle positions by one step.
 static void
-render_point(const struct vec3 *v, float radius)
+lod_collect(struct arena *arena, const struct octant *oct, float limit,
+	struct frame *frame)
 {
-	const float d	  = 2 * radius;
-	const float red	  = (v->x + radius) / d;
-	const float green = (v->y + radius) / d;
-	const float blue  = (v->z + radius) / d;
+	if (oct->bodies == 1 || oct->len < limit) {
+		frame->sprites[frame->len++]
+			= (struct sprite) { oct->center.pos, (float)oct->bodies };
+		return;
+	}
 
-	glColor3f(red, green, blue);
-	glVertex3f(v->x, v->y, v->z);
+	for (unsigned c = 0; c < OTREE_CHILDREN; c++)
+		if (oct->children[c] != ARENA_NULL)
+			lod_collect(arena, arena_get(arena, oct->children[c]), limit,
+				frame);
 }
@@ -0,0 +1,128 @@
+#define _XOPEN_SOURCE 700
+
+#include "barnes-hut/shm.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "barnes-hut/options.h"
+
+// The simulation's mapping of the shared memory object.
+static struct {
+	const char *name;
+	void *addr;
+	size_t len;
+	struct shm_feed_header *header;
+	// The number of the latest written frame.
+	uint64_t frame;
+} feed = { NULL, NULL, 0, NULL, 0 };
+
+static inline struct shm_feed_slot *
+feed_slot(uint64_t frame)
+{
+	const size_t slot = frame % feed.header->slots;
+	return (struct shm_feed_slot *)((char *)feed.addr + feed.header->offset
+		+ slot * feed.header->slot_size);
+}
+
+int
+shm_feed_init(const char *name)
+{
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	int res;
+
+	const size_t slot_size = sizeof(struct shm_feed_slot)
+		+ sizeof(struct vec3) * options.particles;
+	const size_t slot_pages = (slot_size + page - 1) / page;
+	const size_t len		= page + SHM_FEED_SLOTS * slot_pages * page;
+
+	// Replace a stale object (e.g., of a crashed run) instead of truncating
+	// it, which would fault readers still mapping it.
+	(void)shm_unlink(name);
+	const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		return errno;
+
+	if (ftruncate(fd, len)) {
+		res = errno;
+		close(fd);
+		shm_unlink(name);
+		return res;
+	}
+
+	void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	res		   = errno;
+	close(fd);
+	if (addr == MAP_FAILED) {
+		shm_unlink(name);
+		return res;
+	}
+
+	feed.name	= name;
+	feed.addr	= addr;
+	feed.len	= len;
+	feed.header = addr;
+	feed.frame	= 0;
+
+	// The object is freshly created, so all slots are zero (never written).
+	struct shm_feed_header *header = feed.header;
+	header->version				   = SHM_FEED_VERSION;
+	header->slots				   = SHM_FEED_SLOTS;
+	header->particles			   = options.particles;
+	header->slot_size			   = slot_pages * page;
+	header->offset				   = page;
+	atomic_store_explicit(&header->latest, 0, memory_order_relaxed);
+	// Readers check the magic before any other field, so it is written last.
+	atomic_thread_fence(memory_order_release);
+	memcpy(header->magic, SHM_FEED_MAGIC, sizeof(SHM_FEED_MAGIC));
+
+	return 0;
+}
+
+void
+shm_feed_deinit(void)
+{
+	if (feed.addr == NULL)
+		return;
+
+	if (munmap(feed.addr, feed.len))
+		fprintf(stderr, "Failed to unmap shared memory feed: %s\n",
+			strerror(errno));
+	if (shm_unlink(feed.name))
+		fprintf(stderr, "Failed to unlink shared memory feed %s: %s\n",
+			feed.name, strerror(errno));
+
+	verbose_printf("published %lu frames to %s\n", (unsigned long)feed.frame,
+		feed.name);
+	feed.addr = NULL;
+}
+
+void
+shm_feed_publish(const struct particle particles[], unsigned step,
+	float radius)
+{
+	const uint64_t frame	   = ++feed.frame;
+	struct shm_feed_slot *slot = feed_slot(frame);
+
+	atomic_store_explicit(&slot->seq, 2 * frame - 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	slot->step	 = step;
+	slot->radius = radius;
+	slot->len	 = options.particles;
+
+	struct vec3 *positions = (struct vec3 *)(slot + 1);
+	for (size_t p = 0; p < options.particles; p++)
+		positions[p] = particles[p].part.pos;
+
+	atomic_store_explicit(&slot->seq, 2 * frame, memory_order_release);
+	atomic_store_explicit(&feed.header->latest, frame, memory_order_release);
+}
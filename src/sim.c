@@ -0,0 +1,113 @@
+#define _XOPEN_SOURCE 700
+
+#include "barnes-hut/sim.h"
+
+#include <stdbool.h>
+
+#include "barnes-hut/common.h"
+#include "barnes-hut/profile.h"
+
+int
+sim_init(struct sim *sim, const struct options *opts, struct arena *arena)
+{
+	int res;
+
+	*sim = (struct sim) {
+		.opts	   = *opts,
+		.particles = NULL,
+		.sources   = { 0 },
+		.radius	   = opts->radius,
+	};
+	sim->tree.root	 = ARENA_NULL;
+	sim->tree.arena	 = arena;
+	sim->tree.packed = NULL;
+	sim->tree.theta	 = opts->theta;
+
+	if (sim->opts.solver == SOLVER_AUTO) {
+		const size_t crossover = direct_crossover(sim->opts.theta);
+		sim->opts.solver = (sim->opts.particles < crossover) ? SOLVER_DIRECT
+															  : SOLVER_TREE;
+		verbose_printf("using %s solver (direct below %zu particles).\n",
+			(sim->opts.solver == SOLVER_DIRECT) ? "direct" : "tree",
+			crossover);
+	}
+
+	if ((sim->opts.solver == SOLVER_DIRECT || sim->opts.accuracy)
+		&& (res = direct_init(&sim->sources, sim->opts.particles)))
+		return res;
+	if (sim->opts.packed) {
+		if ((res = particle_tree_packed_init(&sim->packed,
+				 sim->opts.particles)))
+			return res;
+		sim->tree.packed = &sim->packed;
+	}
+
+	return 0;
+}
+
+void
+sim_deinit(struct sim *sim)
+{
+	direct_deinit(&sim->sources);
+	if (sim->tree.packed != NULL)
+		arena_deinit(&sim->packed);
+}
+
+int
+sim_build(struct sim *sim, unsigned step)
+{
+	const bool direct = sim->opts.solver == SOLVER_DIRECT;
+	int res;
+
+	if (sim->opts.optimize && step % sim->opts.sort_every == 0) {
+		profile_enter(0, PHASE_SORT);
+		res = sort_particles(sim->particles, sim->opts.particles,
+			sim->opts.order, sim->radius);
+		if (unlikely(res))
+			return res;
+	}
+
+	// Packing the sources is the direct solver's counterpart to inserting.
+	if (direct || sim->opts.accuracy) {
+		profile_enter(0, PHASE_INSERT);
+		direct_pack(&sim->sources, sim->particles);
+	}
+	// The tree is also built for comparing its forces to direct summation.
+	if (!direct || sim->opts.accuracy) {
+		profile_enter(0, PHASE_INSERT);
+		res = particle_tree_insert(&sim->tree, sim->particles,
+			sim->opts.particles, sim->radius);
+		if (unlikely(res))
+			return res;
+
+		profile_enter(0, PHASE_CENTER);
+		particle_tree_center(&sim->tree);
+		if (sim->tree.packed != NULL
+			&& unlikely((res = particle_tree_pack(&sim->tree))))
+			return res;
+	}
+
+#ifdef STATS
+	if (sim->tree.arena->curr > sim->arena_peak)
+		sim->arena_peak = sim->tree.arena->curr;
+#endif // STATS
+
+	return 0;
+}
+
+void
+sim_diagnostics(const struct sim *sim, const struct particle_slice *slice,
+	struct diagnostics *diag)
+{
+	diagnostics_slice(&sim->tree,
+		(sim->opts.solver == SOLVER_DIRECT) ? &sim->sources : NULL, slice,
+		diag);
+}
+
+float
+sim_simulate(const struct sim *sim, const struct particle_slice *slice)
+{
+	return (sim->opts.solver == SOLVER_DIRECT)
+		? direct_simulate(&sim->sources, slice, sim->opts.dt)
+		: particle_tree_simulate(&sim->tree, slice, sim->opts.dt);
+}
@@ -0,0 +1,394 @@
+#define _XOPEN_SOURCE 700
+
+#include "barnes-hut/snapshot.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "barnes-hut/common.h"
+#include "barnes-hut/options.h"
+
+#define SNAPSHOT_SLOTS 2
+
+// The states of a snapshot buffer.
+enum slot_state {
+	// The buffer is unused and may be filled by the simulation.
+	SLOT_FREE,
+	// The buffer is being filled by the simulation.
+	SLOT_FILLING,
+	// The buffer is filled and waits for the writer thread.
+	SLOT_FULL,
+	// The buffer is being encoded and written by the writer thread.
+	SLOT_BUSY,
+};
+
+// A buffer holding a copy of all particle positions of a single step.
+struct slot {
+	enum slot_state state;
+	// The submission sequence number (for writing in submission order).
+	unsigned long seq;
+	unsigned step;
+	struct vec3 *positions;
+};
+
+// The global snapshot writer state.
+static struct {
+	FILE *file;
+	unsigned bits;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stop;
+	unsigned long seq;
+	struct slot slots[SNAPSHOT_SLOTS];
+	// The writer thread's Morton key buffers (keys and radix sort scratch).
+	uint64_t *keys;
+	uint64_t *scratch;
+	// The writer thread's output buffer for the coded deltas.
+	uint64_t *words;
+	// The statistics reported on exit.
+	unsigned long written;
+	unsigned long dropped;
+	unsigned long long bytes;
+} writer;
+
+static void *writer_main(void *args);
+static int write_frame(const struct slot *slot);
+static void radix_sort(uint64_t keys[], uint64_t scratch[], size_t len,
+	unsigned key_bits);
+static inline uint64_t quantize(float v, float min, float scale, float qmax);
+static inline uint64_t spread_bits(uint64_t x);
+
+// An LSB-first bit stream writer over 64-bit words.
+struct bit_writer {
+	uint64_t *words;
+	size_t len;
+	uint64_t acc;
+	unsigned bits;
+};
+
+// Appends the lowest `n` (at most 64) bits of `value`.
+static inline void
+bit_writer_put(struct bit_writer *bw, uint64_t value, unsigned n)
+{
+	bw->acc |= value << bw->bits;
+	if (bw->bits + n >= 64) {
+		bw->words[bw->len++] = bw->acc;
+		// The bits not fitting into the completed word (none if `bits` was 0).
+		bw->acc = (bw->bits > 0) ? value >> (64 - bw->bits) : 0;
+		bw->bits = bw->bits + n - 64;
+	} else
+		bw->bits += n;
+}
+
+// Appends the final partial word, if any.
+static inline void
+bit_writer_flush(struct bit_writer *bw)
+{
+	if (bw->bits > 0)
+		bw->words[bw->len++] = bw->acc;
+	bw->acc	 = 0;
+	bw->bits = 0;
+}
+
+int
+snapshot_init(const char *path, unsigned bits)
+{
+	int res;
+
+	if ((writer.file = fopen(path, "wb")) == NULL)
+		return errno;
+
+	writer.bits	   = bits;
+	writer.stop	   = false;
+	writer.seq	   = 0;
+	writer.written = writer.dropped = 0;
+	writer.bytes   = 0;
+
+	const size_t n = options.particles;
+	writer.keys	   = malloc(sizeof(uint64_t) * n);
+	writer.scratch = malloc(sizeof(uint64_t) * n);
+	// Each delta takes at most `SNAPSHOT_ESCAPE` + 64 bits, i.e., two words.
+	writer.words = malloc(sizeof(uint64_t) * 2 * (n + 1));
+	if (unlikely(writer.keys == NULL || writer.scratch == NULL
+			|| writer.words == NULL))
+		goto nomem;
+
+	for (unsigned s = 0; s < SNAPSHOT_SLOTS; s++) {
+		writer.slots[s].state	  = SLOT_FREE;
+		writer.slots[s].positions = malloc(sizeof(struct vec3) * n);
+		if (unlikely(writer.slots[s].positions == NULL))
+			goto nomem;
+	}
+
+	pthread_mutex_init(&writer.lock, NULL);
+	pthread_cond_init(&writer.cond, NULL);
+	if ((res = pthread_create(&writer.thread, NULL, writer_main, NULL))) {
+		pthread_cond_destroy(&writer.cond);
+		pthread_mutex_destroy(&writer.lock);
+		goto error;
+	}
+
+	return 0;
+
+nomem:
+	res = ENOMEM;
+error:
+	for (unsigned s = 0; s < SNAPSHOT_SLOTS; s++)
+		free(writer.slots[s].positions);
+	free(writer.words);
+	free(writer.scratch);
+	free(writer.keys);
+	fclose(writer.file);
+	writer.file = NULL;
+	return res;
+}
+
+void
+snapshot_deinit(void)
+{
+	if (writer.file == NULL)
+		return;
+
+	pthread_mutex_lock(&writer.lock);
+	writer.stop = true;
+	pthread_cond_signal(&writer.cond);
+	pthread_mutex_unlock(&writer.lock);
+	pthread_join(writer.thread, NULL);
+
+	pthread_cond_destroy(&writer.cond);
+	pthread_mutex_destroy(&writer.lock);
+
+	if (fclose(writer.file))
+		fprintf(stderr, "Failed to close snapshot file: %s\n", strerror(errno));
+	writer.file = NULL;
+
+	const double raw = (double)writer.written * options.particles
+		* sizeof(struct vec3);
+	verbose_printf("wrote %lu snapshots (%lu dropped), %llu bytes "
+				   "(%.2fx smaller than raw positions)\n",
+		writer.written, writer.dropped, writer.bytes,
+		(writer.bytes > 0) ? raw / (double)writer.bytes : 0.0);
+
+	for (unsigned s = 0; s < SNAPSHOT_SLOTS; s++)
+		free(writer.slots[s].positions);
+	free(writer.words);
+	free(writer.scratch);
+	free(writer.keys);
+}
+
+bool
+snapshot_submit(const struct particle particles[], unsigned step)
+{
+	struct slot *slot = NULL;
+
+	pthread_mutex_lock(&writer.lock);
+	for (unsigned s = 0; s < SNAPSHOT_SLOTS; s++)
+		if (writer.slots[s].state == SLOT_FREE) {
+			slot		= &writer.slots[s];
+			slot->state = SLOT_FILLING;
+			break;
+		}
+	if (slot == NULL)
+		writer.dropped += 1;
+	pthread_mutex_unlock(&writer.lock);
+
+	if (slot == NULL)
+		return false;
+
+	for (size_t p = 0; p < options.particles; p++)
+		slot->positions[p] = particles[p].part.pos;
+
+	pthread_mutex_lock(&writer.lock);
+	slot->state = SLOT_FULL;
+	slot->step	= step;
+	slot->seq	= writer.seq++;
+	pthread_cond_signal(&writer.cond);
+	pthread_mutex_unlock(&writer.lock);
+
+	return true;
+}
+
+static void *
+writer_main(void *args)
+{
+	int res;
+
+	pthread_mutex_lock(&writer.lock);
+	while (true) {
+		// Pick the oldest filled buffer.
+		struct slot *slot = NULL;
+		for (unsigned s = 0; s < SNAPSHOT_SLOTS; s++) {
+			struct slot *curr = &writer.slots[s];
+			if (curr->state == SLOT_FULL
+				&& (slot == NULL || curr->seq < slot->seq))
+				slot = curr;
+		}
+
+		if (slot == NULL) {
+			if (writer.stop)
+				break;
+			pthread_cond_wait(&writer.cond, &writer.lock);
+			continue;
+		}
+
+		slot->state = SLOT_BUSY;
+		pthread_mutex_unlock(&writer.lock);
+
+		if ((res = write_frame(slot)))
+			fprintf(stderr, "Failed to write snapshot for step %u: %s\n",
+				slot->step, strerror(res));
+
+		pthread_mutex_lock(&writer.lock);
+		slot->state = SLOT_FREE;
+	}
+	pthread_mutex_unlock(&writer.lock);
+
+	return NULL;
+}
+
+static int
+write_frame(const struct slot *slot)
+{
+	const size_t n = options.particles;
+
+	struct snapshot_frame frame = {
+		.magic	   = SNAPSHOT_MAGIC,
+		.version   = SNAPSHOT_VERSION,
+		.step	   = slot->step,
+		.bits	   = writer.bits,
+		.particles = n,
+		.min	   = { INFINITY, INFINITY, INFINITY },
+		.max	   = { -INFINITY, -INFINITY, -INFINITY },
+	};
+
+	for (size_t p = 0; p < n; p++) {
+		const float v[3] = { slot->positions[p].x, slot->positions[p].y,
+			slot->positions[p].z };
+		for (unsigned a = 0; a < 3; a++) {
+			frame.min[a] = fminf(frame.min[a], v[a]);
+			frame.max[a] = fmaxf(frame.max[a], v[a]);
+		}
+	}
+
+	// Quantize all positions relative to the bounding box and interleave the
+	// fixed-point coordinates into Morton keys.
+	const float qmax = (float)((1u << writer.bits) - 1);
+	float scale[3];
+	for (unsigned a = 0; a < 3; a++) {
+		const float extent = frame.max[a] - frame.min[a];
+		scale[a]		   = (extent > 0.0) ? qmax / extent : 0.0;
+	}
+
+	for (size_t p = 0; p < n; p++) {
+		const struct vec3 *v = &slot->positions[p];
+		const uint64_t x = quantize(v->x, frame.min[0], scale[0], qmax);
+		const uint64_t y = quantize(v->y, frame.min[1], scale[1], qmax);
+		const uint64_t z = quantize(v->z, frame.min[2], scale[2], qmax);
+		writer.keys[p]
+			= spread_bits(x) | (spread_bits(y) << 1) | (spread_bits(z) << 2);
+	}
+
+	// Sorting the keys turns them into small, roughly geometrically
+	// distributed deltas, for which Rice coding with a parameter close to
+	// the mean delta is near optimal.
+	radix_sort(writer.keys, writer.scratch, n, 3 * writer.bits);
+
+	const uint64_t mean = (n > 0) ? writer.keys[n - 1] / n : 0;
+	frame.rice_k		= 0;
+	while (frame.rice_k < 63 && ((uint64_t)2 << frame.rice_k) <= mean)
+		frame.rice_k += 1;
+
+	struct bit_writer bw = { .words = writer.words };
+	uint64_t prev		 = 0;
+	for (size_t p = 0; p < n; p++) {
+		const uint64_t delta = writer.keys[p] - prev;
+		const uint64_t q	 = delta >> frame.rice_k;
+		prev				 = writer.keys[p];
+
+		if (q < SNAPSHOT_ESCAPE) {
+			bit_writer_put(&bw, ((uint64_t)1 << q) - 1, q + 1);
+			if (frame.rice_k > 0)
+				bit_writer_put(&bw,
+					delta & (UINT64_MAX >> (64 - frame.rice_k)),
+					frame.rice_k);
+		} else {
+			bit_writer_put(&bw, ((uint64_t)1 << SNAPSHOT_ESCAPE) - 1,
+				SNAPSHOT_ESCAPE);
+			bit_writer_put(&bw, delta & UINT32_MAX, 32);
+			bit_writer_put(&bw, delta >> 32, 32);
+		}
+	}
+	bit_writer_flush(&bw);
+
+	frame.bytes = bw.len * sizeof(uint64_t);
+	if (fwrite(&frame, sizeof(frame), 1, writer.file) != 1
+		|| fwrite(writer.words, sizeof(uint64_t), bw.len, writer.file)
+			!= bw.len)
+		return EIO;
+	if (fflush(writer.file))
+		return errno;
+
+	writer.bytes += sizeof(frame) + frame.bytes;
+	writer.written += 1;
+	return 0;
+}
+
+// Sorts the keys with an LSD radix sort over the lowest `key_bits` bits.
+static void
+radix_sort(uint64_t keys[], uint64_t scratch[], size_t len, unsigned key_bits)
+{
+	uint64_t *src = keys;
+	uint64_t *dst = scratch;
+
+	for (unsigned shift = 0; shift < key_bits; shift += 8) {
+		size_t counts[256] = { 0 };
+		for (size_t i = 0; i < len; i++)
+			counts[(src[i] >> shift) & 0xff] += 1;
+
+		size_t offset = 0;
+		for (unsigned d = 0; d < 256; d++) {
+			const size_t count = counts[d];
+			counts[d]		   = offset;
+			offset += count;
+		}
+
+		for (size_t i = 0; i < len; i++)
+			dst[counts[(src[i] >> shift) & 0xff]++] = src[i];
+
+		uint64_t *tmp = src;
+		src			  = dst;
+		dst			  = tmp;
+	}
+
+	if (src != keys)
+		memcpy(keys, src, sizeof(uint64_t) * len);
+}
+
+// Returns the fixed-point coordinate of `v` within the box starting at `min`,
+// clamped to `qmax`, which the rounding of the box maximum may exceed.
+static inline uint64_t
+quantize(float v, float min, float scale, float qmax)
+{
+	const float q = (v - min) * scale + 0.5f;
+	return (uint64_t)((q < qmax) ? q : qmax);
+}
+
+// Spreads the lowest 21 bits of `x` so that two zero bits follow each bit.
+static inline uint64_t
+spread_bits(uint64_t x)
+{
+	x &= 0x1fffff;
+	x = (x | x << 32) & 0x1f00000000ffff;
+	x = (x | x << 16) & 0x1f0000ff0000ff;
+	x = (x | x << 8) & 0x100f00f00f00f00f;
+	x = (x | x << 4) & 0x10c30c30c30c30c3;
+	x = (x | x << 2) & 0x1249249249249249;
+	return x;
+}
@@ -0,0 +1,122 @@
+#define _XOPEN_SOURCE 700
+
+#include "barnes-hut/trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include "barnes-hut/options.h"
+#include "barnes-hut/profile.h"
+
+bool trace_enabled				   = false;
+struct trace_thread *trace_threads = NULL;
+
+// The global tracer state.
+static struct {
+	const char *path;
+	unsigned threads;
+} tracer = { NULL, 0 };
+
+int
+trace_init(const char *path, unsigned threads)
+{
+	trace_threads = aligned_alloc(64, sizeof(struct trace_thread) * threads);
+	if (unlikely(trace_threads == NULL))
+		return ENOMEM;
+
+	for (unsigned t = 0; t < threads; t++) {
+		trace_threads[t] = (struct trace_thread) { .len = 0 };
+		// The rings are first touched by their own threads.
+		trace_threads[t].events
+			= malloc(sizeof(struct trace_event) * TRACE_EVENTS);
+		if (unlikely(trace_threads[t].events == NULL)) {
+			while (t-- > 0)
+				free(trace_threads[t].events);
+			free(trace_threads);
+			return ENOMEM;
+		}
+	}
+
+	tracer.path	   = path;
+	tracer.threads = threads;
+	trace_enabled  = true;
+	return 0;
+}
+
+void
+trace_deinit(void)
+{
+	if (!trace_enabled)
+		return;
+	trace_enabled = false;
+
+	// All time stamps are relative to the earliest retained event.
+	uint64_t base = UINT64_MAX;
+	for (unsigned t = 0; t < tracer.threads; t++) {
+		const struct trace_thread *thread = &trace_threads[t];
+		if (thread->len == 0)
+			continue;
+		const uint64_t first
+			= (thread->len > TRACE_EVENTS) ? thread->len - TRACE_EVENTS : 0;
+		const uint64_t ns = thread->events[first & (TRACE_EVENTS - 1)].ns;
+		if (ns < base)
+			base = ns;
+	}
+
+	FILE *file = fopen(tracer.path, "w");
+	if (file == NULL) {
+		fprintf(stderr, "Failed to open trace file %s: %s\n", tracer.path,
+			strerror(errno));
+		goto out;
+	}
+
+	unsigned long spans = 0, dropped = 0;
+	fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+				  "\"args\":{\"name\":\"barnes-hut\"}}");
+	for (unsigned t = 0; t < tracer.threads; t++) {
+		const struct trace_thread *thread = &trace_threads[t];
+		fprintf(file,
+			",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+			"\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+			t, (t == 0) ? "main" : "worker", t);
+
+		// Each event's span ends with the thread's next event.
+		const uint64_t first
+			= (thread->len > TRACE_EVENTS) ? thread->len - TRACE_EVENTS : 0;
+		dropped += first;
+		for (uint64_t e = first; e + 1 < thread->len; e++) {
+			const struct trace_event *curr
+				= &thread->events[e & (TRACE_EVENTS - 1)];
+			const struct trace_event *next
+				= &thread->events[(e + 1) & (TRACE_EVENTS - 1)];
+			if (curr->phase >= PHASES)
+				continue;
+
+			fprintf(file,
+				",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+				"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"step\":%u}}",
+				profile_phase_name(curr->phase), t,
+				(double)(curr->ns - base) * 1e-3,
+				(double)(next->ns - curr->ns) * 1e-3, curr->step);
+			spans += 1;
+		}
+	}
+	fprintf(file, "\n]}\n");
+
+	if (fclose(file))
+		fprintf(stderr, "Failed to close trace file %s: %s\n", tracer.path,
+			strerror(errno));
+	else
+		verbose_printf("wrote %lu trace spans to %s (%lu events overwritten)\n",
+			spans, tracer.path, dropped);
+
+out:
+	for (unsigned t = 0; t < tracer.threads; t++)
+		free(trace_threads[t].events);
+	free(trace_threads);
+	trace_threads = NULL;
+}
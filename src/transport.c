@@ -0,0 +1,279 @@
+// Required for `MSG_DONTWAIT`, `MSG_NOSIGNAL` and `SOCK_CLOEXEC`.
+#define _DEFAULT_SOURCE
+
+#include "barnes-hut/transport.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "barnes-hut/common.h"
+
+// The number of attempts to connect to a rank that is not listening yet, 10
+// ms apart.
+#define CONNECT_ATTEMPTS 3000
+
+// The state of the Unix domain socket transport.
+struct unix_transport {
+	// The number of ranks.
+	unsigned len;
+	// The connection to each rank (-1 for this rank).
+	int fds[];
+};
+
+static int unix_exchange(struct transport *net, unsigned to, const void *sbuf,
+	size_t slen, unsigned from, void *rbuf, size_t rlen);
+static void unix_close(struct transport *net);
+
+static const struct transport_ops unix_ops = {
+	.exchange = unix_exchange,
+	.close	  = unix_close,
+};
+
+static int socket_path(struct sockaddr_un *addr, const char *dir,
+	unsigned rank);
+static int write_all(int fd, const void *buf, size_t len);
+static int read_all(int fd, void *buf, size_t len);
+
+int
+transport_open(struct transport *net, const char *spec, unsigned rank,
+	unsigned ranks)
+{
+	static const char prefix[] = "unix:";
+	int res;
+
+	if (strncmp(spec, prefix, sizeof(prefix) - 1) != 0) {
+		fprintf(stderr, "Unknown transport %s\n", spec);
+		return EINVAL;
+	}
+	const char *dir = spec + sizeof(prefix) - 1;
+
+	struct unix_transport *impl
+		= malloc(sizeof(struct unix_transport) + sizeof(int) * ranks);
+	if (unlikely(impl == NULL))
+		return ENOMEM;
+
+	impl->len = ranks;
+	for (unsigned r = 0; r < ranks; r++)
+		impl->fds[r] = -1;
+
+	*net = (struct transport) {
+		.rank  = rank,
+		.ranks = ranks,
+		.ops   = &unix_ops,
+		.impl  = impl,
+	};
+
+	struct sockaddr_un addr;
+	if ((res = socket_path(&addr, dir, rank))) {
+		free(impl);
+		return res;
+	}
+
+	// A stale socket of a previous run would keep the bind from succeeding.
+	(void)unlink(addr.sun_path);
+	const int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listener < 0) {
+		res = errno;
+		free(impl);
+		return res;
+	}
+	if (bind(listener, (struct sockaddr *)&addr, sizeof(addr))
+		|| listen(listener, (int)ranks)) {
+		res = errno;
+		goto fail;
+	}
+
+	// Each rank connects to all lower ranks, which may not be listening yet,
+	// and accepts the connections of all higher ones.
+	for (unsigned r = 0; r < rank; r++) {
+		struct sockaddr_un peer;
+		if ((res = socket_path(&peer, dir, r)))
+			goto fail;
+
+		for (unsigned attempt = 0;; attempt++) {
+			const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			if (fd < 0) {
+				res = errno;
+				goto fail;
+			}
+			if (connect(fd, (struct sockaddr *)&peer, sizeof(peer)) == 0) {
+				impl->fds[r] = fd;
+				break;
+			}
+
+			res = errno;
+			close(fd);
+			if ((res != ENOENT && res != ECONNREFUSED)
+				|| attempt == CONNECT_ATTEMPTS)
+				goto fail;
+
+			const struct timespec ts = { .tv_sec = 0, .tv_nsec = 10000000 };
+			nanosleep(&ts, NULL);
+		}
+
+		const uint32_t id = rank;
+		if ((res = write_all(impl->fds[r], &id, sizeof(id))))
+			goto fail;
+	}
+
+	for (unsigned r = rank + 1; r < ranks; r++) {
+		const int fd = accept(listener, NULL, NULL);
+		if (fd < 0) {
+			res = errno;
+			goto fail;
+		}
+
+		uint32_t id;
+		if ((res = read_all(fd, &id, sizeof(id)))) {
+			close(fd);
+			goto fail;
+		}
+		if (id <= rank || id >= ranks || impl->fds[id] != -1) {
+			fprintf(stderr, "Unexpected connection from rank %u\n", id);
+			close(fd);
+			res = EPROTO;
+			goto fail;
+		}
+		impl->fds[id] = fd;
+	}
+
+	close(listener);
+	(void)unlink(addr.sun_path);
+	return 0;
+
+fail:
+	close(listener);
+	(void)unlink(addr.sun_path);
+	unix_close(net);
+	return res;
+}
+
+static int
+unix_exchange(struct transport *net, unsigned to, const void *sbuf,
+	size_t slen, unsigned from, void *rbuf, size_t rlen)
+{
+	const struct unix_transport *impl = net->impl;
+	const int sfd					  = impl->fds[to];
+	const int rfd					  = impl->fds[from];
+
+	// Sending and receiving are interleaved, so exchanges in a ring of ranks
+	// progress even if the messages exceed the socket buffers.
+	size_t sent = 0, received = 0;
+	while (sent < slen || received < rlen) {
+		struct pollfd fds[2];
+		nfds_t len = 0;
+		if (sent < slen)
+			fds[len++] = (struct pollfd) { .fd = sfd, .events = POLLOUT };
+		if (received < rlen)
+			fds[len++] = (struct pollfd) { .fd = rfd, .events = POLLIN };
+
+		if (poll(fds, len, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+
+		for (nfds_t i = 0; i < len; i++) {
+			if (fds[i].revents == 0)
+				continue;
+
+			ssize_t n;
+			if (fds[i].events == POLLOUT)
+				n = send(sfd, (const char *)sbuf + sent, slen - sent,
+					MSG_DONTWAIT | MSG_NOSIGNAL);
+			else
+				n = recv(rfd, (char *)rbuf + received, rlen - received,
+					MSG_DONTWAIT);
+
+			if (n < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+					continue;
+				return errno;
+			}
+			if (n == 0 && fds[i].events == POLLIN)
+				// The peer closed its connection mid-exchange.
+				return ECONNRESET;
+
+			if (fds[i].events == POLLOUT)
+				sent += (size_t)n;
+			else
+				received += (size_t)n;
+		}
+	}
+
+	return 0;
+}
+
+static void
+unix_close(struct transport *net)
+{
+	struct unix_transport *impl = net->impl;
+	if (impl == NULL)
+		return;
+
+	for (unsigned r = 0; r < impl->len; r++)
+		if (impl->fds[r] >= 0)
+			close(impl->fds[r]);
+	free(impl);
+	net->impl = NULL;
+}
+
+static int
+socket_path(struct sockaddr_un *addr, const char *dir, unsigned rank)
+{
+	*addr = (struct sockaddr_un) { .sun_family = AF_UNIX };
+
+	const int len = snprintf(addr->sun_path, sizeof(addr->sun_path),
+		"%s/rank-%u.sock", dir, rank);
+	if (len < 0 || (size_t)len >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "Transport directory %s is too long\n", dir);
+		return ENAMETOOLONG;
+	}
+
+	return 0;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+	for (size_t done = 0; done < len;) {
+		const ssize_t n
+			= send(fd, (const char *)buf + done, len - done, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		done += (size_t)n;
+	}
+
+	return 0;
+}
+
+static int
+read_all(int fd, void *buf, size_t len)
+{
+	for (size_t done = 0; done < len;) {
+		const ssize_t n = recv(fd, (char *)buf + done, len - done, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		if (n == 0)
+			return ECONNRESET;
+		done += (size_t)n;
+	}
+
+	return 0;
+}
@@ -0,0 +1,183 @@
+// A reference reader for the shared memory feed of a running simulation
+// (`barnes-hut --shm=NAME`).
+//
+// Attaches to the feed, and for each newly completed frame computes the
+// center and extent of all positions in place (without copying them out of
+// the shared mapping), validating the result with the slot's sequence lock.
+//
+// Usage: shm-reader NAME [FRAMES]
+
+#define _XOPEN_SOURCE 700
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "barnes-hut/shm.h"
+
+// The statistics computed for a single frame.
+struct stats {
+	uint32_t step;
+	float radius;
+	uint64_t len;
+	struct vec3 center;
+	float extent;
+};
+
+static void
+msleep(unsigned ms)
+{
+	struct timespec ts
+		= { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000 };
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+// Returns `true` while the object of the given name is still the one mapped,
+// i.e., the simulation has neither exited nor been restarted.
+static bool
+feed_alive(const char *name, const struct stat *mapped)
+{
+	struct stat st;
+	const int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return false;
+
+	const bool alive = !fstat(fd, &st) && st.st_ino == mapped->st_ino;
+	close(fd);
+	return alive;
+}
+
+// Reads the given frame from its slot, returns `false` if the frame was
+// (partially) overwritten by a newer frame while reading.
+static bool
+read_frame(const struct shm_feed_header *header, const void *addr,
+	uint64_t frame, struct stats *stats)
+{
+	const struct shm_feed_slot *slot
+		= (const struct shm_feed_slot *)((const char *)addr + header->offset
+			+ (frame % header->slots) * header->slot_size);
+
+	const uint64_t seq
+		= atomic_load_explicit((_Atomic uint64_t *)&slot->seq,
+			memory_order_acquire);
+	if (seq != 2 * frame)
+		return false;
+
+	stats->step	  = slot->step;
+	stats->radius = slot->radius;
+	stats->len	  = slot->len;
+	if (stats->len > header->particles)
+		return false;
+
+	const struct vec3 *positions = (const struct vec3 *)(slot + 1);
+	double sum[3]				 = { 0.0, 0.0, 0.0 };
+	float extent				 = 0.0f;
+	for (uint64_t p = 0; p < stats->len; p++) {
+		const struct vec3 v = positions[p];
+		sum[0] += v.x;
+		sum[1] += v.y;
+		sum[2] += v.z;
+		extent = fmaxf(extent, sqrtf(v.x * v.x + v.y * v.y + v.z * v.z));
+	}
+
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit((_Atomic uint64_t *)&slot->seq,
+			memory_order_relaxed)
+		!= seq)
+		return false;
+
+	const double n = (stats->len > 0) ? (double)stats->len : 1.0;
+	stats->center  = (struct vec3) { sum[0] / n, sum[1] / n, sum[2] / n };
+	stats->extent  = extent;
+	return true;
+}
+
+int
+main(int argc, char *argv[argc])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s NAME [FRAMES]\n", argv[0]);
+		return EINVAL;
+	}
+
+	const char *name		= argv[1];
+	const unsigned long max = (argc > 2) ? strtoul(argv[2], NULL, 10) : 0;
+
+	const int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s: %s\n", name, strerror(errno));
+		return errno;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st)) {
+		fprintf(stderr, "Failed to stat %s: %s\n", name, strerror(errno));
+		return errno;
+	}
+
+	void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "Failed to map %s: %s\n", name, strerror(errno));
+		return errno;
+	}
+
+	const struct shm_feed_header *header = addr;
+	if (memcmp(header->magic, SHM_FEED_MAGIC, sizeof(SHM_FEED_MAGIC))
+		|| header->version != SHM_FEED_VERSION
+		|| header->offset + header->slots * header->slot_size
+			> (uint64_t)st.st_size) {
+		fprintf(stderr, "Invalid shared memory feed %s\n", name);
+		return EINVAL;
+	}
+	atomic_thread_fence(memory_order_acquire);
+
+	printf("frame,step,radius,particles,cx,cy,cz,extent,skipped\n");
+
+	uint64_t last	   = 0;
+	unsigned long read = 0, retries = 0, idle = 0;
+	while (max == 0 || read < max) {
+		const uint64_t latest = atomic_load_explicit(
+			(_Atomic uint64_t *)&header->latest, memory_order_acquire);
+		if (latest == last) {
+			if (++idle % 1000 == 0 && !feed_alive(name, &st))
+				break;
+			msleep(1);
+			continue;
+		}
+		idle = 0;
+
+		struct stats stats;
+		if (!read_frame(header, addr, latest, &stats)) {
+			// Lapped by the simulation, retry with the then latest frame.
+			retries += 1;
+			continue;
+		}
+
+		const uint64_t skipped = (last > 0) ? latest - last - 1 : 0;
+		printf("%lu,%u,%.3f,%lu,%.3f,%.3f,%.3f,%.3f,%lu\n",
+			(unsigned long)latest, stats.step, stats.radius,
+			(unsigned long)stats.len, stats.center.x, stats.center.y,
+			stats.center.z, stats.extent, (unsigned long)skipped);
+		fflush(stdout);
+
+		last = latest;
+		read += 1;
+	}
+
+	fprintf(stderr, "read %lu frames (%lu torn reads retried)\n", read,
+		retries);
+	munmap(addr, st.st_size);
+	return 0;
+}
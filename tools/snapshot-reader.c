@@ -0,0 +1,316 @@
+// A reference decoder for snapshot files (`barnes-hut --snapshot=FILE`).
+//
+// Decodes every frame and prints its step, particle count, size and bounding
+// box, or with `-p` the dequantized positions of all particles (in Morton
+// order). Given a checkpoint written at the same point of the simulation
+// (`--checkpoint-every` dividing `step + 1` of a snapshot step), the
+// checkpoint's positions are quantized like the writer does and compared
+// against the decoded frame, which checks the round trip.
+//
+// Usage: snapshot-reader [-p] FILE [CHECKPOINT]
+
+#define _XOPEN_SOURCE 700
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "barnes-hut/checkpoint.h"
+#include "barnes-hut/snapshot.h"
+
+// An LSB-first bit stream reader over 64-bit words.
+struct bit_reader {
+	const uint64_t *words;
+	size_t len;
+	size_t pos;
+	bool overrun;
+};
+
+// Returns the next `n` (at most 64) bits.
+static uint64_t
+bit_reader_get(struct bit_reader *br, unsigned n)
+{
+	uint64_t value = 0;
+
+	for (unsigned i = 0; i < n;) {
+		if (br->pos >= br->len * 64) {
+			br->overrun = true;
+			return 0;
+		}
+
+		const unsigned off	= br->pos % 64;
+		const unsigned take = (n - i < 64 - off) ? n - i : 64 - off;
+		const uint64_t mask = (take == 64) ? UINT64_MAX
+										   : ((uint64_t)1 << take) - 1;
+		value |= ((br->words[br->pos / 64] >> off) & mask) << i;
+		i += take;
+		br->pos += take;
+	}
+
+	return value;
+}
+
+// Compacts every third bit of `x` into its lowest 21 bits.
+static uint64_t
+compact_bits(uint64_t x)
+{
+	x &= 0x1249249249249249;
+	x = (x | x >> 2) & 0x10c30c30c30c30c3;
+	x = (x | x >> 4) & 0x100f00f00f00f00f;
+	x = (x | x >> 8) & 0x1f0000ff0000ff;
+	x = (x | x >> 16) & 0x1f00000000ffff;
+	x = (x | x >> 32) & 0x1fffff;
+	return x;
+}
+
+// Returns the fixed-point coordinate of `v` within the box starting at `min`
+// (clamped to `qmax` as the writer does).
+static uint64_t
+quantize(float v, float min, float scale, float qmax)
+{
+	const float q = (v - min) * scale + 0.5f;
+	return (uint64_t)((q < qmax) ? q : qmax);
+}
+
+// Spreads the lowest 21 bits of `x` so that two zero bits follow each bit
+// (as the writer does).
+static uint64_t
+spread_bits(uint64_t x)
+{
+	x &= 0x1fffff;
+	x = (x | x << 32) & 0x1f00000000ffff;
+	x = (x | x << 16) & 0x1f0000ff0000ff;
+	x = (x | x << 8) & 0x100f00f00f00f00f;
+	x = (x | x << 4) & 0x10c30c30c30c30c3;
+	x = (x | x << 2) & 0x1249249249249249;
+	return x;
+}
+
+// Decodes the Rice coded deltas of a frame into ascending Morton keys.
+static int
+decode_keys(const struct snapshot_frame *frame, const uint64_t words[],
+	uint64_t keys[])
+{
+	struct bit_reader br = { .words = words, .len = frame->bytes / 8 };
+	uint64_t prev		 = 0;
+
+	for (uint64_t p = 0; p < frame->particles; p++) {
+		unsigned q = 0;
+		while (q < SNAPSHOT_ESCAPE && bit_reader_get(&br, 1))
+			q++;
+
+		uint64_t delta;
+		if (q == SNAPSHOT_ESCAPE) {
+			delta = bit_reader_get(&br, 32);
+			delta |= bit_reader_get(&br, 32) << 32;
+		} else
+			delta = ((uint64_t)q << frame->rice_k)
+				| bit_reader_get(&br, frame->rice_k);
+
+		if (br.overrun)
+			return EINVAL;
+		prev += delta;
+		keys[p] = prev;
+	}
+
+	// Only the padding of the final word may remain.
+	return (br.len * 64 - br.pos < 64) ? 0 : EINVAL;
+}
+
+static int
+compare_keys(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a;
+	const uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Quantizes the positions of the checkpoint like the writer does and returns
+// the number of keys differing from the decoded ones.
+static size_t
+check_round_trip(const struct snapshot_frame *frame, const uint64_t keys[],
+	const struct particle particles[], uint64_t scratch[])
+{
+	const float qmax = (float)((1u << frame->bits) - 1);
+	float scale[3];
+	for (unsigned a = 0; a < 3; a++) {
+		const float extent = frame->max[a] - frame->min[a];
+		scale[a]		   = (extent > 0.0) ? qmax / extent : 0.0;
+	}
+
+	for (uint64_t p = 0; p < frame->particles; p++) {
+		const struct vec3 *v = &particles[p].part.pos;
+		const uint64_t x = quantize(v->x, frame->min[0], scale[0], qmax);
+		const uint64_t y = quantize(v->y, frame->min[1], scale[1], qmax);
+		const uint64_t z = quantize(v->z, frame->min[2], scale[2], qmax);
+		scratch[p]
+			= spread_bits(x) | (spread_bits(y) << 1) | (spread_bits(z) << 2);
+	}
+	qsort(scratch, frame->particles, sizeof(uint64_t), compare_keys);
+
+	size_t diff = 0;
+	for (uint64_t p = 0; p < frame->particles; p++)
+		diff += scratch[p] != keys[p];
+	return diff;
+}
+
+// Reads the particles of the given checkpoint.
+static int
+read_checkpoint(const char *path, struct checkpoint_header *header,
+	struct particle **particles)
+{
+	int res = 0;
+
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return errno;
+
+	if (fread(header, sizeof(*header), 1, file) != 1
+		|| memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC))
+		|| header->particle_size != sizeof(struct particle)
+		|| header->offset < sizeof(*header)
+		|| fseek(file, (long)header->offset, SEEK_SET)) {
+		res = EINVAL;
+		goto out;
+	}
+
+	*particles = malloc(sizeof(struct particle) * header->particles);
+	if (*particles == NULL) {
+		res = ENOMEM;
+		goto out;
+	}
+	if (fread(*particles, sizeof(struct particle), header->particles, file)
+		!= header->particles) {
+		free(*particles);
+		res = EINVAL;
+	}
+
+out:
+	fclose(file);
+	return res;
+}
+
+int
+main(int argc, char *argv[argc])
+{
+	struct checkpoint_header checkpoint = { 0 };
+	struct particle *particles			= NULL;
+	bool print							= false;
+	bool checked						= false;
+	int res								= 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p")) != -1)
+		if (opt == 'p')
+			print = true;
+		else
+			goto usage;
+	if (optind >= argc || argc - optind > 2)
+		goto usage;
+
+	const char *path = argv[optind];
+	if (argc - optind == 2
+		&& (res = read_checkpoint(argv[optind + 1], &checkpoint, &particles))) {
+		fprintf(stderr, "Failed to read checkpoint %s: %s\n",
+			argv[optind + 1], strerror(res));
+		return 1;
+	}
+
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	struct snapshot_frame frame;
+	uint64_t *words = NULL, *keys = NULL, *scratch = NULL;
+	while (fread(&frame, sizeof(frame), 1, file) == 1) {
+		if (memcmp(frame.magic, SNAPSHOT_MAGIC, sizeof(frame.magic))
+			|| frame.version != SNAPSHOT_VERSION || frame.bits == 0
+			|| frame.bits > 21 || frame.rice_k > 63 || frame.bytes % 8 != 0) {
+			fprintf(stderr, "Invalid snapshot frame in %s\n", path);
+			res = EINVAL;
+			break;
+		}
+
+		words	= realloc(words, frame.bytes);
+		keys	= realloc(keys, sizeof(uint64_t) * frame.particles);
+		scratch = realloc(scratch, sizeof(uint64_t) * frame.particles);
+		if ((frame.bytes > 0 && words == NULL)
+			|| (frame.particles > 0 && (keys == NULL || scratch == NULL))) {
+			res = ENOMEM;
+			break;
+		}
+
+		if (fread(words, 1, frame.bytes, file) != frame.bytes
+			|| decode_keys(&frame, words, keys)) {
+			fprintf(stderr, "Corrupt snapshot frame for step %u in %s\n",
+				frame.step, path);
+			res = EINVAL;
+			break;
+		}
+
+		const double raw = (double)frame.particles * sizeof(struct vec3);
+		const double coded = (double)(sizeof(frame) + frame.bytes);
+		if (!print)
+			printf("step %u: %llu particles, %.0f bytes (%.2fx), "
+				   "box [%g, %g] x [%g, %g] x [%g, %g]\n",
+				frame.step, (unsigned long long)frame.particles, coded,
+				raw / coded, frame.min[0], frame.max[0], frame.min[1],
+				frame.max[1], frame.min[2], frame.max[2]);
+		else
+			for (uint64_t p = 0; p < frame.particles; p++) {
+				float pos[3];
+				for (unsigned a = 0; a < 3; a++) {
+					const uint64_t q = compact_bits(keys[p] >> a);
+					pos[a]			 = frame.min[a]
+						+ (float)q * (frame.max[a] - frame.min[a])
+							/ (float)((1u << frame.bits) - 1);
+				}
+				printf("%u %g %g %g\n", frame.step, pos[0], pos[1], pos[2]);
+			}
+
+		// A checkpoint stores the step following the one it was written
+		// after.
+		if (particles != NULL && frame.step + 1 == checkpoint.step) {
+			if (frame.particles != checkpoint.particles) {
+				fprintf(stderr, "round trip of step %u: %llu particles, "
+								"checkpoint has %llu\n",
+					frame.step, (unsigned long long)frame.particles,
+					(unsigned long long)checkpoint.particles);
+				res = EINVAL;
+				break;
+			}
+
+			const size_t diff
+				= check_round_trip(&frame, keys, particles, scratch);
+			fprintf(stderr, "round trip of step %u: %zu of %llu keys differ\n",
+				frame.step, diff, (unsigned long long)frame.particles);
+			if (diff > 0)
+				res = EINVAL;
+			checked = true;
+		}
+	}
+
+	if (!res && particles != NULL && !checked) {
+		fprintf(stderr, "No snapshot frame for the checkpoint's step %u\n",
+			checkpoint.step - 1);
+		res = EINVAL;
+	}
+
+	free(scratch);
+	free(keys);
+	free(words);
+	free(particles);
+	fclose(file);
+	return (res) ? 1 : 0;
+
+usage:
+	fprintf(stderr, "Usage: %s [-p] FILE [CHECKPOINT]\n", argv[0]);
+	return 1;
+}